@@ -0,0 +1,685 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pty.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "../atcd/atcproc.h"
+#include "../atcd/cmdqueue.h"
+#include "../atcd/gameclock.h"
+#include "../atcd/latency.h"
+#include "../shared/monotime.h"
+
+
+
+static const struct option longopts[] = {
+	{"atc", required_argument, 0, 'a'},
+	{"games", required_argument, 0, 'n'},
+	{"jobs", required_argument, 0, 'j'},
+	{"bot", required_argument, 0, 'b'},
+	{"input", required_argument, 0, 'i'},
+	{"time-limit", required_argument, 0, 't'},
+	{"time-shim", required_argument, 0, 'V'},
+	{"speed", required_argument, 0, 'x'},
+	{"no-pin", no_argument, 0, 'P'},
+	{nullptr, 0, 0, 0}
+};
+
+static const char shortopts[] = "a:n:j:b:i:t:V:x:P";
+
+/* How a game ended. */
+enum result {
+	RESULT_ENDED,
+	RESULT_LOST,
+	RESULT_TIME_LIMIT,
+	RESULT_FAILED,
+};
+
+/* What a worker tells the parent about its game, in one write to a pipe. */
+struct report {
+	enum result result;
+
+	/* The real time the game ran for, and the game updates delivered (zero without the time shim). */
+	uint64_t duration, updates;
+
+	/* Commands accepted into the queue, and input lines rejected as invalid or for want of room. */
+	unsigned long commands, rejected;
+
+	/* Bytes of screen output the bot did not read in time and missed. */
+	unsigned long dropped;
+
+	/* The time from a command being issued to its delivery to ATC. */
+	struct latency_summary latency;
+
+	/* The game's own message about how it ended, or what went wrong. */
+	char outcome[128];
+};
+
+/* A scripted command: the game time at which to send it, in nanoseconds, and the line to send. */
+struct scripted {
+	uint64_t at;
+	char command[32];
+};
+
+/* The game to play and how to drive it, shared by every worker. */
+static const char *game = nullptr;
+static const char *bot = nullptr;
+static struct scripted *script = nullptr;
+static size_t script_count = 0;
+static uint64_t time_limit = 0;
+static const char *time_shim = nullptr;
+static unsigned int game_speed = 1;
+
+/* Set by the death callback once ATC has exited. */
+static volatile sig_atomic_t has_atc_exited = 0;
+
+
+
+static void atc_died(void) {
+	has_atc_exited = 1;
+}
+
+
+
+/* Loads a script of "<seconds> <command>" lines, ignoring blank lines and # comments. Returns true on success, false on failure. */
+static bool load_script(const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return false;
+	}
+	char line[256];
+	unsigned int lineno = 0;
+	size_t alloc = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		const char *p = line + strspn(line, " \t");
+		if (!*p || *p == '#')
+			continue;
+		char *endptr;
+		double seconds = strtod(p, &endptr);
+		bool has_seconds = endptr != p;
+		p = endptr + strspn(endptr, " \t");
+		if (!has_seconds || !(seconds >= 0) || (*endptr != ' ' && *endptr != '\t') || !*p || strlen(p) + 2 > sizeof(script->command)) {
+			fprintf(stderr, "%s:%u: expected \"<seconds> <command>\"\n", path, lineno);
+			fclose(fp);
+			return false;
+		}
+		if (script_count == alloc) {
+			size_t new_alloc = alloc ? alloc * 2 : 64;
+			struct scripted *new = realloc(script, new_alloc * sizeof(*script));
+			if (!new) {
+				perror("malloc");
+				fclose(fp);
+				return false;
+			}
+			script = new;
+			alloc = new_alloc;
+		}
+		struct scripted *entry = &script[script_count++];
+		entry->at = (uint64_t) (seconds * 1e9);
+		snprintf(entry->command, sizeof(entry->command), "%s\n", p);
+	}
+	fclose(fp);
+	return true;
+}
+
+
+
+/* The state of one worker's game. */
+static struct report report;
+
+/* The master side of ATC's terminal, and the pipes to and from the bot (or -1). */
+static int screen_fd = -1, bot_in = -1, bot_out = -1;
+static pid_t bot_pid = -1;
+
+/* Partial line of bot output. */
+static char bot_line[64];
+static size_t bot_line_length = 0;
+
+/* When each queued command was issued, oldest first, until its delivery is seen. */
+static uint64_t issued[CMDQUEUE_MAX];
+static size_t issued_count = 0;
+
+/* The tail of the screen output with escape sequences stripped, where cursor positioning and carriage returns become line breaks. */
+static char text[2048];
+static size_t text_length = 0;
+
+/* Where the escape sequence stripper is: in plain text, after ESC, or inside a control sequence. */
+static enum { TEXT, ESCAPE, CONTROL } text_state = TEXT;
+
+/* Whether the game has asked for space to be hit at the end. */
+static bool game_over = false;
+
+
+
+/* Queues a command issued at a given time. */
+static void issue(const char *command, uint64_t when) {
+	cmdqueue_owner superseded;
+	if (!cmdqueue_push(command, PLANES_ALL, 1, 0, &superseded)) {
+		report.rejected++;
+		return;
+	}
+	report.commands++;
+
+	/* A command that replaces an undelivered one keeps the older one's issue time, so its latency is never understated; while ATC is not keeping up, the issue times that do not fit are not sampled. */
+	if (!superseded && issued_count < CMDQUEUE_MAX)
+		issued[issued_count++] = when;
+}
+
+
+
+/* Delivers what the pipe will take, recording latencies once everything issued has gone. */
+static void flush_commands(uint64_t now) {
+	if (cmdqueue_is_empty())
+		return;
+	cmdqueue_flush(now);
+	if (cmdqueue_is_empty()) {
+		for (size_t i = 0; i < issued_count; i++)
+			latency_record(now - issued[i]);
+		issued_count = 0;
+	}
+}
+
+
+
+/* Appends a character to the stripped screen text, dropping the older half when full. */
+static void text_append(char ch) {
+	if (ch == '\n' && text_length && text[text_length - 1] == '\n')
+		return;
+	if (text_length == sizeof(text) - 1) {
+		memmove(text, text + sizeof(text) / 2, text_length - sizeof(text) / 2);
+		text_length -= sizeof(text) / 2;
+	}
+	text[text_length++] = ch;
+	text[text_length] = '\0';
+}
+
+
+
+/* Handles screen output from ATC: strips it into the text tail, notices the end of the game, and passes it on to the bot. */
+static void handle_screen(const char *data, size_t length, uint64_t now) {
+	for (size_t i = 0; i < length; i++) {
+		unsigned char ch = (unsigned char) data[i];
+		switch (text_state) {
+			case TEXT:
+				if (ch == 0x1b)
+					text_state = ESCAPE;
+				else if (ch == '\r' || ch == '\n')
+					text_append('\n');
+				else if (ch >= 0x20 && ch != 0x7f)
+					text_append((char) ch);
+				break;
+
+			case ESCAPE:
+				text_state = ch == '[' ? CONTROL : TEXT;
+				break;
+
+			case CONTROL:
+				if (ch >= 0x40 && ch <= 0x7e) {
+					if (ch == 'H' || ch == 'f')
+						text_append('\n');
+					text_state = TEXT;
+				}
+				break;
+		}
+	}
+
+	/* When a plane is lost, ATC waits for space to be hit before showing the scores and exiting. */
+	if (!game_over && strstr(text, "Hit space")) {
+		game_over = true;
+		issue(" ", now);
+	}
+
+	if (bot_in >= 0) {
+		ssize_t ret = write(bot_in, data, length);
+		if (ret < 0 && errno == EPIPE) {
+			close(bot_in);
+			bot_in = -1;
+		} else {
+			report.dropped += ret < 0 ? length : length - (size_t) ret;
+		}
+	}
+}
+
+
+
+/* Reads whatever ATC has drawn. */
+static void read_screen(uint64_t now) {
+	for (;;) {
+		char buffer[4096];
+		ssize_t ret = read(screen_fd, buffer, sizeof(buffer));
+		if (ret > 0)
+			handle_screen(buffer, (size_t) ret, now);
+		else if (ret < 0 && errno == EINTR)
+			continue;
+		else
+			return;
+	}
+}
+
+
+
+/* Reads commands from the bot, one per line. */
+static void read_bot(uint64_t now) {
+	for (;;) {
+		char buffer[256];
+		ssize_t ret = read(bot_out, buffer, sizeof(buffer));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret == 0) {
+				close(bot_out);
+				bot_out = -1;
+			}
+			return;
+		}
+		for (ssize_t i = 0; i < ret; i++) {
+			if (buffer[i] != '\n') {
+				if (bot_line_length < sizeof(bot_line) - 2)
+					bot_line[bot_line_length] = buffer[i];
+				bot_line_length++;
+				continue;
+			}
+			if (bot_line_length && bot_line_length < sizeof(bot_line) - 2) {
+				bot_line[bot_line_length++] = '\n';
+				bot_line[bot_line_length] = '\0';
+				issue(bot_line, now);
+			} else if (bot_line_length) {
+				report.rejected++;
+			}
+			bot_line_length = 0;
+		}
+	}
+}
+
+
+
+/* Runs the bot, with the screen on its standard input and commands read from its standard output. Returns true on success, false on failure. */
+static bool start_bot(int err_fd) {
+	int to_bot[2], from_bot[2];
+	if (pipe2(to_bot, O_CLOEXEC) < 0)
+		return false;
+	if (pipe2(from_bot, O_CLOEXEC) < 0) {
+		close(to_bot[0]);
+		close(to_bot[1]);
+		return false;
+	}
+	bot_pid = fork();
+	if (bot_pid == 0) {
+		if (dup2(to_bot[0], 0) < 0 || dup2(from_bot[1], 1) < 0 || dup2(err_fd, 2) < 0)
+			_exit(127);
+		execl("/bin/sh", "sh", "-c", bot, (char *) nullptr);
+		_exit(127);
+	}
+	close(to_bot[0]);
+	close(from_bot[1]);
+	if (bot_pid < 0) {
+		close(to_bot[1]);
+		close(from_bot[0]);
+		return false;
+	}
+	bot_in = to_bot[1];
+	bot_out = from_bot[0];
+	fcntl(bot_in, F_SETFL, O_NONBLOCK);
+	fcntl(bot_out, F_SETFL, O_NONBLOCK);
+	return true;
+}
+
+
+
+/* Fills in the report for a game that could not be run. */
+static void fail(const char *what) {
+	report.result = RESULT_FAILED;
+	snprintf(report.outcome, sizeof(report.outcome), "%s: %s", what, strerror(errno));
+}
+
+
+
+/* Plays one game in a worker process, on a CPU if one is given, and fills in the report. */
+static void play(int cpu) {
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			fail("sched_setaffinity");
+			return;
+		}
+	}
+
+	/* Give ATC a terminal of its own to draw on; the bot gets our original standard error for its messages. */
+	int err_fd = fcntl(2, F_DUPFD_CLOEXEC, 3);
+	int slave;
+	struct winsize size = {.ws_row = 24, .ws_col = 80};
+	if (openpty(&screen_fd, &slave, nullptr, nullptr, &size) < 0) {
+		fail("openpty");
+		return;
+	}
+	if (dup2(slave, 1) < 0 || dup2(slave, 2) < 0) {
+		fail("dup2");
+		return;
+	}
+	close(slave);
+	fcntl(screen_fd, F_SETFD, FD_CLOEXEC);
+	fcntl(screen_fd, F_SETFL, O_NONBLOCK);
+
+	if (bot && !start_bot(err_fd)) {
+		fail("bot");
+		return;
+	}
+	if (time_shim && !gameclock_init(time_shim, game_speed)) {
+		fail("time shim");
+		return;
+	}
+	atcproc_set_cb(&atc_died);
+	cmdqueue_set_delay(0);
+	if (!atcproc_start(game)) {
+		fail("atc");
+		return;
+	}
+
+	uint64_t start = monotime_now();
+	size_t next_scripted = 0;
+	for (;;) {
+		/* Issue scripted commands that are due, deliver commands and time the game. */
+		uint64_t now = monotime_now();
+		while (next_scripted < script_count && start + script[next_scripted].at / game_speed <= now) {
+			issue(script[next_scripted].command, start + script[next_scripted].at / game_speed);
+			next_scripted++;
+		}
+		flush_commands(now);
+		gameclock_run(now);
+		if (time_limit && now >= start + time_limit) {
+			if (atcproc_stop()) {
+				report.result = RESULT_TIME_LIMIT;
+				snprintf(report.outcome, sizeof(report.outcome), "time limit reached");
+				break;
+			}
+		}
+
+		/* Work out when something next needs doing. */
+		uint64_t due = UINT64_MAX, when;
+		if (next_scripted < script_count)
+			due = start + script[next_scripted].at / game_speed;
+		if (!cmdqueue_is_blocked() && cmdqueue_next_due(&when) && when < due)
+			due = when;
+		if (gameclock_next_due(now, &when) && when < due)
+			due = when;
+		if (time_limit && start + time_limit < due)
+			due = start + time_limit;
+		struct timespec timeout = monotime_to_timespec(due > now ? due - now : 0);
+
+		struct pollfd pollfds[3];
+		nfds_t count = 0;
+		pollfds[count++] = (struct pollfd) {.fd = screen_fd, .events = POLLIN};
+		pollfds[count++] = (struct pollfd) {.fd = bot_out, .events = POLLIN};
+		pollfds[count++] = (struct pollfd) {.fd = cmdqueue_is_blocked() ? atcproc_get_fd() : -1, .events = POLLOUT};
+
+		/* Careful! Manage the race between polling and getting SIGCHLD, or the game arming its timer after the deadline above was worked out, which calls for going round again. */
+		sigset_t mask, oldmask;
+		sigfillset(&mask);
+		sigprocmask(SIG_BLOCK, &mask, &oldmask);
+		bool exited = has_atc_exited;
+		bool woken = gameclock_take_wakeup();
+		if (!exited && !woken && ppoll(pollfds, count, due != UINT64_MAX ? &timeout : nullptr, &oldmask) < 0 && errno != EINTR) {
+			sigprocmask(SIG_SETMASK, &oldmask, nullptr);
+			fail("ppoll");
+			atcproc_stop();
+			break;
+		}
+		sigprocmask(SIG_SETMASK, &oldmask, nullptr);
+
+		now = monotime_now();
+		read_screen(now);
+		if (exited)
+			break;
+		if (bot_out >= 0)
+			read_bot(now);
+	}
+
+	/* Describe how the game ended, going by ATC's message if it lost a plane. */
+	report.duration = monotime_now() - start;
+	if (gameclock_enabled()) {
+		unsigned int speed;
+		gameclock_get_stats(&speed, &report.updates);
+	}
+	latency_get_summary(&report.latency);
+	if (!report.outcome[0]) {
+		const char *plane = strstr(text, "Plane '");
+		if (game_over && plane) {
+			report.result = RESULT_LOST;
+			snprintf(report.outcome, sizeof(report.outcome), "%.*s", (int) strcspn(plane, "\n"), plane);
+		} else {
+			report.result = RESULT_ENDED;
+			snprintf(report.outcome, sizeof(report.outcome), "game ended");
+		}
+	}
+}
+
+
+
+/* Formats nanoseconds as microseconds. */
+static unsigned long long us(uint64_t ns) {
+	return (unsigned long long) (ns / 1000u);
+}
+
+
+
+/* A running worker. */
+struct worker {
+	pid_t pid;
+	int fd;
+	unsigned int game;
+	int cpu;
+};
+
+
+
+/* Starts a worker to play a game on a CPU. Returns true on success, false on failure. */
+static bool start_worker(struct worker *worker, unsigned int index, int cpu) {
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		perror("pipe2");
+		return false;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		play(cpu);
+		if (bot_pid > 0)
+			kill(bot_pid, SIGTERM);
+		[[maybe_unused]] ssize_t ssz = write(fds[1], &report, sizeof(report));
+		_exit(EXIT_SUCCESS);
+	}
+	close(fds[1]);
+	*worker = (struct worker) {.pid = pid, .fd = fds[0], .game = index, .cpu = cpu};
+	return true;
+}
+
+
+
+int main(int argc, char **argv) {
+	/* Scan command-line options. */
+	unsigned long games = 1, jobs = 0;
+	const char *input_path = nullptr;
+	bool pin = true;
+	int ret;
+	while ((ret = getopt_long(argc, argv, shortopts, longopts, 0)) >= 0) {
+		switch (ret) {
+			case 'a':
+				atcproc_set_binary(optarg);
+				break;
+
+			case 'b':
+				bot = optarg;
+				break;
+
+			case 'i':
+				input_path = optarg;
+				break;
+
+			case 'V':
+				time_shim = optarg;
+				break;
+
+			case 'P':
+				pin = false;
+				break;
+
+			case 'n':
+			case 'j':
+			case 't':
+			case 'x': {
+				char *endptr;
+				unsigned long value = strtoul(optarg, &endptr, 10);
+				if (!*optarg || *endptr || value == 0 || value > (ret == 'x' ? GAMECLOCK_SPEED_MAX : 1000000u)) {
+					fprintf(stderr, "%s: invalid %s: %s\n", argv[0], ret == 'n' ? "game count" : ret == 'j' ? "job count" : ret == 't' ? "time limit" : "game speed", optarg);
+					return EXIT_FAILURE;
+				}
+				if (ret == 'n')
+					games = value;
+				else if (ret == 'j')
+					jobs = value;
+				else if (ret == 't')
+					time_limit = value * 1000000000u;
+				else
+					game_speed = value;
+				break;
+			}
+
+			default:
+				fprintf(stderr, "%s: unrecognized argument\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc - 1 || (bot && input_path) || (game_speed != 1 && !time_shim)) {
+		fprintf(stderr, "Usage: %s [--atc PATH] [--games N] [--jobs N] [--no-pin] [--bot COMMAND | --input SCRIPT] [--time-limit SECONDS] [--time-shim LIBRARY [--speed N]] [GAME]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	game = optind < argc ? argv[optind] : nullptr;
+	if (input_path && !load_script(input_path))
+		return EXIT_FAILURE;
+	setenv("TERM", "vt100", 0);
+
+	/* Spread the workers over the CPUs we may run on, one game per CPU at a time by default. */
+	cpu_set_t allowed;
+	int cpus[CPU_SETSIZE], cpu_count = 0;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		perror("sched_getaffinity");
+		return EXIT_FAILURE;
+	}
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &allowed))
+			cpus[cpu_count++] = cpu;
+	if (!jobs)
+		jobs = (unsigned long) cpu_count;
+	if (jobs > games)
+		jobs = games;
+	struct worker *workers = calloc(jobs, sizeof(*workers));
+	struct pollfd *pollfds = calloc(jobs, sizeof(*pollfds));
+	if (!workers || !pollfds) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	for (size_t slot = 0; slot < jobs; slot++)
+		workers[slot].pid = -1;
+
+	/* Keep every slot busy until all the games have been played, reporting each as it finishes. */
+	uint64_t start = monotime_now();
+	unsigned long started = 0, finished = 0, results[RESULT_FAILED + 1] = {0};
+	unsigned long commands = 0, rejected = 0;
+	uint64_t updates = 0, worst_p99 = 0, worst_max = 0;
+	while (finished < games) {
+		for (size_t slot = 0; slot < jobs && started < games; slot++) {
+			if (workers[slot].pid >= 0)
+				continue;
+			if (!start_worker(&workers[slot], (unsigned int) started + 1, pin ? cpus[slot % (size_t) cpu_count] : -1))
+				return EXIT_FAILURE;
+			started++;
+		}
+
+		for (size_t slot = 0; slot < jobs; slot++)
+			pollfds[slot] = (struct pollfd) {.fd = workers[slot].pid >= 0 ? workers[slot].fd : -1, .events = POLLIN};
+		if (poll(pollfds, jobs, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return EXIT_FAILURE;
+		}
+
+		for (size_t slot = 0; slot < jobs; slot++) {
+			struct worker *worker = &workers[slot];
+			if (!pollfds[slot].revents)
+				continue;
+			struct report r;
+			ssize_t ssz = read(worker->fd, &r, sizeof(r));
+			if (ssz != sizeof(r)) {
+				memset(&r, 0, sizeof(r));
+				r.result = RESULT_FAILED;
+				snprintf(r.outcome, sizeof(r.outcome), "worker died");
+			}
+			close(worker->fd);
+			waitpid(worker->pid, nullptr, 0);
+			worker->pid = -1;
+			finished++;
+
+			printf("game %u", worker->game);
+			if (worker->cpu >= 0)
+				printf(" (cpu %d)", worker->cpu);
+			printf(": %s", r.outcome);
+			if (r.result != RESULT_FAILED)
+				printf(" after %.1f s", (double) r.duration / 1e9);
+			if (r.updates)
+				printf(", %llu updates", (unsigned long long) r.updates);
+			printf("; %lu commands, %lu rejected", r.commands, r.rejected);
+			if (r.latency.count)
+				printf("; latency p50 < %llu us, p99 < %llu us, max %llu us", us(r.latency.p50), us(r.latency.p99), us(r.latency.max));
+			if (r.dropped)
+				printf("; bot missed %lu bytes of screen", r.dropped);
+			putchar('\n');
+
+			results[r.result]++;
+			commands += r.commands;
+			rejected += r.rejected;
+			updates += r.updates;
+			if (r.latency.count && r.latency.p99 > worst_p99)
+				worst_p99 = r.latency.p99;
+			if (r.latency.max > worst_max)
+				worst_max = r.latency.max;
+		}
+	}
+
+	/* Sum up. */
+	double elapsed = (double) (monotime_now() - start) / 1e9;
+	printf("%lu games in %.1f s (%.1f per minute) on %lu jobs: %lu lost a plane, %lu ended otherwise, %lu hit the time limit, %lu failed\n",
+			games, elapsed, elapsed > 0 ? (double) games * 60 / elapsed : 0.0, jobs,
+			results[RESULT_LOST], results[RESULT_ENDED], results[RESULT_TIME_LIMIT], results[RESULT_FAILED]);
+	printf("%lu commands, %lu rejected", commands, rejected);
+	if (updates)
+		printf("; %llu updates", (unsigned long long) updates);
+	if (worst_max)
+		printf("; worst game latency p99 < %llu us, max %llu us", us(worst_p99), us(worst_max));
+	putchar('\n');
+	return results[RESULT_FAILED] ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -3,13 +3,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/un.h>
+#include <stdint.h>
 #include <unistd.h>
-#include "commands.h"
-#include "../shared/sockpath.h"
-#include "../shared/sockaddr_union.h"
+#include <sys/select.h>
+#include "../libmatc/matc.h"
+#include "../shared/commands.h"
+#include "../shared/monotime.h"
+#include "../shared/probes.h"
 
 
 
@@ -17,6 +17,9 @@ static char current_input[1024] = "";
 
 static WINDOW *chatwin, *inputwin;
 
+/* The number of commands sent, which numbers their trace IDs. */
+static uint32_t commands_sent = 0;
+
 
 
 static void safe_endwin(void) {
@@ -27,46 +30,30 @@ static void safe_endwin(void) {
 
 
 
-static bool authenticate(int sockfd) {
-	if (send(sockfd, "MATC 1", strlen("MATC 1"), MSG_NOSIGNAL) < 0) {
-		perror("send(socket)");
-		return false;
-	}
-
-	char buffer[1024];
-	ssize_t ret = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-	if (ret < 0) {
-		perror("recv(socket)");
-		return false;
-	}
-	if (ret == 0) {
-		errno = ECONNRESET;
-		perror("recv(socket)");
-		return false;
-	}
-	buffer[ret] = '\0';
-	if (strcmp(buffer, "MATC VERSION") == 0) {
-		errno = EPROTONOSUPPORT;
-		perror("atcd");
-		return false;
-	} else if (strcmp(buffer, "MATC ACCESS") == 0) {
-		errno = EACCES;
-		perror("atcd");
-		return false;
-	} else if (strcmp(buffer, "MATC OK") != 0) {
-		errno = EPROTONOSUPPORT;
-		perror("atcd");
-		return false;
+static bool authenticate(struct matc *conn) {
+	for (;;) {
+		if (!matc_wait(conn, -1)) {
+			perror("poll(socket)");
+			return false;
+		}
+		struct matc_event event;
+		int ret = matc_next_event(conn, &event);
+		if (ret < 0) {
+			perror(errno == ECONNRESET ? "recv(socket)" : "atcd");
+			return false;
+		}
+		if (ret > 0 && event.type == MATC_EVENT_READY)
+			return true;
 	}
-
-	return true;
 }
 
 
 
-static bool run_stdin_one(int sockfd, int *exitcode) {
-	/* Get a character. */
+static bool run_stdin_one(struct matc *conn, int *exitcode) {
+	/* Get a character, and note when it was pressed for tracing. */
 	int ch = wgetch(inputwin);
+	uint64_t keystroke = monotime_now();
+	PROBE2(atcc, keystroke, ch, strlen(current_input));
 
 	/* See what it is. */
 	if (ch == 4) {
@@ -76,47 +63,36 @@ static bool run_stdin_one(int sockfd, int *exitcode) {
 		return false;
 	} else if (ch == 12) {
 		/* Control-L -> refresh screen -> send immediately */
-		char output = 12;
-		if (send(sockfd, &output, 1, MSG_NOSIGNAL) < 0) {
-			safe_endwin();
-			perror("send(socket)");
-			*exitcode = EXIT_FAILURE;
-			return false;
-		}
+		matc_send_key(conn, '\x0c');
 	} else if (ch == ' ' && current_input[0] != '/') {
 		/* Space -> could be used at the termination of the game -> send immediately */
-		char output = ' ';
-		if (send(sockfd, &output, 1, MSG_NOSIGNAL) < 0) {
-			safe_endwin();
-			perror("send(socket)");
-			*exitcode = EXIT_FAILURE;
-			return false;
-		}
+		matc_send_key(conn, ' ');
 	} else if (ch == '\r' || ch == KEY_ENTER) {
 		/* Enter -> send only if our current input is terminal */
 		char output[2048];
-		bool terminal;
-		if (parse_command(current_input, output, sizeof(output), &terminal) && terminal) {
-			/* Don't send the newline for chat messages. */
-			if (current_input[0] != '/')
-				strcat(current_input, "\n");
-			if (send(sockfd, current_input, strlen(current_input), MSG_NOSIGNAL) < 0) {
-				safe_endwin();
-				perror("send(socket)");
-				*exitcode = EXIT_FAILURE;
-				return false;
-			}
+		bool terminal, queued;
+		if (!parse_command(current_input, matc_planes(conn), output, sizeof(output), &terminal) || !terminal)
+			queued = false;
+		else if (current_input[0] == '/' && current_input[1] == '/')
+			queued = matc_send_server(conn, current_input + 2);
+		else if (current_input[0] == '/')
+			queued = matc_send_chat(conn, current_input + 1);
+		else
+			queued = matc_send_traced_command(conn, current_input, (uint64_t) getpid() << 32 | ++commands_sent, keystroke);
+		if (queued) {
 			current_input[0] = '\0';
 			wprintw(inputwin, "\r");
 			wclrtoeol(inputwin);
 			wrefresh(inputwin);
+		} else if (errno == EMSGSIZE || errno == ENOBUFS) {
+			beep();
 		}
 	} else if (ch == KEY_BACKSPACE || ch == 8 || ch == 127) {
 		/* Backspace -> if current input nonempty then remove last char */
 		if (current_input[0] != '\0') {
 			current_input[strlen(current_input) - 1] = '\0';
 			char output[2048];
-			parse_command(current_input, output, sizeof(output), nullptr);
+			parse_command(current_input, matc_planes(conn), output, sizeof(output), nullptr);
 			wprintw(inputwin, "\r%s", output);
 			wclrtoeol(inputwin);
 			wrefresh(inputwin);
@@ -135,7 +111,7 @@ static bool run_stdin_one(int sockfd, int *exitcode) {
 		output[0] = ch;
 		output[1] = '\0';
 		strcat(new_input, output);
-		if (parse_command(new_input, output, sizeof(output), nullptr)) {
+		if (parse_command(new_input, matc_planes(conn), output, sizeof(output), nullptr)) {
 			strcpy(current_input, new_input);
 			waddstr(inputwin, "\r");
 			waddstr(inputwin, output);
@@ -144,43 +120,75 @@ static bool run_stdin_one(int sockfd, int *exitcode) {
 		}
 	}
 
+	/* Send whatever was queued. */
+	if (!matc_flush(conn)) {
+		safe_endwin();
+		perror("send(socket)");
+		*exitcode = EXIT_FAILURE;
+		return false;
+	}
 	return true;
 }
 
 
 
-static bool run_socket_one(int sockfd, int *exitcode) {
-	/* Read the packet from the socket. */
-	char buffer[1024];
-	ssize_t ret = read(sockfd, buffer, sizeof(buffer));
+static bool run_socket_one(struct matc *conn, int *exitcode) {
+	/* Output each message that has arrived. */
+	uint64_t start = monotime_now();
+	unsigned int shown = 0;
+	size_t bytes = 0;
+	struct matc_event event;
+	int ret;
+	while ((ret = matc_next_event(conn, &event)) > 0) {
+		/* The library keeps track of which planes can be commanded; there is nothing to show. */
+		if (event.type == MATC_EVENT_PLANES)
+			continue;
+		waddstr(chatwin, event.text);
+		waddstr(chatwin, "\n");
+		shown++;
+		bytes += event.length;
+	}
+	wrefresh(chatwin);
+	PROBE3(atcc, render, shown, bytes, monotime_now() - start);
 	if (ret < 0) {
+		if (errno == ECONNRESET) {
+			endwin();
+			*exitcode = EXIT_SUCCESS;
+		} else {
+			safe_endwin();
+			perror("read(socket)");
+			*exitcode = EXIT_FAILURE;
+		}
+		return false;
+	}
+
+	/* Send anything held up by a full socket. */
+	if (!matc_flush(conn)) {
 		safe_endwin();
-		perror("read(socket)");
+		perror("send(socket)");
 		*exitcode = EXIT_FAILURE;
 		return false;
-	} else if (ret == 0) {
-		endwin();
-		*exitcode = EXIT_SUCCESS;
-		return false;
 	}
-	buffer[ret] = '\0';
-
-	/* Output the message. */
-	waddstr(chatwin, buffer);
-	waddstr(chatwin, "\n");
-	wrefresh(chatwin);
 	return true;
 }
 
 
 
-static int run(int sockfd) {
+static int run(struct matc *conn) {
+	int sockfd = matc_get_fd(conn);
 	for (;;) {
-		fd_set rfds;
+		fd_set rfds, wfds;
 		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
 		FD_SET(0 /* stdin */, &rfds);
 		FD_SET(sockfd, &rfds);
-		if (select(sockfd + 1, &rfds, nullptr, nullptr, nullptr) < 0) {
+		if (matc_wants(conn) & MATC_WANT_WRITE)
+			FD_SET(sockfd, &wfds);
+
+		/* Packets received along with earlier ones (e.g. with the server's acceptance) are already out of the socket, so only check for keystrokes before showing them. */
+		bool pending = matc_pending(conn);
+		struct timeval poll_only = {0, 0};
+		if (select(sockfd + 1, &rfds, &wfds, nullptr, pending ? &poll_only : nullptr) < 0) {
 			safe_endwin();
 			perror("select(stdin, socket)");
 			return EXIT_FAILURE;
@@ -188,12 +196,12 @@ static int run(int sockfd) {
 
 		if (FD_ISSET(0, &rfds)) {
 			int exitcode;
-			if (!run_stdin_one(sockfd, &exitcode))
+			if (!run_stdin_one(conn, &exitcode))
 				return exitcode;
 		}
-		if (FD_ISSET(sockfd, &rfds)) {
+		if (pending || FD_ISSET(sockfd, &rfds) || FD_ISSET(sockfd, &wfds)) {
 			int exitcode;
-			if (!run_socket_one(sockfd, &exitcode))
+			if (!run_socket_one(conn, &exitcode))
 				return exitcode;
 		}
 	}
@@ -214,36 +222,13 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
-	/* Establish the socket path to connect to. */
-	union sockaddr_union saddr;
-	if (argc == 2) {
-		if (strlen(argv[1]) + 1 > sizeof(saddr.sun.sun_path)) {
-			errno = ENAMETOOLONG;
-			perror("socket address");
-			return EXIT_FAILURE;
-		}
-		strcpy(saddr.sun.sun_path, argv[1]);
-	} else {
-		if (!sockpath_set_default(&saddr.sun)) {
-			perror("socket address");
-			return EXIT_FAILURE;
-		}
-	}
-
-	/* Create a socket and connect to the server. */
-	int sockfd = socket(PF_UNIX, SOCK_SEQPACKET, 0);
-	if (sockfd < 0) {
-		perror("socket(PF_UNIX, SOCK_SEQPACKET, 0)");
-		return EXIT_FAILURE;
-	}
-	saddr.sun.sun_family = AF_UNIX;
-	if (connect(sockfd, &saddr.s, sizeof(saddr)) < 0) {
+	/* Connect to the server and negotiate the protocol version. */
+	struct matc *conn = matc_connect(argc == 2 ? argv[1] : nullptr);
+	if (!conn) {
 		perror("connect(socket)");
 		return EXIT_FAILURE;
 	}
-
-	/* Transmit an authentication/version-negotiation packet. */
-	if (!authenticate(sockfd)) {
+	if (!authenticate(conn)) {
 		return EXIT_FAILURE;
 	}
 
@@ -261,6 +246,6 @@ int main(int argc, char **argv) {
 	idlok(chatwin, 1);
 
 	/* Run the application. */
-	return run(sockfd);
+	return run(conn);
 }
 
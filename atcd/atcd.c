@@ -7,16 +7,38 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <grp.h>
 #include <pwd.h>
 #include <fcntl.h>
 #include "auth.h"
 #include "atcproc.h"
+#include "cmdqueue.h"
+#include "ratelimit.h"
+#include "latency.h"
+#include "handshake.h"
+#include "evbackend.h"
+#include "recorder.h"
+#include "gameclock.h"
+#include "screen.h"
+#include "gamestate.h"
+#include "trace.h"
+#include "flightrec.h"
+#include "tuning.h"
+#include "history.h"
+#include "macro.h"
+#include "intern.h"
+#include "../shared/commands.h"
+#include "../shared/monotime.h"
+#include "../shared/probes.h"
 #include "../shared/sockpath.h"
 #include "../shared/sockaddr_union.h"
 
@@ -24,50 +46,287 @@
 
 static const struct option longopts[] = {
 	{"socket", required_argument, 0, 'S'},
+	{"coalesce-delay", required_argument, 0, 'c'},
+	{"rate", required_argument, 0, 'r'},
+	{"burst", required_argument, 0, 'b'},
+	{"admin-socket", required_argument, 0, 'A'},
+	{"control-slo", required_argument, 0, 'L'},
+	{"atc", required_argument, 0, 'a'},
+	{"standby", no_argument, 0, 's'},
+	{"restore", required_argument, 0, 'R'},
+	{"idle-timeout", required_argument, 0, 'i'},
+	{"auto-pause", no_argument, 0, 'P'},
+	{"resume-countdown", required_argument, 0, 'C'},
+	{"handshake-timeout", required_argument, 0, 'H'},
+	{"max-pending", required_argument, 0, 'M'},
+	{"max-connections", required_argument, 0, 'N'},
+	{"handshake-threads", required_argument, 0, 'T'},
+	{"io-backend", required_argument, 0, 'I'},
+	{"record", required_argument, 0, 'w'},
+	{"time-shim", required_argument, 0, 'V'},
+	{"speed", required_argument, 0, 'x'},
+	{"game-state", no_argument, 0, 'G'},
+	{"trace", required_argument, 0, 'g'},
+	{"flight-recorder", required_argument, 0, 'F'},
+	{"cpus", required_argument, 0, 'u'},
+	{"atc-cpus", required_argument, 0, 'U'},
+	{"sched", required_argument, 0, 'y'},
+	{"atc-sched", required_argument, 0, 'Y'},
+	{"mlock", no_argument, 0, 'm'},
+	{"atc-cgroup", required_argument, 0, 'k'},
+	{"atc-cpu-quota", required_argument, 0, 'q'},
+	{"acl", required_argument, 0, 'l'},
+	{"history", required_argument, 0, 'D'},
 	{nullptr, 0, 0, 0}
 };
 
-static const char shortopts[] = "S:";
+static const char shortopts[] = "S:c:r:b:A:L:a:si:PC:H:M:N:T:I:w:V:x:Gg:F:u:U:y:Y:mk:q:l:D:";
 
+/* The number of received packets each connection can hold before we stop reading from it. */
+#define INBOX_MAX 8
+
+/* The number of control commands each connection may run on the priority lane per pass of the main loop. */
+#define CONTROL_PER_PASS 4
+
+/* The number of bytes each backlogged connection may have serviced per round. */
+#define DRR_QUANTUM 256
+
+/* The number of outgoing messages that can wait for a slow client before it is disconnected. */
+#define OUTBOX_MAX 64
+
+/* The longest message a client can take in one packet, and so the longest clprintf() makes. */
+#define MESSAGE_MAX 255
+
+/* The most chat messages //history shows. */
+#define HISTORY_LINES 20
+
+/* How long atc's screen must be still before the game state is read off it, so that an update split across several writes is seen whole. */
+#define SCREEN_SETTLE 1000000u
+
+struct packet {
+	size_t length;
+	bool throttled;
+
+	/* For a traced command, its trace ID, when its key was pressed, when it was sent and when it was received. */
+	uint64_t trace, keystroke, sent, received;
+
+	char data[256];
+};
+
+/* Flags kept for each slot of the connection table. */
+#define CONN_IN_USE 0x01
+#define CONN_SUBSCRIBED 0x02
+#define CONN_ADMIN 0x04
+#define CONN_DEBUGGING 0x08
+#define CONN_EOF 0x10
+#define CONN_BACKLOGGED 0x20
+#define CONN_INBOX_FULL 0x40
+
+/* The parts of a connection that are not needed when scanning every connection; the rest are in the hot arrays of the connection table. */
 struct connection;
 struct connection {
-	struct connection *next;
-	struct connection **prevptr;
-	int fd;
-	bool debug;
 	uid_t user;
-	char *username;
+
+	/* The user's name, interned. */
+	const char *username;
+
+	/* Messages that could not be sent without blocking, as a ring. */
+	char *outbox[OUTBOX_MAX];
+	unsigned int outbox_head, outbox_count;
+
+	/* Received packets waiting to be serviced, as a ring. */
+	struct packet inbox[INBOX_MAX];
+	unsigned int inbox_head, inbox_count;
+
+	/* The user's token bucket. */
+	int bucket;
+
+	/* Deficit round-robin state. */
+	struct connection *active_next;
+	bool active;
+	size_t deficit;
 };
 
-static struct connection *connections = nullptr;
-static struct connection *pending = nullptr;
+/*
+ * The connection table. Its slots are allocated once at startup and never
+ * move, so pointers to them stay valid, and each slot's fd and flags live in
+ * parallel arrays so that a scan over every connection touches contiguous
+ * memory. A slot's generation changes whenever it is freed, so a handle that
+ * outlives its connection is recognized as stale.
+ */
+static size_t conn_capacity = 256;
+static struct connection *conn_slab = nullptr;
+static int *conn_fd = nullptr;
+static uint8_t *conn_flags = nullptr;
+static uint32_t *conn_generation = nullptr;
+
+/* One past the highest slot in use, which bounds every scan. */
+static size_t conn_top = 0;
+
+/* The free slots, as a stack. */
+static uint32_t *conn_free = nullptr;
+static size_t conn_free_count = 0;
+
+/* Scratch space for a broadcast: the slots and FDs sent to in one batch. */
+static uint32_t *batch_slot = nullptr;
+static int *batch_fd = nullptr;
+
+/* The number of connections in the table. */
+static unsigned int connection_count = 0;
+
+/* Connections with packets waiting in their inboxes, in service order. */
+static struct connection *active_head = nullptr, *active_tail = nullptr;
+static size_t active_count = 0;
+
+/* How we wait for I/O and send broadcasts. */
+static const struct evbackend *ev = nullptr;
 
 static volatile sig_atomic_t has_atc_exited = 0;
 
+static volatile sig_atomic_t reexec_requested = 0;
+
+/* Whether to keep a standby atc process ready for the next game. */
+static bool use_standby = false;
+
+/* Whether to pause the game when the last player leaves and resume it when one comes back. */
+static bool auto_pause = false;
+
+/* How many seconds to count down before resuming a game paused because everyone left. */
+static unsigned int resume_countdown = 3;
+
+/* Whether the game is paused because everyone left. */
+static bool auto_paused = false;
+
+/* The seconds left in the resume countdown (zero if not counting down), and when to announce the next one. */
+static unsigned int countdown_left = 0;
+static uint64_t countdown_next = 0;
+
+/* When atc's screen will have been still long enough to read the game state off it, or zero if it has not changed. */
+static uint64_t screen_settled = 0;
+
+/* How long to stay running with no clients and no game, in nanoseconds, or zero to run forever. */
+static uint64_t idle_timeout = 0;
+
+/* The listening sockets, our own binary and our original arguments, needed to re-execute ourselves. */
+static int listen_sock = -1, admin_sock = -1;
+static char self_path[PATH_MAX];
+static char **self_argv;
+
 
 
 static void atc_death_cb(void) {
 	has_atc_exited = 1;
 }
 
+static void hup_sig_handler(int signum __attribute__((unused))) {
+	reexec_requested = 1;
+}
+
+
+
+/* Allocates the connection table with room for a given number of connections. Returns true on success, false on failure. */
+static bool conn_table_init(size_t capacity) {
+	conn_slab = calloc(capacity, sizeof(*conn_slab));
+	conn_fd = calloc(capacity, sizeof(*conn_fd));
+	conn_flags = calloc(capacity, sizeof(*conn_flags));
+	conn_generation = calloc(capacity, sizeof(*conn_generation));
+	conn_free = calloc(capacity, sizeof(*conn_free));
+	batch_slot = calloc(capacity, sizeof(*batch_slot));
+	batch_fd = calloc(capacity, sizeof(*batch_fd));
+	if (!conn_slab || !conn_fd || !conn_flags || !conn_generation || !conn_free || !batch_slot || !batch_fd)
+		return false;
+
+	/* Stack the slots so the lowest are handed out first, and start every generation at one so that a zero handle is never valid. */
+	for (size_t i = 0; i < capacity; i++) {
+		conn_free[i] = capacity - 1 - i;
+		conn_generation[i] = 1;
+	}
+	conn_free_count = capacity;
+	conn_capacity = capacity;
+	return true;
+}
+
+static inline size_t conn_slot(const struct connection *conn) {
+	return (size_t) (conn - conn_slab);
+}
+
+static inline cmdqueue_owner conn_handle(const struct connection *conn) {
+	size_t slot = conn_slot(conn);
+	return ((uint64_t) conn_generation[slot] << 32) | slot;
+}
+
+/* Finds the connection a handle refers to. Returns nullptr if it has since closed. */
+static struct connection *conn_lookup(cmdqueue_owner handle) {
+	size_t slot = handle & UINT32_MAX;
+	if (slot >= conn_capacity || conn_generation[slot] != handle >> 32 || !(conn_flags[slot] & CONN_IN_USE))
+		return nullptr;
+	return &conn_slab[slot];
+}
+
 
 
-static const struct connection CONN_ALL_IMPL, CONN_DEBUG_IMPL;
-static const struct connection * const CONN_ALL = &CONN_ALL_IMPL;
-static const struct connection * const CONN_DEBUG = &CONN_DEBUG_IMPL;
-static inline void clputs(const struct connection *conn, const char *string) {
-	if (conn != CONN_ALL && conn != CONN_DEBUG) {
-		while (send(conn->fd, string, strlen(string), MSG_NOSIGNAL) < 0 && errno == EINTR);
+/* Queues a message for a client that cannot take it yet; a client that falls too far behind is disconnected rather than allowed to stall everyone. */
+static void enqueue(struct connection *conn, const char *string) {
+	size_t slot = conn_slot(conn);
+	char *copy;
+	if (conn->outbox_count == OUTBOX_MAX || !(copy = strdup(string))) {
+		flightrec_log(FLIGHTREC_OVERFLOW, conn_fd[slot], conn->user, conn->outbox_count, "outbox");
+		conn_flags[slot] |= CONN_EOF;
+		return;
+	}
+	conn->outbox[(conn->outbox_head + conn->outbox_count++) % OUTBOX_MAX] = copy;
+	conn_flags[slot] |= CONN_BACKLOGGED;
+	PROBE3(atcd, send_queued, conn_fd[slot], strlen(string), conn->outbox_count);
+}
+
+
+
+/* Deals with how sending a message to a client went: one that would have blocked, or was not tried after one that would, waits in the outbox behind it. */
+static void message_sent(uint32_t slot, const char *data, ssize_t result) {
+	PROBE3(atcd, send, conn_fd[slot], strlen(data), result);
+	if (result == -EAGAIN || result == -EWOULDBLOCK || result == -ECANCELED)
+		enqueue(&conn_slab[slot], data);
+	else if (result < 0)
+		flightrec_log(FLIGHTREC_SEND_FAILED, conn_fd[slot], conn_slab[slot].user, -result, nullptr);
+}
+
+
+
+static struct connection CONN_ALL_IMPL, CONN_DEBUG_IMPL, CONN_SUBSCRIBERS_IMPL;
+static struct connection * const CONN_ALL = &CONN_ALL_IMPL;
+static struct connection * const CONN_DEBUG = &CONN_DEBUG_IMPL;
+static struct connection * const CONN_SUBSCRIBERS = &CONN_SUBSCRIBERS_IMPL;
+static inline void clputs(struct connection *conn, const char *string) {
+	if (conn != CONN_ALL && conn != CONN_DEBUG && conn != CONN_SUBSCRIBERS) {
+		/* Send unless earlier messages are still waiting. */
+		size_t slot = conn_slot(conn);
+		if (conn_flags[slot] & CONN_BACKLOGGED) {
+			enqueue(conn, string);
+		} else {
+			uint32_t tag = slot;
+			ev->send_all(&conn_fd[slot], &tag, 1, string);
+		}
 	} else {
-		for (const struct connection *cur_conn = connections; cur_conn; cur_conn = cur_conn->next)
-			if (conn == CONN_ALL || cur_conn->debug)
-				clputs(cur_conn, string);
+		/* Queue behind the backlog for clients that have one, and send to the rest in one batch; only the hot arrays are touched unless a client is backlogged. */
+		uint8_t want = CONN_IN_USE | (conn == CONN_DEBUG ? CONN_DEBUGGING : conn == CONN_SUBSCRIBERS ? CONN_SUBSCRIBED : 0);
+		size_t count = 0;
+		for (size_t slot = 0; slot < conn_top; slot++)
+			if ((conn_flags[slot] & want) == want) {
+				if (conn_flags[slot] & CONN_BACKLOGGED) {
+					enqueue(&conn_slab[slot], string);
+				} else {
+					batch_slot[count] = slot;
+					batch_fd[count++] = conn_fd[slot];
+				}
+			}
+		if (count)
+			ev->send_all(batch_fd, batch_slot, count, string);
 	}
 }
 
-static inline void clprintf(const struct connection *conn, const char *format, ...) {
+static inline void clprintf(struct connection *conn, const char *format, ...) {
 	va_list args;
-	char buffer[256];
+	char buffer[MESSAGE_MAX + 1];
 
 	va_start(args, format);
 	vsnprintf(buffer, sizeof(buffer), format, args);
@@ -77,26 +336,315 @@ static inline void clprintf(const struct connection *conn, const char *format, .
 
 
 
+/* Sends a game state event to a client. */
+static void send_state(const char *event, void *arg) {
+	clputs(arg, event);
+}
+
+/* Sends a game state event to every client that asked for them, and records it. */
+static void publish_state(const char *event, void *arg __attribute__((unused))) {
+	recorder_log(RECORD_STATE, 0, event, strlen(event));
+	clputs(CONN_SUBSCRIBERS, event);
+}
+
+
+
+/* The planes commands may be given to: any, until the game state says which are in the air. */
+static plane_set command_planes = PLANES_ALL;
+
+/* Tells a client which planes commands may be given to, as "[planes] <letters>", or "[planes] *" for any. */
+static void send_planes(struct connection *conn) {
+	char buffer[64] = "[planes] ";
+	size_t length = strlen(buffer);
+	plane_set planes = command_planes;
+	if (planes == PLANES_ALL) {
+		buffer[length++] = '*';
+	} else {
+		for (char name = 'a'; name <= 'z'; name++)
+			if (planes & plane_bit(name))
+				buffer[length++] = name;
+		for (char name = 'A'; name <= 'Z'; name++)
+			if (planes & plane_bit(name))
+				buffer[length++] = name;
+	}
+	buffer[length] = '\0';
+	clputs(conn, buffer);
+}
+
+/* Limits commands to the planes in the game, telling every client if that changed. */
+static void update_planes(void) {
+	plane_set planes = gamestate_planes();
+	if (planes == command_planes)
+		return;
+	command_planes = planes;
+	send_planes(CONN_ALL);
+}
+
+
+
+/* Parses an age such as "90s", "30m", "12h", "7d" or "2w" into nanoseconds. Returns true on success, false on failure. */
+static bool parse_age(const char *text, uint64_t *age) {
+	char *endptr;
+	if (*text < '0' || *text > '9')
+		return false;
+	unsigned long long count = strtoull(text, &endptr, 10);
+	uint64_t unit;
+	switch (*endptr) {
+		case 's':
+			unit = 1;
+			break;
+
+		case 'm':
+			unit = 60;
+			break;
+
+		case 'h':
+			unit = 3600;
+			break;
+
+		case 'd':
+			unit = 86400;
+			break;
+
+		case 'w':
+			unit = 604800;
+			break;
+
+		default:
+			return false;
+	}
+	if (endptr[1] || count > UINT64_MAX / 1000000000u / unit)
+		return false;
+	*age = count * unit * 1000000000u;
+	return true;
+}
+
+
+
+/* Shows a user the chat history asked for by "//history [user] [age]". */
+static void show_history(const char *args, struct connection *conn) {
+	if (!history_enabled()) {
+		clputs(conn, "[server] chat history needs atcd to be run with --history");
+		return;
+	}
+
+	/* Take each word as an age if it looks like one, or else as a user. */
+	uid_t uid = 0;
+	bool any_user = true;
+	uint64_t since = 0;
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), "%s", args);
+	char *saveptr;
+	for (char *word = strtok_r(buffer, " ", &saveptr); word; word = strtok_r(nullptr, " ", &saveptr)) {
+		uint64_t age;
+		if (parse_age(word, &age)) {
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			uint64_t now_ns = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+			since = age < now_ns ? now_ns - age : 0;
+			continue;
+		}
+		char *endptr;
+		unsigned long number = strtoul(word, &endptr, 10);
+		if (*endptr == '\0') {
+			uid = number;
+		} else {
+			const struct passwd *pwd;
+			do {
+				errno = 0;
+				pwd = getpwnam(word);
+			} while (!pwd && errno == EINTR);
+			if (!pwd) {
+				clprintf(conn, "[server] no such user: %s", word);
+				return;
+			}
+			uid = pwd->pw_uid;
+		}
+		any_user = false;
+	}
+
+	char *lines[HISTORY_LINES];
+	size_t count;
+	if (!history_query(uid, any_user, since, lines, HISTORY_LINES, &count)) {
+		clprintf(conn, "[server] failed to read chat history: %s", strerror(errno));
+		return;
+	}
+	if (!count)
+		clputs(conn, "[server] no chat history found");
+	for (size_t i = 0; i < count; i++) {
+		clprintf(conn, "[server] %s", lines[i]);
+		free(lines[i]);
+	}
+}
+
+
+
+/* Tells the owner of a queued command that was dropped in favour of a newer one for the same plane who sent the newer one. Nobody needs telling if the command had no owner, the owner has gone, or it was replaced by its own sender. */
+static void notify_superseded(cmdqueue_owner owner, char plane, const struct connection *by) {
+	struct connection *victim = owner ? conn_lookup(owner) : nullptr;
+	if (victim && victim != by)
+		clprintf(victim, "[server] your command for plane %c was superseded by %s", plane, by->username);
+}
+
+
+
+/* Sends a description from tuning_describe(), which can be longer than a packet, over as many lines as it takes, breaking between its parts. */
+static void show_scheduling(struct connection *conn, const char *who, const char *description) {
+	size_t room = MESSAGE_MAX - strlen("[server]  scheduling: ") - strlen(who);
+	while (*description) {
+		size_t length = strlen(description);
+		if (length > room) {
+			size_t cut = room;
+			while (cut > 0 && !(description[cut - 1] == ',' && description[cut] == ' '))
+				cut--;
+			length = cut ? cut - 1 : room;
+		}
+		clprintf(conn, "[server] %s scheduling: %.*s", who, (int) length, description);
+		description += length;
+		if (description[0] == ',' && description[1] == ' ')
+			description += 2;
+	}
+}
+
+
+
+/* Expands the batch given by "//do <items>" and queues its commands to go to the game in one write, all or none of them. */
+static void run_batch(const char *batch, struct connection *conn) {
+	if (!atcproc_is_running()) {
+		clputs(conn, "[server] game is not running");
+		return;
+	}
+
+	char commands[MACRO_EXPANSION_MAX][MACRO_COMMAND_MAX];
+	size_t count;
+	if (!macro_expand(conn->user, batch, commands, &count)) {
+		if (errno == E2BIG)
+			clprintf(conn, "[server] a batch may expand to at most %u commands", MACRO_EXPANSION_MAX);
+		else
+			clputs(conn, "[server] invalid batch");
+		return;
+	}
+
+	/* A batch bigger than a full bucket could never be paid for, however long the user waited. */
+	unsigned int burst = ratelimit_get_burst();
+	if (burst && count > burst) {
+		clprintf(conn, "[server] a batch may expand to at most %u commands, the rate limit's burst size", burst);
+		return;
+	}
+
+	/* Charge for every command the batch expands to, not just the packet it came in, which has paid for the first. */
+	if (count > 1 && !ratelimit_take_many(conn->bucket, count - 1, monotime_now())) {
+		ratelimit_count_throttled(conn->bucket);
+		clprintf(conn, "[server] too many commands too quickly for a batch of %zu, try again", count);
+		return;
+	}
+
+	const char *inputs[MACRO_EXPANSION_MAX];
+	cmdqueue_owner superseded[MACRO_EXPANSION_MAX];
+	size_t failed;
+	for (size_t i = 0; i < count; i++)
+		inputs[i] = commands[i];
+	int fd = conn_fd[conn_slot(conn)];
+	if (!cmdqueue_push_batch(inputs, count, command_planes, conn_handle(conn), superseded, &failed)) {
+		flightrec_log(errno == ENOBUFS ? FLIGHTREC_OVERFLOW : FLIGHTREC_REJECT, fd, conn->user, errno, errno == ENOBUFS ? "cmdqueue" : inputs[failed]);
+		if (errno == EINVAL)
+			clprintf(conn, "[server] invalid command: %.*s", (int) strcspn(inputs[failed], "\n"), inputs[failed]);
+		else if (errno == ESRCH)
+			clprintf(conn, "[server] there is no plane %c", inputs[failed][0]);
+		else
+			clputs(conn, "[server] too many commands waiting, try again");
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		recorder_log(RECORD_INPUT, conn->user, inputs[i], strlen(inputs[i]));
+		flightrec_log(FLIGHTREC_INPUT, fd, conn->user, 0, inputs[i]);
+		notify_superseded(superseded[i], inputs[i][0], conn);
+	}
+}
+
+
+
+/* Lists a user's macros for "//macro", removes one for "//macro <name>", or defines one for "//macro <name> <items>". */
+static void manage_macros(const char *args, struct connection *conn) {
+	while (*args == ' ')
+		args++;
+	if (!*args) {
+		uid_t uid;
+		const char *name, *body;
+		bool any = false;
+		for (size_t i = 0; macro_get(i, &uid, &name, &body); i++)
+			if (uid == conn->user) {
+				clprintf(conn, "[server] %s: %s", name, body);
+				any = true;
+			}
+		if (!any)
+			clputs(conn, "[server] you have no macros");
+		return;
+	}
+
+	/* Split off the name. */
+	char name[MACRO_NAME_MAX + 1];
+	size_t length = strcspn(args, " ");
+	if (length > MACRO_NAME_MAX) {
+		clputs(conn, "[server] invalid macro name");
+		return;
+	}
+	memcpy(name, args, length);
+	name[length] = '\0';
+	const char *body = args + length;
+	while (*body == ' ')
+		body++;
+
+	if (!*body) {
+		if (macro_remove(conn->user, name))
+			clputs(conn, "[server] OK");
+		else
+			clprintf(conn, "[server] you have no macro called %s", name);
+	} else if (macro_define(conn->user, name, body)) {
+		clputs(conn, "[server] OK");
+	} else if (errno == EINVAL) {
+		clputs(conn, "[server] invalid macro");
+	} else if (errno == ENOSPC) {
+		clprintf(conn, "[server] you may keep at most %u macros", MACRO_PER_USER);
+	} else {
+		clputs(conn, "[server] error");
+	}
+}
+
+
+
 static void server_command(const char *command, struct connection *conn) {
+	recorder_log(RECORD_COMMAND, conn->user, command, strlen(command));
+	flightrec_log(FLIGHTREC_COMMAND, conn_fd[conn_slot(conn)], conn->user, 0, command);
 	if (strcmp(command, "help") == 0) {
 		clputs(conn, "[server] supported commands on this server are:");
 		clputs(conn, "[server] help");
 		clputs(conn, "[server] debug");
 		clputs(conn, "[server] nodebug");
-		clputs(conn, "[server] allow <user>");
-		clputs(conn, "[server] deny <user>");
+		clputs(conn, "[server] allow <user>|@<group>");
+		clputs(conn, "[server] deny <user>|@<group>");
 		clputs(conn, "[server] acl");
 		clputs(conn, "[server] users");
+		clputs(conn, "[server] stats");
 		clputs(conn, "[server] start [<map>]");
 		clputs(conn, "[server] stop");
 		clputs(conn, "[server] pause");
 		clputs(conn, "[server] resume");
+		clputs(conn, "[server] speed [<n>|step]");
+		clputs(conn, "[server] step [<n>]");
+		clputs(conn, "[server] state [on|off]");
+		clputs(conn, "[server] trace");
+		clputs(conn, "[server] flightrec");
+		clputs(conn, "[server] history [<user>] [<age>]");
+		clputs(conn, "[server] do <items>");
+		clputs(conn, "[server] macro [<name> [<items>]]");
+		clputs(conn, "[server] reexec");
 		clputs(conn, "[server] quit");
 	} else if (strcmp(command, "debug") == 0) {
-		conn->debug = true;
+		conn_flags[conn_slot(conn)] |= CONN_DEBUGGING;
 		clputs(conn, "[server] debug mode enabled");
 	} else if (strcmp(command, "nodebug") == 0) {
-		conn->debug = false;
+		conn_flags[conn_slot(conn)] &= ~CONN_DEBUGGING;
 		clputs(conn, "[server] debug mode disabled");
 	} else if (memcmp(command, "allow ", 6) == 0) {
 		if (!auth_add(command + 6)) {
@@ -123,30 +671,176 @@ static void server_command(const char *command, struct connection *conn) {
 			else
 				clprintf(conn, "[server] %u", uids[i]);
 		}
+		const gid_t *gids;
+		size_t ngids = auth_get_groups(&gids);
+		for (size_t i = 0; i < ngids; i++) {
+			const struct group *grp;
+			do {
+				grp = getgrgid(gids[i]);
+			} while (!grp && errno == EINTR);
+			if (grp)
+				clprintf(conn, "[server] @%s", grp->gr_name);
+			else
+				clprintf(conn, "[server] @%u", gids[i]);
+		}
 	} else if (strcmp(command, "users") == 0) {
-		for (const struct connection *cur_conn = connections; cur_conn; cur_conn = cur_conn->next)
-			clprintf(conn, "[server] %s", cur_conn->username);
+		for (size_t slot = 0; slot < conn_top; slot++)
+			if (conn_flags[slot] & CONN_IN_USE)
+				clprintf(conn, "[server] %s%s", conn_slab[slot].username, (conn_flags[slot] & CONN_ADMIN) ? " (admin)" : "");
+	} else if (strcmp(command, "stats") == 0) {
+		const char *username;
+		unsigned long served, throttled, deferred;
+		for (int bucket = 0; ratelimit_get_stats(bucket, &username, &served, &throttled, &deferred); bucket++)
+			clprintf(conn, "[server] %s: %lu packets served, %lu throttled, %lu control commands deferred", username, served, throttled, deferred);
+		clprintf(conn, "[server] connections: %u connected, %zu slots free of %zu", connection_count, conn_free_count, conn_capacity);
+		struct handshake_stats hs;
+		handshake_get_stats(&hs);
+		clprintf(conn, "[server] handshakes: %u pending on %u threads, %lu timed out, %lu rejected over the limit of %u",
+				hs.pending, hs.threads, hs.timed_out, hs.rejected, hs.max_pending);
+		struct latency_summary summary;
+		latency_get_summary(&summary);
+		clprintf(conn, "[server] control commands: %lu, p50 < %llu us, p99 < %llu us, max %llu us, %lu over %llu us target",
+				summary.count, (unsigned long long) summary.p50 / 1000u, (unsigned long long) summary.p99 / 1000u,
+				(unsigned long long) summary.max / 1000u, summary.over_target, (unsigned long long) summary.target / 1000u);
+		unsigned long logged, dropped;
+		if (recorder_get_stats(&logged, &dropped))
+			clprintf(conn, "[server] recording: %lu records, %lu dropped", logged, dropped);
+		if (history_get_stats(&logged, &dropped))
+			clprintf(conn, "[server] chat history: %lu messages, %lu dropped", logged, dropped);
+		if (gameclock_enabled()) {
+			unsigned int speed;
+			uint64_t ticks;
+			gameclock_get_stats(&speed, &ticks);
+			if (speed)
+				clprintf(conn, "[server] game clock: %ux, %llu ticks this game", speed, (unsigned long long) ticks);
+			else
+				clprintf(conn, "[server] game clock: stepped, %llu ticks this game", (unsigned long long) ticks);
+		}
+		char scheduling[512];
+		tuning_describe(0, scheduling, sizeof(scheduling));
+		show_scheduling(conn, "atcd", scheduling);
+		pid_t pid;
+		int fd;
+		bool paused;
+		if (atcproc_get_child(&pid, &fd, &paused)) {
+			tuning_describe(pid, scheduling, sizeof(scheduling));
+			show_scheduling(conn, "atc", scheduling);
+		}
 	} else if (memcmp(command, "start", 5) == 0 && (command[5] == '\0' || command[5] == ' ')) {
 		if (atcproc_is_running()) {
 			clputs(conn, "[server] game is already running");
 		} else {
-			if (atcproc_start(command[5] == '\0' ? nullptr : command + 6))
+			cmdqueue_clear();
+			gamestate_reset();
+			update_planes();
+			uint64_t before = monotime_now();
+			gameclock_reset(before);
+			if (atcproc_start(command[5] == '\0' ? nullptr : command + 6)) {
+				clprintf(CONN_DEBUG, "[server] game launched in %llu us", (unsigned long long) (monotime_now() - before) / 1000u);
 				clprintf(CONN_ALL, "[server] %s has started the game", conn->username);
+			} else {
+				clprintf(conn, "[server] failed to start the game: %s", strerror(errno));
+			}
+			if (use_standby && !atcproc_prepare())
+				clprintf(CONN_DEBUG, "[server] failed to prepare standby game: %s", strerror(errno));
 		}
 	} else if (strcmp(command, "stop") == 0) {
-		if (atcproc_stop())
+		if (atcproc_stop()) {
+			cmdqueue_clear();
+			auto_paused = false;
+			countdown_left = 0;
 			clprintf(CONN_ALL, "[server] %s ended the game", conn->username);
+		}
 	} else if (strcmp(command, "pause") == 0) {
-		if (atcproc_pause())
+		if (atcproc_pause()) {
+			auto_paused = false;
+			countdown_left = 0;
 			clprintf(CONN_ALL, "[server] %s paused the game", conn->username);
+		}
 	} else if (strcmp(command, "resume") == 0) {
-		if (atcproc_resume())
+		if (atcproc_resume()) {
+			auto_paused = false;
+			countdown_left = 0;
 			clprintf(CONN_ALL, "[server] %s resumed the game", conn->username);
+		}
+	} else if (strcmp(command, "speed") == 0 || memcmp(command, "speed ", 6) == 0 || strcmp(command, "step") == 0 || memcmp(command, "step ", 5) == 0) {
+		if (!gameclock_enabled()) {
+			clputs(conn, "[server] time control needs atcd to be run with --time-shim");
+		} else if (command[1] == 'p' && command[5] == '\0') {
+			unsigned int speed;
+			uint64_t ticks;
+			gameclock_get_stats(&speed, &ticks);
+			if (speed)
+				clprintf(conn, "[server] the game runs at %ux", speed);
+			else
+				clputs(conn, "[server] the game is stepped by hand");
+		} else if (command[1] == 'p') {
+			char *endptr;
+			unsigned long speed = strcmp(command + 6, "step") == 0 ? 0 : strtoul(command + 6, &endptr, 10);
+			if (strcmp(command + 6, "step") != 0 && (!command[6] || *endptr || speed == 0 || speed > GAMECLOCK_SPEED_MAX)) {
+				clprintf(conn, "[server] speed must be from 1 to %u, or step", GAMECLOCK_SPEED_MAX);
+			} else {
+				gameclock_set_speed(speed, monotime_now());
+				if (speed)
+					clprintf(CONN_ALL, "[server] %s set the game to run at %lux", conn->username, speed);
+				else
+					clprintf(CONN_ALL, "[server] %s set the game to be stepped by hand", conn->username);
+			}
+		} else {
+			char *endptr;
+			unsigned long ticks = command[4] ? strtoul(command + 5, &endptr, 10) : 1;
+			if (command[4] && (!command[5] || *endptr || ticks == 0 || ticks > UINT_MAX))
+				clputs(conn, "[server] invalid number of steps");
+			else if (!gameclock_step(ticks))
+				clputs(conn, "[server] the game is not being stepped; use //speed step first");
+		}
+	} else if (strcmp(command, "state") == 0 || memcmp(command, "state ", 6) == 0) {
+		if (screen_get_fd() < 0) {
+			clputs(conn, "[server] game state needs atcd to be run with --game-state");
+		} else if (strcmp(command, "state on") == 0) {
+			conn_flags[conn_slot(conn)] |= CONN_SUBSCRIBED;
+			clputs(conn, "[server] game state events enabled");
+			gamestate_describe(&send_state, conn);
+		} else if (strcmp(command, "state off") == 0) {
+			conn_flags[conn_slot(conn)] &= ~CONN_SUBSCRIBED;
+			clputs(conn, "[server] game state events disabled");
+		} else {
+			clprintf(conn, "[server] game state events are %s", (conn_flags[conn_slot(conn)] & CONN_SUBSCRIBED) ? "on" : "off");
+		}
+	} else if (strcmp(command, "trace") == 0) {
+		size_t count;
+		if (!trace_is_enabled())
+			clputs(conn, "[server] tracing needs atcd to be run with --trace");
+		else if (!trace_dump(&count))
+			clprintf(conn, "[server] failed to write the trace: %s", strerror(errno));
+		else
+			clprintf(conn, "[server] wrote %zu spans to the trace", count);
+	} else if (memcmp(command, "history", 7) == 0 && (command[7] == '\0' || command[7] == ' ')) {
+		show_history(command + 7, conn);
+	} else if (memcmp(command, "do ", 3) == 0) {
+		run_batch(command + 3, conn);
+	} else if (memcmp(command, "macro", 5) == 0 && (command[5] == '\0' || command[5] == ' ')) {
+		manage_macros(command + 5, conn);
+	} else if (strcmp(command, "flightrec") == 0) {
+		size_t count;
+		char reason[64];
+		snprintf(reason, sizeof(reason), "//flightrec by %s", conn->username);
+		if (!flightrec_dump(reason, &count))
+			clprintf(conn, "[server] failed to write the flight recorder: %s", strerror(errno));
+		else
+			clprintf(conn, "[server] wrote %zu events from the flight recorder", count);
+	} else if (strcmp(command, "reexec") == 0) {
+		clprintf(CONN_DEBUG, "[server] %s requested a restart", conn->username);
+		reexec_requested = 1;
 	} else if (strcmp(command, "quit") == 0) {
-		for (const struct connection *cur_conn = connections; cur_conn; cur_conn = cur_conn->next)
-			close(cur_conn->fd);
+		ev->flush(-1, nullptr, 0);
+		for (size_t slot = 0; slot < conn_top; slot++)
+			if (conn_flags[slot] & CONN_IN_USE)
+				close(conn_fd[slot]);
 		atcproc_stop();
 		printf("%s shut down the server\n", conn->username);
+		recorder_flush();
+		history_flush();
 		exit(EXIT_SUCCESS);
 	} else {
 		clputs(conn, "[server] unknown command");
@@ -155,115 +849,626 @@ static void server_command(const char *command, struct connection *conn) {
 
 
 
-static bool run_pending_connection_once(struct connection *conn) {
-	/* Receive a message. */
-	char databuf[256];
-	ssize_t ret;
-	do {
-		ret = recv(conn->fd, databuf, sizeof(databuf), 0);
-	} while (ret < 0 && errno == EINTR);
-	if (ret <= 0)
-		return false;
-	databuf[ret] = '\0';
+/* Checks whether a server command is a game control command, which takes the priority lane. */
+static bool is_control_command(const char *command) {
+	return strcmp(command, "pause") == 0 || strcmp(command, "resume") == 0 || strcmp(command, "stop") == 0
+		|| strcmp(command, "quit") == 0 || (memcmp(command, "start", 5) == 0 && (command[5] == '\0' || command[5] == ' '))
+		|| (memcmp(command, "step", 4) == 0 && (command[4] == '\0' || command[4] == ' '))
+		|| (memcmp(command, "speed", 5) == 0 && (command[5] == '\0' || command[5] == ' '));
+}
 
-	/* Check for an acceptable protocol version. */
-	if (strcmp(databuf, "MATC 1") != 0) {
-		clputs(CONN_DEBUG, "[server] client denied for bad protocol version");
-		clputs(conn, "MATC VERSION");
-		return false;
+
+
+static void flush_outbox(struct connection *conn) {
+	size_t slot = conn_slot(conn);
+	while (conn->outbox_count) {
+		char *message = conn->outbox[conn->outbox_head];
+		ssize_t ret;
+		do {
+			ret = send(conn_fd[slot], message, strlen(message), MSG_NOSIGNAL | MSG_DONTWAIT);
+		} while (ret < 0 && errno == EINTR);
+		PROBE3(atcd, send, conn_fd[slot], strlen(message), ret >= 0 ? ret : -errno);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		free(message);
+		conn->outbox_head = (conn->outbox_head + 1) % OUTBOX_MAX;
+		conn->outbox_count--;
 	}
+	conn_flags[slot] &= ~CONN_BACKLOGGED;
+}
 
-	/* Get the user ID of the connecting client. */
-	struct ucred cred;
-	socklen_t credlen = sizeof(cred);
-	if (getsockopt(conn->fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0)
-		return false;
-	if (credlen != sizeof(cred))
-		return false;
 
-	/* Look up the username. */
-	struct passwd *pwd;
-	do {
-		pwd = getpwuid(cred.uid);
-	} while (!pwd && errno == EINTR);
-	if (!pwd) {
-		clprintf(CONN_DEBUG, "[server] user denied for no passwd entry: %ld", (long) cred.uid);
-		clputs(conn, "MATC ACCESS");
+
+static void free_connection(struct connection *conn) {
+	/* Send anything still held for the connection before its FD can be reused. */
+	ev->flush(-1, nullptr, 0);
+	size_t slot = conn_slot(conn);
+	PROBE3(atcd, close, conn_fd[slot], conn->user, conn->outbox_count);
+	flightrec_log(FLIGHTREC_CLOSE, conn_fd[slot], conn->user, conn->outbox_count, conn->username);
+	while (close(conn_fd[slot]) < 0 && errno == EINTR);
+	while (conn->outbox_count) {
+		free(conn->outbox[conn->outbox_head]);
+		conn->outbox_head = (conn->outbox_head + 1) % OUTBOX_MAX;
+		conn->outbox_count--;
+	}
+	connection_count--;
+
+	/* Invalidate any handles to the slot and give it back. */
+	conn_flags[slot] = 0;
+	if (!++conn_generation[slot])
+		conn_generation[slot] = 1;
+	conn_free[conn_free_count++] = slot;
+	while (conn_top && !conn_flags[conn_top - 1])
+		conn_top--;
+}
+
+
+
+/* Gets when a received message was sent, on the monotonic clock, from its timestamp, given when it was received; without a timestamp, that is when it was received. */
+static uint64_t sent_time(struct msghdr *msg, uint64_t received) {
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+		return received;
+	struct timespec sent, now;
+	memcpy(&sent, CMSG_DATA(cmsg), sizeof(sent));
+	clock_gettime(CLOCK_REALTIME, &now);
+	int64_t age = (int64_t) (now.tv_sec - sent.tv_sec) * 1000000000 + (now.tv_nsec - sent.tv_nsec);
+	return age > 0 && (uint64_t) age < received ? received - (uint64_t) age : received;
+}
+
+
+
+static bool run_connection_once(struct connection *conn) {
+	/* Receive as many messages as there is room for. */
+	unsigned int controls = 0;
+	while (conn->inbox_count < INBOX_MAX) {
+		struct packet *pkt = &conn->inbox[(conn->inbox_head + conn->inbox_count) % INBOX_MAX];
+		struct iovec iov = {.iov_base = pkt->data, .iov_len = sizeof(pkt->data) - 1};
+		union {
+			struct cmsghdr hdr;
+			char buf[CMSG_SPACE(sizeof(struct timespec))];
+		} control;
+		struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = &control, .msg_controllen = sizeof(control)};
+		ssize_t ret;
+		do {
+			ret = recvmsg(conn_fd[conn_slot(conn)], &msg, MSG_DONTWAIT);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret <= 0)
+			return false;
+		pkt->data[ret] = '\0';
+		PROBE3(atcd, receive, conn_fd[conn_slot(conn)], conn->user, ret);
+
+		/* Control commands skip the queue and run right now, as long as the connection has not had its share of the lane this pass and its user has control tokens; otherwise they wait their turn like any other packet. */
+		if (pkt->data[0] == '/' && pkt->data[1] == '/' && is_control_command(pkt->data + 2) && controls < CONTROL_PER_PASS
+				&& ratelimit_take_control(conn->bucket, monotime_now())) {
+			controls++;
+			server_command(pkt->data + 2, conn);
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+				struct timespec sent, now;
+				memcpy(&sent, CMSG_DATA(cmsg), sizeof(sent));
+				clock_gettime(CLOCK_REALTIME, &now);
+				int64_t latency = (int64_t) (now.tv_sec - sent.tv_sec) * 1000000000 + (now.tv_nsec - sent.tv_nsec);
+				latency_record(latency > 0 ? (uint64_t) latency : 0);
+			}
+			continue;
+		}
+
+		pkt->length = ret;
+		pkt->throttled = false;
+		pkt->trace = 0;
+		if (trace_is_enabled() && (pkt->trace = trace_parse(pkt->data, (size_t) ret, &pkt->keystroke))) {
+			pkt->received = monotime_now();
+			pkt->sent = sent_time(&msg, pkt->received);
+		}
+		conn->inbox_count++;
+	}
+	if (conn->inbox_count == INBOX_MAX)
+		conn_flags[conn_slot(conn)] |= CONN_INBOX_FULL;
+
+	/* Put the connection in line for service. */
+	if (conn->inbox_count && !conn->active) {
+		conn->active = true;
+		conn->active_next = nullptr;
+		if (active_tail)
+			active_tail->active_next = conn;
+		else
+			active_head = conn;
+		active_tail = conn;
+		active_count++;
+	}
+
+	return true;
+}
+
+
+
+static void handle_packet(struct connection *conn, const struct packet *pkt) {
+	const char *databuf = pkt->data;
+
+	/* Check if we received a chat message. */
+	if (databuf[0] == '/') {
+		/* Check if it's actually a server command. */
+		if (databuf[1] == '/') {
+			server_command(databuf + 2, conn);
+		} else {
+			recorder_log(RECORD_CHAT, conn->user, databuf + 1, strlen(databuf + 1));
+			history_log(conn->user, conn->username, databuf + 1);
+			clprintf(CONN_ALL, "<%s> %s", conn->username, databuf + 1);
+		}
+		return;
+	}
+
+	/* Queue the received data for the atc process, replacing any unsent command for the same plane. */
+	if (atcproc_is_running()) {
+		cmdqueue_owner superseded;
+		uint64_t start = pkt->trace ? monotime_now() : 0;
+		bool pushed = cmdqueue_push(databuf, command_planes, conn_handle(conn), pkt->trace, &superseded);
+		if (pkt->trace)
+			trace_span(pkt->trace, TRACE_VALIDATE, start, monotime_now());
+		if (!pushed) {
+			flightrec_log(errno == ENOBUFS ? FLIGHTREC_OVERFLOW : FLIGHTREC_REJECT, conn_fd[conn_slot(conn)], conn->user, errno, errno == ENOBUFS ? "cmdqueue" : databuf);
+			if (errno == EINVAL)
+				clputs(conn, "[server] invalid command");
+			else if (errno == ESRCH)
+				clprintf(conn, "[server] there is no plane %c", databuf[0]);
+			else
+				clputs(conn, "[server] too many commands waiting, try again");
+			return;
+		}
+		recorder_log(RECORD_INPUT, conn->user, databuf, strlen(databuf));
+		flightrec_log(FLIGHTREC_INPUT, conn_fd[conn_slot(conn)], conn->user, 0, databuf);
+		notify_superseded(superseded, databuf[0], conn);
+	}
+}
+
+
+
+static void serve_inputs(uint64_t now) {
+	/* Give each backlogged connection a quantum in turn (deficit round-robin) until nobody can make progress. */
+	size_t stalled = 0;
+	while (active_head && stalled < active_count) {
+		/* Take the connection at the front of the line. */
+		struct connection *conn = active_head;
+		active_head = conn->active_next;
+		if (!active_head)
+			active_tail = nullptr;
+		active_count--;
+
+		/* Service packets while its deficit and token bucket allow. */
+		bool progress = false;
+		conn->deficit += DRR_QUANTUM;
+		while (conn->inbox_count) {
+			struct packet *pkt = &conn->inbox[conn->inbox_head];
+			if (pkt->length > conn->deficit)
+				break;
+			if (!ratelimit_take(conn->bucket, now)) {
+				if (!pkt->throttled) {
+					pkt->throttled = true;
+					ratelimit_count_throttled(conn->bucket);
+				}
+				break;
+			}
+			conn->deficit -= pkt->length;
+			conn->inbox_head = (conn->inbox_head + 1) % INBOX_MAX;
+			conn->inbox_count--;
+			conn_flags[conn_slot(conn)] &= ~CONN_INBOX_FULL;
+			if (pkt->trace) {
+				trace_span(pkt->trace, TRACE_CLIENT, pkt->keystroke, pkt->sent);
+				trace_span(pkt->trace, TRACE_SOCKET, pkt->sent, pkt->received);
+				trace_span(pkt->trace, TRACE_INBOX, pkt->received, monotime_now());
+			}
+			handle_packet(conn, pkt);
+			progress = true;
+		}
+
+		/* Send it to the back of the line if it still has packets, or drop it out of the rotation if not. */
+		if (conn->inbox_count) {
+			if (conn->deficit > DRR_QUANTUM)
+				conn->deficit = DRR_QUANTUM;
+			conn->active_next = nullptr;
+			if (active_tail)
+				active_tail->active_next = conn;
+			else
+				active_head = conn;
+			active_tail = conn;
+			active_count++;
+		} else {
+			conn->deficit = 0;
+			conn->active = false;
+		}
+		stalled = progress ? 0 : stalled + 1;
+	}
+}
+
+
+
+static struct connection *new_connection(int fd, uint8_t flags) {
+	/* Take a free slot from the table. */
+	if (!conn_free_count) {
+		errno = ENFILE;
+		return nullptr;
+	}
+	size_t slot = conn_free[--conn_free_count];
+	if (slot >= conn_top)
+		conn_top = slot + 1;
+	struct connection *conn = &conn_slab[slot];
+	conn_fd[slot] = fd;
+	conn_flags[slot] = CONN_IN_USE | flags;
+	connection_count++;
+
+	/* Initialize the new connection. */
+	conn->user = 0;
+	conn->username = nullptr;
+	conn->outbox_head = conn->outbox_count = 0;
+	conn->inbox_head = conn->inbox_count = 0;
+	conn->bucket = -1;
+	conn->active = false;
+	conn->deficit = 0;
+	return conn;
+}
+
+
+
+/* Re-executes atcd in place, handing the listeners, every client and the running game over to the new image. Returns only on failure. */
+static void reexec(void) {
+	/* Deliver what we can of the queued commands and messages; anything still stuck is lost. */
+	if (!cmdqueue_is_empty())
+		cmdqueue_flush(UINT64_MAX);
+	clputs(CONN_ALL, "[server] restarting the server");
+	ev->flush(-1, nullptr, 0);
+	for (size_t slot = 0; slot < conn_top; slot++)
+		if (conn_flags[slot] & CONN_IN_USE)
+			flush_outbox(&conn_slab[slot]);
+
+	/* The new image will make its own standby game. Connections still with the handshake threads are closed by the exec; those clients will have to reconnect. */
+	atcproc_discard_standby();
+
+	/* Keep the game from dying unnoticed between here and the new image adopting it. */
+	sigset_t mask, oldmask;
+	sigfillset(&mask);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+	/* Write our state to an anonymous file that survives the exec. */
+	int clockfd = gameclock_get_fd();
+	int screen_master, screen_slave;
+	bool have_screen = screen_get_fds(&screen_master, &screen_slave);
+	char **argv = nullptr;
+	FILE *fp = nullptr;
+	int statefd = memfd_create("atcd-state", 0);
+	if (statefd < 0)
+		goto fail;
+	int dupfd = dup(statefd);
+	if (dupfd < 0 || !(fp = fdopen(dupfd, "w"))) {
+		if (dupfd >= 0)
+			close(dupfd);
+		goto fail;
+	}
+	fprintf(fp, "atcd-state 1\n");
+	fprintf(fp, "listen %d %d\n", listen_sock, admin_sock);
+	const uid_t *uids;
+	size_t nuids = auth_get_acl(&uids);
+	for (size_t i = 0; i < nuids; i++)
+		fprintf(fp, "acl %lu\n", (unsigned long) uids[i]);
+	const gid_t *gids;
+	size_t ngids = auth_get_groups(&gids);
+	for (size_t i = 0; i < ngids; i++)
+		fprintf(fp, "aclgroup %lu\n", (unsigned long) gids[i]);
+	uid_t macro_uid;
+	const char *macro_name, *macro_body;
+	for (size_t i = 0; macro_get(i, &macro_uid, &macro_name, &macro_body); i++)
+		fprintf(fp, "macro %lu %s %s\n", (unsigned long) macro_uid, macro_name, macro_body);
+	pid_t pid;
+	int pipefd;
+	bool paused;
+	if (atcproc_get_child(&pid, &pipefd, &paused)) {
+		fprintf(fp, "game %ld %d %d %d\n", (long) pid, pipefd, paused, auto_paused);
+		fcntl(pipefd, F_SETFD, 0);
+	}
+	if (clockfd >= 0) {
+		fprintf(fp, "clock %d\n", clockfd);
+		fcntl(clockfd, F_SETFD, 0);
+	}
+	if (have_screen) {
+		fprintf(fp, "screen %d %d\n", screen_master, screen_slave);
+		fcntl(screen_master, F_SETFD, 0);
+		fcntl(screen_slave, F_SETFD, 0);
+	}
+	for (size_t slot = 0; slot < conn_top; slot++)
+		if ((conn_flags[slot] & (CONN_IN_USE | CONN_EOF)) == CONN_IN_USE) {
+			fprintf(fp, "conn %d %lu %d %d %s\n", conn_fd[slot], (unsigned long) conn_slab[slot].user,
+					!!(conn_flags[slot] & CONN_DEBUGGING), !!(conn_flags[slot] & CONN_ADMIN), conn_slab[slot].username);
+			fcntl(conn_fd[slot], F_SETFD, 0);
+			if (conn_flags[slot] & CONN_SUBSCRIBED)
+				fprintf(fp, "subscribed %d\n", conn_fd[slot]);
+		}
+
+	/* Carry over each connected user's groups, which are only looked up in the handshake. */
+	for (size_t slot = 0; slot < conn_top; slot++) {
+		if ((conn_flags[slot] & (CONN_IN_USE | CONN_EOF)) != CONN_IN_USE)
+			continue;
+		bool seen = false;
+		for (size_t earlier = 0; earlier < slot && !seen; earlier++)
+			seen = (conn_flags[earlier] & (CONN_IN_USE | CONN_EOF)) == CONN_IN_USE && conn_slab[earlier].user == conn_slab[slot].user;
+		const gid_t *groups;
+		size_t group_count;
+		if (!seen && auth_get_member_groups(conn_slab[slot].user, &groups, &group_count))
+			for (size_t i = 0; i < group_count; i++)
+				fprintf(fp, "usergroup %lu %lu\n", (unsigned long) conn_slab[slot].user, (unsigned long) groups[i]);
+	}
+	if (fclose(fp) != 0)
+		goto fail;
+	lseek(statefd, 0, SEEK_SET);
+
+	/* Run the binary on disk, which may be newer than us, with our original arguments plus the state file. */
+	size_t argc = 0;
+	while (self_argv[argc])
+		argc++;
+	argv = malloc((argc + 3) * sizeof(*argv));
+	if (!argv)
+		goto fail;
+	memcpy(argv, self_argv, argc * sizeof(*argv));
+	char fdbuf[16];
+	snprintf(fdbuf, sizeof(fdbuf), "%d", statefd);
+	argv[argc] = "--restore";
+	argv[argc + 1] = fdbuf;
+	argv[argc + 2] = nullptr;
+	recorder_flush();
+	history_flush();
+	execv(self_path, argv);
+
+fail:
+	clprintf(CONN_ALL, "[server] restart failed: %s", strerror(errno));
+	if (atcproc_get_child(&pid, &pipefd, &paused))
+		fcntl(pipefd, F_SETFD, FD_CLOEXEC);
+	if (clockfd >= 0)
+		fcntl(clockfd, F_SETFD, FD_CLOEXEC);
+	if (have_screen) {
+		fcntl(screen_master, F_SETFD, FD_CLOEXEC);
+		fcntl(screen_slave, F_SETFD, FD_CLOEXEC);
+	}
+	free(argv);
+	if (statefd >= 0)
+		close(statefd);
+	sigprocmask(SIG_SETMASK, &oldmask, nullptr);
+}
+
+
+
+/* Loads the state written by reexec() in the image we replaced. Returns true on success, false on failure. */
+static bool restore_state(int statefd) {
+	FILE *fp = fdopen(statefd, "r");
+	if (!fp)
 		return false;
+
+	char line[512];
+	bool ok = fgets(line, sizeof(line), fp) && strcmp(line, "atcd-state 1\n") == 0;
+	if (ok)
+		auth_cleanup();
+	while (ok && fgets(line, sizeof(line), fp)) {
+		int fd, fd2, debug, admin, paused = 0, was_auto_paused = 0;
+		long pid;
+		unsigned long uid, gid;
+		char username[256];
+		if (sscanf(line, "listen %d %d", &listen_sock, &admin_sock) == 2) {
+			/* Nothing else to do. */
+		} else if (sscanf(line, "acl %lu", &uid) == 1) {
+			ok = auth_add_uid(uid);
+		} else if (sscanf(line, "aclgroup %lu", &uid) == 1) {
+			ok = auth_add_gid(uid);
+		} else if (sscanf(line, "usergroup %lu %lu", &uid, &gid) == 2) {
+			ok = auth_add_member_group(uid, gid);
+		} else if (sscanf(line, "macro %lu %255s %n", &uid, username, &fd) == 2) {
+			line[strcspn(line, "\n")] = '\0';
+			ok = macro_define(uid, username, line + fd);
+		} else if (sscanf(line, "game %ld %d %d %d", &pid, &fd, &paused, &was_auto_paused) >= 2) {
+			if (!atcproc_adopt(pid, fd, paused))
+				has_atc_exited = 1;
+			auto_paused = paused && was_auto_paused;
+		} else if (sscanf(line, "clock %d", &fd) == 1) {
+			/* Keep driving the clock the game was started with, even if --time-shim was dropped this time. */
+			gameclock_adopt(fd);
+		} else if (sscanf(line, "screen %d %d", &fd, &fd2) == 2) {
+			/* Likewise keep the game on the terminal it was started on. */
+			ok = screen_adopt(fd, fd2);
+		} else if (sscanf(line, "subscribed %d", &fd) == 1) {
+			for (size_t slot = 0; slot < conn_top; slot++)
+				if ((conn_flags[slot] & CONN_IN_USE) && conn_fd[slot] == fd)
+					conn_flags[slot] |= CONN_SUBSCRIBED;
+		} else if (sscanf(line, "conn %d %lu %d %d %255s", &fd, &uid, &debug, &admin, username) == 5) {
+			struct connection *conn = new_connection(fd, (admin ? CONN_ADMIN : 0) | (debug ? CONN_DEBUGGING : 0));
+			if (!conn || !(conn->username = intern(username)) || (conn->bucket = ratelimit_get(uid, conn->username)) < 0)
+				ok = false;
+			else
+				conn->user = uid;
+		} else {
+			ok = false;
+		}
+	}
+
+	fclose(fp);
+	if (!ok)
+		errno = EINVAL;
+	return ok;
+}
+
+
+
+/* Checks whether any connected user is currently allowed to play, as opposed to only watching after being denied. */
+static bool have_players(void) {
+	for (size_t slot = 0; slot < conn_top; slot++)
+		if ((conn_flags[slot] & (CONN_IN_USE | CONN_EOF)) == CONN_IN_USE && auth_check(conn_slab[slot].user))
+			return true;
+	return false;
+}
+
+
+
+/* Pauses the game if the last player has left, or starts counting down to resume it if a player has come back. */
+static void check_auto_pause(uint64_t now) {
+	if (!auto_pause)
+		return;
+	bool players = have_players();
+	if (!players && atcproc_is_running() && !atcproc_is_paused()) {
+		if (atcproc_pause()) {
+			auto_paused = true;
+			clputs(CONN_ALL, "[server] all players have left; pausing the game");
+		}
+	} else if (!players) {
+		countdown_left = 0;
+	} else if (auto_paused && !countdown_left) {
+		countdown_left = resume_countdown + 1;
+		countdown_next = now;
+	}
+}
+
+
+
+/* Announces the next step of the resume countdown, if due, and resumes the game at the end of it. */
+static void run_countdown(uint64_t now) {
+	while (countdown_left && countdown_next <= now) {
+		if (--countdown_left) {
+			clprintf(CONN_ALL, "[server] resuming the game in %u...", countdown_left);
+			countdown_next += 1000000000u;
+		} else if (atcproc_resume()) {
+			auto_paused = false;
+			clputs(CONN_ALL, "[server] game resumed");
+		} else {
+			auto_paused = false;
+		}
 	}
+}
+
+
 
-	/* Check for an acceptable UID. */
-	if (!auth_check(cred.uid)) {
-		clprintf(CONN_DEBUG, "[server] user denied by ACL: %s", pwd->pw_name);
+/* Welcomes a client that has finished the handshake, if the ACL allows. */
+static void admit(const struct handshake_result *result) {
+	struct connection *conn = new_connection(result->fd, result->admin ? CONN_ADMIN : 0);
+	if (!conn) {
+		clprintf(CONN_DEBUG, "[server] no room in the connection table for %s", result->text);
+		close(result->fd);
+		return;
+	}
+
+	/* Check for an acceptable UID, or membership of an acceptable group as found by the handshake. */
+	auth_set_groups(result->uid, result->groups, result->group_count);
+	if (!auth_check(result->uid)) {
+		clprintf(CONN_DEBUG, "[server] user denied by ACL: %s", result->text);
+		PROBE2(atcd, admit_denied, result->fd, result->uid);
+		flightrec_log(FLIGHTREC_DENY, result->fd, result->uid, 0, "acl");
 		clputs(conn, "MATC ACCESS");
-		return false;
+		free_connection(conn);
+		return;
 	}
 
-	/* Store a copy of the UID and username. */
-	conn->user = cred.uid;
-	conn->username = strdup(pwd->pw_name);
+	/* Store the UID and the shared copy of the username. */
+	conn->user = result->uid;
+	conn->username = intern(result->text);
 	if (!conn->username) {
-		clprintf(CONN_DEBUG, "[server] strdup failed saving username: %s", pwd->pw_name);
-		return false;
+		clprintf(CONN_DEBUG, "[server] failed interning username: %s", result->text);
+		free_connection(conn);
+		return;
+	}
+
+	/* Find the user's token bucket. */
+	conn->bucket = ratelimit_get(result->uid, conn->username);
+	if (conn->bucket < 0) {
+		clprintf(CONN_DEBUG, "[server] failed allocating token bucket: %s", result->text);
+		free_connection(conn);
+		return;
 	}
 
 	/* Accept the new user! */
+	PROBE3(atcd, admit, result->fd, result->uid, result->admin);
+	flightrec_log(FLIGHTREC_ADMIT, result->fd, result->uid, result->admin, result->text);
 	clputs(conn, "MATC OK");
 
 	/* Announce their arrival. */
 	clprintf(CONN_ALL, "[server] %s has entered the game", conn->username);
+	recorder_log(RECORD_JOIN, conn->user, conn->username, strlen(conn->username));
 
-	return true;
+	/* Tell them which planes they can command, unless it is any. */
+	if (command_planes != PLANES_ALL)
+		send_planes(conn);
+
+	/* Get the game going again if it was waiting for players. */
+	check_auto_pause(monotime_now());
 }
 
 
 
-static bool run_connection_once(struct connection *conn) {
-	/* Receive a message. */
-	char databuf[256];
-	ssize_t ret;
-	do {
-		ret = recv(conn->fd, databuf, sizeof(databuf) - 1, 0);
-	} while (ret < 0 && errno == EINTR);
-	if (ret <= 0)
-		return false;
-	databuf[ret] = '\0';
+static int run_parent(int listenfd, int adminfd) {
+	/* When we last found ourselves with nothing to do, or zero if busy. */
+	uint64_t idle_since = 0;
 
-	/* Check if we received a chat message. */
-	if (databuf[0] == '/') {
-		/* Check if it's actually a server command. */
-		if (databuf[1] == '/')
-			server_command(databuf + 2, conn);
-		else
-			clprintf(CONN_ALL, "<%s> %s", conn->username, databuf + 1);
-		return true;
+	/* The listeners must not block, since several threads accept on them until the backlog is empty. */
+	fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+	if (adminfd >= 0)
+		fcntl(adminfd, F_SETFL, fcntl(adminfd, F_GETFL) | O_NONBLOCK);
+
+	/* Leave accepting connections and the handshake to their own threads; this one runs the game. */
+	if (!handshake_start(listenfd, adminfd)) {
+		perror("atcd: start handshake threads");
+		return EXIT_FAILURE;
 	}
+	int handshakefd = handshake_get_fd();
 
-	/* Dump the received data to the atc process. */
-	if (atcproc_is_running())
-		atcproc_send(databuf);
+	for (;;) {
+		/* Restart if asked to, by //reexec or SIGHUP. */
+		if (reexec_requested) {
+			reexec_requested = 0;
+			reexec();
+		}
 
-	return true;
-}
+		/* Send what the last pass held back, so that clients it leaves backlogged are waited on below. */
+		ev->flush(-1, nullptr, 0);
 
+		/* Load up all the socket FDs to wait on, including slow clients with messages waiting to be written. */
+		ev->clear();
+		ev->watch(handshakefd, EV_READ);
+		for (size_t slot = 0; slot < conn_top; slot++) {
+			uint8_t flags = conn_flags[slot];
+			if ((flags & (CONN_IN_USE | CONN_EOF)) != CONN_IN_USE)
+				continue;
+			unsigned int events = ((flags & CONN_INBOX_FULL) ? 0 : EV_READ) | ((flags & CONN_BACKLOGGED) ? EV_WRITE : 0);
+			if (events)
+				ev->watch(conn_fd[slot], events);
+		}
 
+		/* Watch what atc draws, if we are reading its screen. */
+		int screenfd = screen_get_fd();
+		if (screenfd >= 0)
+			ev->watch(screenfd, EV_READ);
 
-static int run_parent(int listenfd) {
-	for (;;) {
-		/* Load up all the socket FDs to select() on. */
-		fd_set rfds;
-		FD_ZERO(&rfds);
-		FD_SET(listenfd, &rfds);
-		int maxfd = listenfd;
-		for (struct connection *conn = connections; conn; conn = conn->next) {
-			FD_SET(conn->fd, &rfds);
-			if (conn->fd > maxfd)
-				maxfd = conn->fd;
-		}
-		for (struct connection *conn = pending; conn; conn = conn->next) {
-			FD_SET(conn->fd, &rfds);
-			if (conn->fd > maxfd)
-				maxfd = conn->fd;
+		/* Wait for the atc pipe to drain if queued commands are stuck behind it. */
+		int atcfd = atcproc_get_fd();
+		if (atcfd >= 0 && cmdqueue_is_blocked())
+			ev->watch(atcfd, EV_WRITE);
+
+		/* Wake up when the next held command becomes due, a throttled user earns a token, or it is time to exit for idleness. */
+		uint64_t due = UINT64_MAX, next;
+		if (!cmdqueue_is_blocked() && cmdqueue_next_due(&next))
+			due = next;
+		for (const struct connection *conn = active_head; conn; conn = conn->active_next)
+			if ((next = ratelimit_next(conn->bucket)) < due)
+				due = next;
+		if (countdown_left && countdown_next < due)
+			due = countdown_next;
+		if (gameclock_next_due(monotime_now(), &next) && next < due)
+			due = next;
+		if (screen_settled && screen_settled < due)
+			due = screen_settled;
+		struct handshake_stats hs;
+		handshake_get_stats(&hs);
+		if (idle_timeout) {
+			if (connection_count || hs.pending || atcproc_is_running())
+				idle_since = 0;
+			else if (!idle_since)
+				idle_since = monotime_now();
+			if (idle_since && idle_since + idle_timeout < due)
+				due = idle_since + idle_timeout;
 		}
 
 		/* Careful! Manage the race between select()ing and getting SIGCHLD. */
@@ -273,89 +1478,206 @@ static int run_parent(int listenfd) {
 		for (;;) {
 			if (has_atc_exited) {
 				clputs(CONN_ALL, "[server] the game has ended");
+				recorder_log(RECORD_GAME_END, 0, nullptr, 0);
+				cmdqueue_clear();
+				gamestate_reset();
+				update_planes();
+				auto_paused = false;
+				countdown_left = 0;
 				has_atc_exited = 0;
+				if (use_standby)
+					atcproc_prepare();
 			}
-			if (pselect(maxfd + 1, &rfds, nullptr, nullptr, nullptr, &oldmask) >= 0)
+			if (reexec_requested) {
+				/* Go round again so the restart happens at the top of the loop. */
+				ev->clear();
+				break;
+			}
+
+			/* The game may have armed its timer since the deadline was worked out, even before signals were blocked, so look again now that no wakeup can slip past. */
+			if (gameclock_take_wakeup() && gameclock_next_due(monotime_now(), &next) && next < due)
+				due = next;
+			struct timespec timeout, *timeoutptr = nullptr;
+			if (due != UINT64_MAX) {
+				uint64_t now = monotime_now();
+				timeout = monotime_to_timespec(due > now ? due - now : 0);
+				timeoutptr = &timeout;
+			}
+			if (ev->wait(timeoutptr, &oldmask) >= 0)
 				break;
 			if (errno != EINTR) {
-				perror("pselect(sockets)");
+				perror("wait(sockets)");
 				return EXIT_FAILURE;
 			}
 		}
 		sigprocmask(SIG_SETMASK, &oldmask, nullptr);
 
-		/* First check for any progress in the connected FDs. */
-		for (struct connection *conn = connections, *nextconn = conn ? conn->next : nullptr; conn; conn = nextconn, nextconn = conn ? conn->next : nullptr)
-			if (FD_ISSET(conn->fd, &rfds))
-				if (!run_connection_once(conn)) {
-					/* Delete from linked list.*/
-					if (conn->next)
-						conn->next->prevptr = conn->prevptr;
-					*(conn->prevptr) = conn->next;
-
-					/* Shut down connection. */
-					while (close(conn->fd) < 0 && errno == EINTR);
-					clprintf(CONN_ALL, "[server] %s has exited the game", conn->username);
-					free(conn->username);
-					free(conn);
-				}
+		/* Exit if we have been idle long enough; with socket activation we will be started again on demand. */
+		handshake_get_stats(&hs);
+		if (idle_since && monotime_now() >= idle_since + idle_timeout && !connection_count && !hs.pending && !atcproc_is_running()) {
+			atcproc_discard_standby();
+			recorder_flush();
+			history_flush();
+			return EXIT_SUCCESS;
+		}
 
-		/* Next check for any progress in the pending FDs. */
-		for (struct connection *conn = pending, *nextconn = conn ? conn->next : nullptr; conn; conn = nextconn, nextconn = conn ? conn->next : nullptr)
-			if (FD_ISSET(conn->fd, &rfds)) {
-				/* Delete from linked list. */
-				if (conn->next)
-					conn->next->prevptr = conn->prevptr;
-				*(conn->prevptr) = conn->next;
-
-				/* Handle the arrived packet. */
-				if (!run_pending_connection_once(conn)) {
-					/* Shut down the connection. */
-					while (close(conn->fd) < 0 && errno == EINTR);
-					free(conn);
-				} else {
-					/* Add to the connected list. */
-					conn->next = connections;
-					conn->prevptr = &connections;
-					connections = conn;
-					if (conn->next)
-						conn->next->prevptr = &conn->next;
-				}
+		/* Take in what atc has drawn, and publish the game state once the screen has settled. */
+		if (screenfd >= 0 && (ev->ready(screenfd) & EV_READ) && screen_read()) {
+			uint64_t now = monotime_now();
+			screen_settled = now + SCREEN_SETTLE;
+			trace_echo(now);
+		}
+		if (screen_settled && monotime_now() >= screen_settled) {
+			screen_settled = 0;
+			if (atcproc_is_running()) {
+				gamestate_update(&publish_state, nullptr);
+				update_planes();
 			}
+		}
 
-		/* Finally check if we have an incoming connection on the listener. */
-		if (FD_ISSET(listenfd, &rfds)) {
-			int newfd;
-			do {
-				newfd = accept(listenfd, nullptr, nullptr);
-			} while (newfd < 0 && errno == EINTR);
-			if (newfd >= 0) {
-				/* Allocate a new connection structure. */
-				struct connection *conn = malloc(sizeof(*conn));
-				if (!conn) {
-					close(newfd);
-				} else {
-					/* Initialize the new connection. */
-					conn->fd = newfd;
-					conn->debug = false;
-					conn->user = 0;
-					conn->username = nullptr;
-
-					/* Add it to the pending list. */
-					conn->next = pending;
-					conn->prevptr = &pending;
-					pending = conn;
-					if (conn->next)
-						conn->next->prevptr = &conn->next;
-				}
+		/* First check for any progress in the connected FDs, admin connections first so their control commands run soonest. */
+		for (int pass = 0; pass < 2; pass++) {
+			uint8_t want = CONN_IN_USE | (pass == 0 ? CONN_ADMIN : 0);
+			for (size_t slot = 0; slot < conn_top; slot++)
+				if ((conn_flags[slot] & (CONN_IN_USE | CONN_ADMIN | CONN_EOF)) == want && (ev->ready(conn_fd[slot]) & EV_READ))
+					if (!run_connection_once(&conn_slab[slot]))
+						conn_flags[slot] |= CONN_EOF;
+		}
+
+		/* Send queued messages to clients that have caught up. */
+		for (size_t slot = 0; slot < conn_top; slot++)
+			if ((conn_flags[slot] & (CONN_IN_USE | CONN_EOF)) == CONN_IN_USE && (ev->ready(conn_fd[slot]) & EV_WRITE))
+				flush_outbox(&conn_slab[slot]);
+
+		/* Service the received input fairly across connections. */
+		serve_inputs(monotime_now());
+
+		/* Close connections whose peers have gone away once their input is used up. */
+		for (size_t slot = 0; slot < conn_top; slot++)
+			if ((conn_flags[slot] & (CONN_IN_USE | CONN_EOF)) == (CONN_IN_USE | CONN_EOF) && !conn_slab[slot].inbox_count) {
+				/* Shut down connection; any commands it left queued are still delivered. */
+				struct connection *conn = &conn_slab[slot];
+				clprintf(CONN_ALL, "[server] %s has exited the game", conn->username);
+				recorder_log(RECORD_LEAVE, conn->user, conn->username, strlen(conn->username));
+				free_connection(conn);
+				check_auto_pause(monotime_now());
 			}
+
+		/* Next take in the clients that have finished the handshake, and pass on news of those that failed. */
+		if (ev->ready(handshakefd) & EV_READ)
+			for (struct handshake_result *result = handshake_take(), *next_result; result; result = next_result) {
+				next_result = result->next;
+				if (result->fd >= 0)
+					admit(result);
+				else
+					clputs(CONN_DEBUG, result->text);
+				free(result);
+			}
+
+		/* Run the resume countdown. */
+		run_countdown(monotime_now());
+
+		/* Keep the game clock still while the game is paused, and deliver the game's timer. */
+		gameclock_hold(atcproc_is_paused(), monotime_now());
+		gameclock_run(monotime_now());
+
+		/* Deliver any due commands to the atc process. */
+		if (!cmdqueue_is_empty() && !cmdqueue_flush(monotime_now()))
+			cmdqueue_clear();
+	}
+}
+
+
+
+static int make_listener(union sockaddr_union *saddr, mode_t mask) {
+	int sockfd = socket(PF_UNIX, SOCK_SEQPACKET, 0);
+	if (sockfd < 0) {
+		perror("socket(PF_UNIX, SOCK_SEQPACKET, 0)");
+		return -1;
+	}
+	unlink(saddr->sun.sun_path);
+	saddr->sun.sun_family = AF_UNIX;
+	mode_t oldumask = umask(mask);
+	if (bind(sockfd, &saddr->s, sizeof(*saddr)) < 0) {
+		perror("bind");
+		return -1;
+	}
+	umask(oldumask);
+	if (listen(sockfd, 10) < 0) {
+		perror("listen");
+		return -1;
+	}
+	return sockfd;
+}
+
+
+
+/* Picks up listening sockets passed by a service manager using the LISTEN_FDS protocol. A socket named "admin" in LISTEN_FDNAMES becomes the admin socket and the first other one becomes the main socket. Returns true on success (including when none were passed), false on failure. */
+static bool inherit_listeners(void) {
+	/* Check that the sockets are meant for us. */
+	const char *pidstr = getenv("LISTEN_PID"), *fdsstr = getenv("LISTEN_FDS"), *names = getenv("LISTEN_FDNAMES");
+	if (!pidstr || !fdsstr || strtol(pidstr, nullptr, 10) != (long) getpid())
+		return true;
+	int count = atoi(fdsstr);
+
+	for (int i = 0; i < count; i++) {
+		/* Find the socket's name, if it has one. */
+		int fd = 3 + i;
+		size_t namelen = names ? strcspn(names, ":") : 0;
+		bool is_admin = namelen == 5 && memcmp(names, "admin", 5) == 0;
+		if (names) {
+			names += namelen;
+			if (*names == ':')
+				names++;
+		}
+
+		/* Make sure it is the right kind of socket. */
+		int type;
+		socklen_t typelen = sizeof(type);
+		if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typelen) < 0 || type != SOCK_SEQPACKET) {
+			fprintf(stderr, "atcd: inherited FD %d is not a SOCK_SEQPACKET socket\n", fd);
+			return false;
 		}
+
+		/* Put it in its place. */
+		if (is_admin && admin_sock < 0)
+			admin_sock = fd;
+		else if (!is_admin && listen_sock < 0)
+			listen_sock = fd;
+		else
+			close(fd);
 	}
+
+	/* Don't pass the variables on to atc. */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	return true;
 }
 
 
 
 int main(int argc, char **argv) {
+	/* Remember how we were run, before getopt permutes the arguments, so //reexec can do it again. */
+	ssize_t pathlen = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+	if (pathlen < 0) {
+		perror("readlink(/proc/self/exe)");
+		return EXIT_FAILURE;
+	}
+	self_path[pathlen] = '\0';
+	self_argv = calloc(argc + 1, sizeof(*self_argv));
+	if (!self_argv) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	for (int i = 0, j = 0; i < argc; i++) {
+		/* Leave out the state file of a previous restart. */
+		if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc)
+			i++;
+		else
+			self_argv[j++] = argv[i];
+	}
+
 	/* Initialize the authentication library. */
 	if (!auth_init()) {
 		perror("malloc");
@@ -370,6 +1692,21 @@ int main(int argc, char **argv) {
 	}
 
 	/* Scan command-line options. */
+	union sockaddr_union admin_saddr;
+	bool has_admin_path = false;
+	unsigned int rate = 20, burst = 40;
+	uint64_t handshake_timeout = 10000000000u;
+	unsigned int max_pending = 64, handshake_threads = 1;
+	const char *record_path = nullptr;
+	const char *history_path = nullptr;
+	const char *time_shim = nullptr;
+	unsigned int game_speed = 1;
+	bool game_state = false;
+	struct tuning own_tuning = {0}, atc_tuning = {0};
+	bool lock_memory = false;
+	const char *atc_cgroup = nullptr;
+	unsigned int atc_quota = 0;
+	int restore_fd = -1;
 	int ret;
 	while ((ret = getopt_long(argc, argv, shortopts, longopts, 0)) >= 0) {
 		switch (ret) {
@@ -382,35 +1719,343 @@ int main(int argc, char **argv) {
 				strcpy(saddr.sun.sun_path, optarg);
 				break;
 
+			case 'A':
+				if (strlen(optarg) + 1 > sizeof(admin_saddr.sun.sun_path)) {
+					errno = ENAMETOOLONG;
+					perror("admin socket address");
+					return EXIT_FAILURE;
+				}
+				strcpy(admin_saddr.sun.sun_path, optarg);
+				has_admin_path = true;
+				break;
+
+			case 'L': {
+				char *endptr;
+				unsigned long target = strtoul(optarg, &endptr, 10);
+				if (!*optarg || *endptr) {
+					fprintf(stderr, "%s: invalid control latency target: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				latency_set_target(target * 1000u);
+				break;
+			}
+
+			case 'a':
+				atcproc_set_binary(optarg);
+				break;
+
+			case 'w':
+				record_path = optarg;
+				break;
+
+			case 'D':
+				history_path = optarg;
+				break;
+
+			case 'V':
+				time_shim = optarg;
+				break;
+
+			case 'G':
+				game_state = true;
+				break;
+
+			case 'F':
+				if (!flightrec_set_path(optarg)) {
+					perror("flight recorder");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'u':
+			case 'U':
+				if (!tuning_parse_cpus(ret == 'u' ? &own_tuning : &atc_tuning, optarg)) {
+					fprintf(stderr, "%s: invalid CPU list: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'y':
+			case 'Y':
+				if (!tuning_parse_policy(ret == 'y' ? &own_tuning : &atc_tuning, optarg)) {
+					fprintf(stderr, "%s: invalid scheduling policy: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'm':
+				lock_memory = true;
+				break;
+
+			case 'l': {
+				unsigned int line;
+				if (!auth_load(optarg, &line)) {
+					if (line)
+						fprintf(stderr, "%s: %s: line %u: %s\n", argv[0], optarg, line, strerror(errno));
+					else
+						fprintf(stderr, "%s: %s: %s\n", argv[0], optarg, strerror(errno));
+					return EXIT_FAILURE;
+				}
+				break;
+			}
+
+			case 'k':
+				atc_cgroup = optarg;
+				break;
+
+			case 'q': {
+				char *endptr;
+				unsigned long value = strtoul(optarg, &endptr, 10);
+				if (!*optarg || *endptr || value == 0 || value > 100000) {
+					fprintf(stderr, "%s: invalid CPU quota: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				atc_quota = value;
+				break;
+			}
+
+			case 'g':
+				if (!trace_open(optarg)) {
+					perror("trace");
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'x': {
+				char *endptr;
+				unsigned long value = strcmp(optarg, "step") == 0 ? 0 : strtoul(optarg, &endptr, 10);
+				if (strcmp(optarg, "step") != 0 && (!*optarg || *endptr || value == 0 || value > GAMECLOCK_SPEED_MAX)) {
+					fprintf(stderr, "%s: invalid game speed: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				game_speed = value;
+				break;
+			}
+
+			case 'I':
+				ev = evbackend_find(optarg);
+				if (!ev) {
+					fprintf(stderr, "%s: unknown I/O backend: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 's':
+				use_standby = true;
+				break;
+
+			case 'R':
+				restore_fd = atoi(optarg);
+				break;
+
+			case 'P':
+				auto_pause = true;
+				break;
+
+			case 'C': {
+				char *endptr;
+				unsigned long seconds = strtoul(optarg, &endptr, 10);
+				if (!*optarg || *endptr || seconds > UINT_MAX - 1) {
+					fprintf(stderr, "%s: invalid resume countdown: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				resume_countdown = seconds;
+				break;
+			}
+
+			case 'H':
+			case 'M':
+			case 'T': {
+				char *endptr;
+				unsigned long value = strtoul(optarg, &endptr, 10);
+				if (!*optarg || *endptr || value == 0 || value > UINT_MAX) {
+					fprintf(stderr, "%s: invalid %s: %s\n", argv[0], ret == 'H' ? "handshake timeout" : ret == 'M' ? "pending connection limit" : "handshake thread count", optarg);
+					return EXIT_FAILURE;
+				}
+				if (ret == 'H')
+					handshake_timeout = value * 1000000000u;
+				else if (ret == 'M')
+					max_pending = value;
+				else
+					handshake_threads = value;
+				break;
+			}
+
+			case 'N': {
+				char *endptr;
+				unsigned long value = strtoul(optarg, &endptr, 10);
+				if (!*optarg || *endptr || value == 0 || value > UINT32_MAX) {
+					fprintf(stderr, "%s: invalid connection limit: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				conn_capacity = value;
+				break;
+			}
+
+			case 'i': {
+				char *endptr;
+				unsigned long timeout = strtoul(optarg, &endptr, 10);
+				if (!*optarg || *endptr) {
+					fprintf(stderr, "%s: invalid idle timeout: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				idle_timeout = timeout * 1000000000u;
+				break;
+			}
+
+			case 'c': {
+				char *endptr;
+				unsigned long delay = strtoul(optarg, &endptr, 10);
+				if (!*optarg || *endptr) {
+					fprintf(stderr, "%s: invalid coalesce delay: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				cmdqueue_set_delay(delay * 1000000u);
+				break;
+			}
+
+			case 'r':
+			case 'b': {
+				char *endptr;
+				unsigned long value = strtoul(optarg, &endptr, 10);
+				if (!*optarg || *endptr || value > UINT_MAX) {
+					fprintf(stderr, "%s: invalid %s: %s\n", argv[0], ret == 'r' ? "rate" : "burst", optarg);
+					return EXIT_FAILURE;
+				}
+				if (ret == 'r')
+					rate = value;
+				else
+					burst = value;
+				break;
+			}
+
 			default:
 				fprintf(stderr, "%s: unrecognized argument\n", argv[0]);
 				return EXIT_FAILURE;
 		}
 	}
 
-	/* Create and initialize the socket. */
-	int sockfd = socket(PF_UNIX, SOCK_SEQPACKET, 0);
-	if (sockfd < 0) {
-		perror("socket(PF_UNIX, SOCK_SEQPACKET, 0)");
+	/* Apply the input rate limits and handshake limits. */
+	ratelimit_configure(rate, burst);
+	handshake_configure(handshake_timeout, max_pending, handshake_threads);
+
+	/* Schedule ourselves as asked before starting any threads, which inherit it, and set up how the game is to be. */
+	if (!tuning_apply(&own_tuning, 0)) {
+		fprintf(stderr, "%s: scheduling: %s\n", argv[0], strerror(errno));
 		return EXIT_FAILURE;
 	}
-	unlink(saddr.sun.sun_path);
-	saddr.sun.sun_family = AF_UNIX;
-	mode_t oldumask = umask(0);
-	if (bind(sockfd, &saddr.s, sizeof(saddr)) < 0) {
-		perror("bind");
+	if (lock_memory && !tuning_lock_memory()) {
+		fprintf(stderr, "%s: locking memory: %s\n", argv[0], strerror(errno));
 		return EXIT_FAILURE;
 	}
-	umask(oldumask);
-	if (listen(sockfd, 10) < 0) {
-		perror("listen");
+	if (atc_quota && !atc_cgroup) {
+		fprintf(stderr, "%s: a CPU quota needs --atc-cgroup\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (atc_cgroup && !tuning_make_cgroup(atc_cgroup, atc_quota)) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], atc_cgroup, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	atcproc_set_tuning(&atc_tuning, atc_cgroup);
+
+	/* Set up the connection table. */
+	if (!conn_table_init(conn_capacity)) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	/* Set up the I/O backend, with room for every connection, the handshake threads, the atc pipe and its screen. */
+	if (!ev)
+		ev = evbackend_default();
+	if (!ev->init(conn_capacity + 3, &message_sent)) {
+		/* A kernel too old for a backend is no reason not to run; fall back to the portable one. */
+		fprintf(stderr, "%s: %s backend: %s\n", argv[0], ev->name, strerror(errno));
+		if (ev == evbackend_default() || !evbackend_default()->init(conn_capacity + 3, &message_sent))
+			return EXIT_FAILURE;
+		ev = evbackend_default();
+		fprintf(stderr, "%s: using the %s backend instead\n", argv[0], ev->name);
+	}
+
+	/* Have commands written to the game along with the backend's other output. */
+	atcproc_set_writer(ev->flush);
+
+	/* Start recording the session, if asked to. */
+	if (record_path && !recorder_open(record_path)) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], record_path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* Keep chat history, if asked to. */
+	if (history_path && !history_open(history_path)) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], history_path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* Run games by a virtual clock, if asked to. */
+	if (time_shim && !gameclock_init(time_shim, game_speed)) {
+		fprintf(stderr, "%s: game clock: %s\n", argv[0], strerror(errno));
 		return EXIT_FAILURE;
 	}
 
 	/* Set the callback for child death. */
 	atcproc_set_cb(&atc_death_cb);
 
+	if (restore_fd >= 0) {
+		/* Pick up where the image we replaced left off. */
+		if (!restore_state(restore_fd)) {
+			perror("atcd: restore state");
+			return EXIT_FAILURE;
+		}
+		clputs(CONN_ALL, "[server] server restarted");
+
+		/* Have the game redraw its screen, which this image has not seen. */
+		cmdqueue_owner superseded;
+		if (screen_get_fd() >= 0 && atcproc_is_running())
+			cmdqueue_push("\x0c", command_planes, 0, 0, &superseded);
+	} else {
+		/* Use sockets passed in by a service manager, if any. */
+		if (!inherit_listeners())
+			return EXIT_FAILURE;
+
+		/* Otherwise create and initialize the socket, open to everyone (the ACL decides who gets in). */
+		if (listen_sock < 0)
+			listen_sock = make_listener(&saddr, 0);
+		if (listen_sock < 0)
+			return EXIT_FAILURE;
+
+		/* Create the admin socket, if requested and not inherited, accessible only to our own user. */
+		if (has_admin_path && admin_sock < 0) {
+			admin_sock = make_listener(&admin_saddr, 077);
+			if (admin_sock < 0)
+				return EXIT_FAILURE;
+		}
+	}
+
+	/* Run games on a terminal of our own, so that we can read their state off the screen, if asked to and not already handed one. */
+	if (game_state && screen_get_fd() < 0 && !screen_open()) {
+		fprintf(stderr, "%s: game screen: %s\n", argv[0], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* Restart on SIGHUP, dump the flight recorder on SIGUSR1 or when dying, and undo the signal mask a restart leaves behind. */
+	struct sigaction sa;
+	sa.sa_handler = &hup_sig_handler;
+	sigfillset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(SIGHUP, &sa, nullptr);
+	if (!flightrec_install()) {
+		perror("atcd: flight recorder");
+		return EXIT_FAILURE;
+	}
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, nullptr);
+
+	/* Get the first game ready. */
+	if (use_standby && !atcproc_prepare())
+		perror("atcd: standby game");
+
 	/* Run. */
-	return run_parent(sockfd);
+	return run_parent(listen_sock, admin_sock);
 }
 
@@ -1,14 +1,20 @@
 #include "atcproc.h"
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
-#include <sys/resource.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include "flightrec.h"
+#include "tuning.h"
+#include "../shared/probes.h"
+#include "../shared/vclock.h"
 
 
 
@@ -18,9 +24,39 @@ static volatile pid_t child_pid = -1;
 /* The write end of the data pipe, or -1 if none currently open. */
 static volatile int pipe_write = -1;
 
+/* Whether the running ATC process is stopped by atcproc_pause(). */
+static volatile bool child_paused = false;
+
+/* The process ID of the standby process waiting to become ATC, or -1 if none. */
+static volatile pid_t standby_pid = -1;
+
+/* The write ends of the standby process's data and control pipes, or -1 if none. */
+static volatile int standby_input = -1, standby_control = -1;
+
 /* The callback function. */
 static void (*volatile child_death_callback)(void) = nullptr;
 
+/* The ATC binary as configured, and as resolved against PATH (empty if not yet resolved). */
+static const char *binary_name = "atc";
+static char binary_path[PATH_MAX] = "";
+
+/* The library to preload into ATC and the FD to pass it as VCLOCK_FD, or nullptr and -1 for none. */
+static const char *preload_library = nullptr;
+static int preload_fd = -1;
+
+/* The terminal to run ATC on, or -1 to leave it atcd's. */
+static int terminal_fd = -1;
+
+/* How to schedule ATC, and the cgroup to run it in, or nullptr for none. */
+static struct tuning child_tuning;
+static const char *child_cgroup = nullptr;
+
+/* How writes to ATC are done. */
+static ssize_t (*pipe_writer)(int fd, const struct iovec *iov, int iovcnt) = &writev;
+
+/* The environment to run ATC with, built when first needed. */
+static char **child_environ = nullptr;
+
 
 
 /* A signal handler to handle SIGINT/SIGTERM sent to the parent. */
@@ -34,23 +70,37 @@ static void term_sig_handler(int signum __attribute__((unused))) {
 
 /* A signal handler to handle SIGCHLD sent to the parent. */
 static void child_sig_handler(int signum __attribute__((unused))) {
-	/* Fetch and clear child PID. */
-	pid_t pid = child_pid;
-	child_pid = -1;
+	int saved_errno = errno;
 
-	/* Close and clear pipe write FD. */
-	if (pipe_write != -1)
-		close(pipe_write);
-	pipe_write = -1;
-
-	/* Reap the child. */
+	/* Reap every child that has died; it may be the game, the standby, or one already reaped by atcproc_stop(). */
+	pid_t pid;
 	int status;
-	if (waitpid(pid, &status, 0) < 0)
-		return;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		if (pid == child_pid) {
+			PROBE2(atcd, atc_death, pid, status);
+			flightrec_log(FLIGHTREC_ATC_DEATH, -1, -1, status, nullptr);
+
+			/* Clear child PID. */
+			child_pid = -1;
+
+			/* Close and clear pipe write FD. */
+			if (pipe_write != -1)
+				close(pipe_write);
+			pipe_write = -1;
+
+			/* Call the callback. */
+			if (child_death_callback)
+				child_death_callback();
+		} else if (pid == standby_pid) {
+			/* The standby died before being used; forget it. */
+			standby_pid = -1;
+			close(standby_input);
+			close(standby_control);
+			standby_input = standby_control = -1;
+		}
+	}
 
-	/* Call the callback. */
-	if (child_death_callback)
-		child_death_callback();
+	errno = saved_errno;
 }
 
 
@@ -74,32 +124,335 @@ static void restore_sigs(const sigset_t *old_mask) {
 
 
 
-bool atcproc_start(const char *game) {
-	bool ret = false;
-
-	/* Block all signals to avoid race conditions. */
-	sigset_t saved_mask;
-	block_sigs(&saved_mask);
-
+/* Installs the signal handlers needed while a child may exist. Returns true on success, false on failure. */
+static bool install_handlers(void) {
 	/* Handle SIGINT/SIGTERM. */
 	struct sigaction sa;
 	sa.sa_handler = &term_sig_handler;
 	sigfillset(&sa.sa_mask);
 	sa.sa_flags = 0;
 	if (sigaction(SIGINT, &sa, nullptr) < 0)
-		goto out;
+		return false;
 	if (sigaction(SIGTERM, &sa, nullptr) < 0)
-		goto out;
+		return false;
 
 	/* Ignore SIGPIPE. */
 	sa.sa_handler = SIG_IGN;
 	if (sigaction(SIGPIPE, &sa, nullptr) < 0)
-		goto out;
+		return false;
 
 	/* Install signal handler for SIGCHLD. */
 	sa.sa_handler = &child_sig_handler;
 	sa.sa_flags = SA_NOCLDSTOP;
 	if (sigaction(SIGCHLD, &sa, nullptr) < 0)
+		return false;
+
+	return true;
+}
+
+
+
+/* Resolves the ATC binary against PATH, once. Returns true on success, false on failure. */
+static bool resolve_binary(void) {
+	/* Check if we already know where it is. */
+	if (binary_path[0])
+		return true;
+
+	/* A name with a slash in it is used as is. */
+	if (strchr(binary_name, '/')) {
+		if (strlen(binary_name) + 1 > sizeof(binary_path)) {
+			errno = ENAMETOOLONG;
+			return false;
+		}
+		strcpy(binary_path, binary_name);
+		return true;
+	}
+
+	/* Otherwise search PATH the same way execlp() would. */
+	const char *path = getenv("PATH");
+	if (!path)
+		path = "/bin:/usr/bin";
+	while (*path) {
+		size_t dirlen = strcspn(path, ":");
+		int len;
+		if (dirlen)
+			len = snprintf(binary_path, sizeof(binary_path), "%.*s/%s", (int) dirlen, path, binary_name);
+		else
+			len = snprintf(binary_path, sizeof(binary_path), "./%s", binary_name);
+		if (len > 0 && (size_t) len < sizeof(binary_path) && access(binary_path, X_OK) == 0)
+			return true;
+		path += dirlen;
+		if (*path == ':')
+			path++;
+	}
+
+	binary_path[0] = '\0';
+	errno = ENOENT;
+	return false;
+}
+
+
+
+/* Builds the environment for ATC: ours, plus what the preloaded library needs. Returns true on success, false on failure. */
+static bool build_environment(void) {
+	if (child_environ)
+		return true;
+	if (!preload_library) {
+		child_environ = environ;
+		return true;
+	}
+
+	/* Copy our environment, leaving out the variables to be replaced. */
+	size_t count = 0;
+	while (environ[count])
+		count++;
+	char **env = calloc(count + 3, sizeof(*env));
+	if (!env)
+		return false;
+	const char *old_preload = getenv("LD_PRELOAD");
+	size_t j = 0;
+	for (size_t i = 0; i < count; i++)
+		if (strncmp(environ[i], "LD_PRELOAD=", 11) != 0 && strncmp(environ[i], VCLOCK_ENV "=", strlen(VCLOCK_ENV) + 1) != 0)
+			env[j++] = environ[i];
+
+	/* Add the library ahead of any already being preloaded, and say where the clock is. */
+	size_t length = strlen("LD_PRELOAD=") + strlen(preload_library) + (old_preload ? 1 + strlen(old_preload) : 0) + 1;
+	char *preload = malloc(length);
+	if (!preload) {
+		free(env);
+		return false;
+	}
+	snprintf(preload, length, "LD_PRELOAD=%s%s%s", preload_library, old_preload ? ":" : "", old_preload ? old_preload : "");
+	env[j++] = preload;
+	static char clock_var[32];
+	snprintf(clock_var, sizeof(clock_var), "%s=%d", VCLOCK_ENV, VCLOCK_FD);
+	env[j++] = clock_var;
+	child_environ = env;
+	return true;
+}
+
+
+
+/* Schedules an ATC process as configured. Returns true on success, false on failure. */
+static bool apply_tuning(pid_t pid) {
+	if (child_cgroup && !tuning_join_cgroup(child_cgroup, pid))
+		return false;
+	return tuning_apply(&child_tuning, pid);
+}
+
+
+
+/* Runs in a standby process: waits to be told the game, then becomes ATC. Never returns. */
+static void __attribute__((noreturn)) run_standby(int input, int control, int clock, int terminal, const sigset_t *mask) {
+	/* Put the data pipe on stdin, and the terminal, if any, on stdout and stderr. */
+	if (dup2(input, 0) < 0)
+		_exit(EXIT_FAILURE);
+	if (terminal >= 0 && (dup2(terminal, 1) < 0 || dup2(terminal, 2) < 0))
+		_exit(EXIT_FAILURE);
+
+	/* Put the clock, if any, where ATC expects it, moving the control pipe out of the way if need be. */
+	int first_closed = 3;
+	if (clock >= 0) {
+		if (control == VCLOCK_FD && (control = fcntl(control, F_DUPFD_CLOEXEC, VCLOCK_FD + 1)) < 0)
+			_exit(EXIT_FAILURE);
+		if (dup2(clock, VCLOCK_FD) < 0)
+			_exit(EXIT_FAILURE);
+		first_closed = VCLOCK_FD + 1;
+	}
+
+	/* Close everything else except the control pipe, which is close-on-exec. */
+	if (control > first_closed)
+		close_range(first_closed, control - 1, 0);
+	close_range(control + 1, ~0U, 0);
+
+	/* Go back to default signal handling, as ATC would get from a fresh exec. */
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	sigprocmask(SIG_SETMASK, mask, nullptr);
+
+	/* Wait for the parent to send "!" followed by the game name and close the pipe; plain EOF means give up. */
+	char buffer[256];
+	size_t length = 0;
+	ssize_t ret;
+	while (length < sizeof(buffer) - 1 && (ret = read(control, buffer + length, sizeof(buffer) - 1 - length)) != 0) {
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			_exit(EXIT_FAILURE);
+		}
+		length += ret;
+	}
+	if (length == 0 || buffer[0] != '!')
+		_exit(EXIT_SUCCESS);
+	buffer[length] = '\0';
+
+	/* Execute ATC. */
+	char *argv[] = {(char *) binary_name, buffer + 1, nullptr};
+	if (!buffer[1])
+		argv[1] = nullptr;
+	execve(binary_path, argv, child_environ);
+	static const char message[] = "atcd: standby execve failed\n";
+	[[maybe_unused]] ssize_t ssz = write(2, message, sizeof(message) - 1);
+	_exit(EXIT_FAILURE);
+}
+
+
+
+void atcproc_set_binary(const char *name) {
+	binary_name = name;
+	binary_path[0] = '\0';
+}
+
+
+
+void atcproc_set_preload(const char *library, int clock_fd) {
+	preload_library = library;
+	preload_fd = clock_fd;
+}
+
+
+
+void atcproc_set_terminal(int fd) {
+	terminal_fd = fd;
+}
+
+
+
+void atcproc_set_writer(ssize_t (*writer)(int fd, const struct iovec *iov, int iovcnt)) {
+	pipe_writer = writer;
+}
+
+
+
+void atcproc_set_tuning(const struct tuning *tuning, const char *cgroup) {
+	child_tuning = *tuning;
+	child_cgroup = cgroup;
+}
+
+
+
+bool atcproc_prepare(void) {
+	bool ret = false;
+
+	/* Block all signals to avoid race conditions. */
+	sigset_t saved_mask;
+	block_sigs(&saved_mask);
+
+	/* Check whether a standby is already waiting. */
+	if (standby_pid >= 0) {
+		ret = true;
+		goto out;
+	}
+
+	/* Set up signal handling, find the binary and make its environment. */
+	if (!install_handlers() || !resolve_binary() || !build_environment())
+		goto out;
+
+	/* Create the data and control pipes. */
+	int inputfds[2], controlfds[2];
+	if (pipe2(inputfds, O_CLOEXEC) < 0)
+		goto out;
+	if (pipe2(controlfds, O_CLOEXEC) < 0) {
+		close(inputfds[0]);
+		close(inputfds[1]);
+		goto out;
+	}
+
+	/* Fork the standby. */
+	pid_t pid = fork();
+	if (pid == 0)
+		run_standby(inputfds[0], controlfds[0], preload_fd, terminal_fd, &saved_mask);
+	close(inputfds[0]);
+	close(controlfds[0]);
+	if (pid < 0) {
+		close(inputfds[1]);
+		close(controlfds[1]);
+		goto out;
+	}
+
+	/*
+	 * Give it ATC's scheduling now, so that waking up later costs nothing
+	 * more. This is done from here because the child of a threaded process
+	 * may only make async-signal-safe calls until it execs.
+	 */
+	if (!apply_tuning(pid)) {
+		int saved_errno = errno;
+		kill(pid, SIGKILL);
+		while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR);
+		close(inputfds[1]);
+		close(controlfds[1]);
+		errno = saved_errno;
+		goto out;
+	}
+
+	/* Record the standby. */
+	standby_pid = pid;
+	standby_input = inputfds[1];
+	standby_control = controlfds[1];
+	fcntl(standby_input, F_SETFL, fcntl(standby_input, F_GETFL) | O_NONBLOCK);
+	ret = true;
+
+out:
+	restore_sigs(&saved_mask);
+	return ret;
+}
+
+
+
+void atcproc_discard_standby(void) {
+	sigset_t saved_mask;
+	block_sigs(&saved_mask);
+	if (standby_pid >= 0) {
+		kill(standby_pid, SIGKILL);
+		while (waitpid(standby_pid, nullptr, 0) < 0 && errno == EINTR);
+		close(standby_input);
+		close(standby_control);
+		standby_pid = -1;
+		standby_input = standby_control = -1;
+	}
+	restore_sigs(&saved_mask);
+}
+
+
+
+/* Hands the game to the standby process. Must be called with signals blocked. Returns true on success, false on failure (the standby is then discarded). */
+static bool start_standby(const char *game) {
+	/* Tell it which game to play; the message fits in the pipe buffer so the write is all or nothing. */
+	char message[256];
+	int length = snprintf(message, sizeof(message), "!%s", game ? game : "");
+	bool ok = length > 0 && (size_t) length < sizeof(message) && write(standby_control, message, length) == length;
+	close(standby_control);
+	standby_control = -1;
+
+	/* Adopt it as the game, or kill it if it could not be told. */
+	if (ok) {
+		PROBE2(atcd, atc_start, standby_pid, standby_input);
+		flightrec_log(FLIGHTREC_ATC_START, standby_input, -1, standby_pid, game);
+		child_pid = standby_pid;
+		child_paused = false;
+		pipe_write = standby_input;
+	} else {
+		kill(standby_pid, SIGKILL);
+		close(standby_input);
+	}
+	standby_pid = -1;
+	standby_input = -1;
+	return ok;
+}
+
+
+
+bool atcproc_start(const char *game) {
+	bool ret = false;
+
+	/* Block all signals to avoid race conditions. */
+	sigset_t saved_mask;
+	block_sigs(&saved_mask);
+
+	/* Set up signal handling. */
+	if (!install_handlers())
 		goto out;
 
 	/* Check if a child process is already running. */
@@ -108,47 +461,79 @@ bool atcproc_start(const char *game) {
 		goto out;
 	}
 
+	/* If a standby process is waiting, just wake it up. */
+	if (standby_pid >= 0 && start_standby(game)) {
+		ret = true;
+		goto out;
+	}
+
+	/* Find the binary and make its environment. */
+	if (!resolve_binary() || !build_environment())
+		goto out;
+
 	/* Create the pipe. */
 	int pipefds[2];
-	if (pipe(pipefds) < 0)
+	if (pipe2(pipefds, O_CLOEXEC) < 0)
 		goto out;
 
-	/* Fork. */
-	pid_t pid = fork();
-	if (pid < 0)
+	/* Arrange for the child to get the pipe reader as stdin, the clock if any, no other FDs beyond stdout/stderr, default signal handling and our original signal mask. */
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attr);
+	posix_spawn_file_actions_adddup2(&actions, pipefds[0], 0);
+	if (terminal_fd >= 0) {
+		posix_spawn_file_actions_adddup2(&actions, terminal_fd, 1);
+		posix_spawn_file_actions_adddup2(&actions, terminal_fd, 2);
+	}
+	if (preload_fd >= 0)
+		posix_spawn_file_actions_adddup2(&actions, preload_fd, VCLOCK_FD);
+	posix_spawn_file_actions_addclosefrom_np(&actions, preload_fd >= 0 ? VCLOCK_FD + 1 : 3);
+	sigset_t defaults;
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGINT);
+	sigaddset(&defaults, SIGTERM);
+	sigaddset(&defaults, SIGCHLD);
+	sigaddset(&defaults, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	posix_spawnattr_setsigmask(&attr, &saved_mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+	/* Spawn ATC. */
+	char *argv[] = {(char *) binary_name, (char *) game, nullptr};
+	pid_t pid;
+	int err = posix_spawn(&pid, binary_path, &actions, &attr, argv, child_environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(pipefds[0]);
+	if (err) {
+		close(pipefds[1]);
+		/* Look the binary up again next time, in case it moved. */
+		binary_path[0] = '\0';
+		errno = err;
 		goto out;
-	else if (pid == 0) {
-		/* Child process. Copy the pipe reader to stdin. */
-		if (dup2(pipefds[0], 0) < 0) {
-			perror("dup2");
-			exit(EXIT_FAILURE);
-		}
-		/* Get the number of possible FDs. */
-		struct rlimit rlim;
-		getrlimit(RLIMIT_NOFILE, &rlim);
-		/* Close everything except stdin/stdout/stderr. */
-		for (unsigned int i = 3; i < rlim.rlim_cur; i++)
-			close(i);
-		/* Restore the signal mask (we want to leave signals unblocked in atc). */
-		restore_sigs(&saved_mask);
-		/* Execute ATC. */
-		if (game)
-			execlp("atc", "atc", game, (const char *) nullptr);
-		else
-			execlp("atc", "atc", (const char *) nullptr);
-		/* If we got here, execlp() failed. */
-		perror("execlp");
-		exit(EXIT_FAILURE);
-	} else {
-		/* Parent process. Record child PID and pipe write FD. */
-		child_pid = pid;
-		pipe_write = pipefds[1];
-		/* Close the pipe read FD. */
-		close(pipefds[0]);
-		/* Done! */
-		ret = true;
 	}
 
+	/* Schedule it as configured, before it is sent anything; a game that cannot be is not started. */
+	if (!apply_tuning(pid)) {
+		int saved_errno = errno;
+		kill(pid, SIGKILL);
+		close(pipefds[1]);
+		errno = saved_errno;
+		goto out;
+	}
+
+	/* Record child PID and pipe write FD. */
+	PROBE2(atcd, atc_start, pid, pipefds[1]);
+	flightrec_log(FLIGHTREC_ATC_START, pipefds[1], -1, pid, game);
+	child_pid = pid;
+	child_paused = false;
+	pipe_write = pipefds[1];
+	/* Make the pipe write FD non-blocking so a busy ATC cannot stall us. */
+	fcntl(pipe_write, F_SETFL, fcntl(pipe_write, F_GETFL) | O_NONBLOCK);
+	/* Done! */
+	ret = true;
+
 out:
 	restore_sigs(&saved_mask);
 	return ret;
@@ -189,6 +574,8 @@ bool atcproc_stop(void) {
 		goto out;
 
 	/* We have reaped the child, so clear its PID and close the pipe. The signal handler will no-op. */
+	PROBE2(atcd, atc_stop, died_pid, status);
+	flightrec_log(FLIGHTREC_ATC_STOP, -1, -1, died_pid, nullptr);
 	child_pid = -1;
 	close(pipe_write);
 	pipe_write = -1;
@@ -217,6 +604,7 @@ bool atcproc_pause(void) {
 	/* Send it SIGSTOP. */
 	if (kill(child_pid, SIGSTOP) < 0)
 		goto out;
+	child_paused = true;
 
 	/* Success! */
 	ret = true;
@@ -244,6 +632,7 @@ bool atcproc_resume(void) {
 	/* Send it SIGCONT. */
 	if (kill(child_pid, SIGCONT) < 0)
 		goto out;
+	child_paused = false;
 
 	/* Success! */
 	ret = true;
@@ -255,6 +644,28 @@ out:
 
 
 
+bool atcproc_signal(int signum) {
+	bool ret = false;
+
+	/* Block signals to avoid race conditions. */
+	sigset_t saved_mask;
+	block_sigs(&saved_mask);
+
+	/* Check that the child PID is valid. */
+	if (child_pid < 0) {
+		errno = ESRCH;
+		goto out;
+	}
+
+	ret = kill(child_pid, signum) == 0;
+
+out:
+	restore_sigs(&saved_mask);
+	return ret;
+}
+
+
+
 bool atcproc_is_running(void) {
 	sigset_t saved_mask;
 	block_sigs(&saved_mask);
@@ -265,23 +676,90 @@ bool atcproc_is_running(void) {
 
 
 
-bool atcproc_send(const char *string) {
+ssize_t atcproc_sendv(const struct iovec *iov, int iovcnt) {
 	sigset_t saved_mask;
-	bool ret = false;
 	ssize_t written;
 
 	/* Block signals to avoid race condition. */
 	block_sigs(&saved_mask);
 
-	/* As long as we have data left, keep trying to write it. */
-	while (string[0] != '\0') {
-		written = write(pipe_write, string, strlen(string));
-		if (written < 0)
-			goto out;
-		string += written;
+	/* Check that the pipe is open. */
+	if (pipe_write < 0) {
+		errno = ESRCH;
+		written = -1;
+		goto out;
 	}
 
-	/* Done! */
+	/* Write as much as the pipe will take right now. */
+	do {
+		written = pipe_writer(pipe_write, iov, iovcnt);
+	} while (written < 0 && errno == EINTR);
+	PROBE3(atcd, atc_write, pipe_write, iovcnt, written);
+
+out:
+	restore_sigs(&saved_mask);
+	return written;
+}
+
+
+
+int atcproc_get_fd(void) {
+	sigset_t saved_mask;
+	block_sigs(&saved_mask);
+	int ret = pipe_write;
+	restore_sigs(&saved_mask);
+	return ret;
+}
+
+
+
+bool atcproc_is_paused(void) {
+	sigset_t saved_mask;
+	block_sigs(&saved_mask);
+	bool ret = child_pid != -1 && child_paused;
+	restore_sigs(&saved_mask);
+	return ret;
+}
+
+
+
+bool atcproc_get_child(pid_t *pid, int *fd, bool *paused) {
+	sigset_t saved_mask;
+	block_sigs(&saved_mask);
+	bool ret = child_pid != -1;
+	*pid = child_pid;
+	*fd = pipe_write;
+	*paused = child_paused;
+	restore_sigs(&saved_mask);
+	return ret;
+}
+
+
+
+bool atcproc_adopt(pid_t pid, int fd, bool paused) {
+	bool ret = false;
+
+	/* Block signals to avoid race conditions. */
+	sigset_t saved_mask;
+	block_sigs(&saved_mask);
+
+	/* Set up signal handling. */
+	if (!install_handlers())
+		goto out;
+
+	/* The child may have died while nobody was handling SIGCHLD. */
+	int status;
+	if (waitpid(pid, &status, WNOHANG) != 0) {
+		close(fd);
+		errno = ESRCH;
+		goto out;
+	}
+
+	/* Record child PID and pipe write FD, which must not leak into future children. */
+	child_pid = pid;
+	pipe_write = fd;
+	child_paused = paused;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
 	ret = true;
 
 out:
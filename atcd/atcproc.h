@@ -2,8 +2,34 @@
 #define ATCPROC_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
-/* Launches an ATC process. Returns true on success, false on failure. */
+struct tuning;
+
+/* Sets the name or path of the ATC binary. A name without a slash is looked up in PATH when first needed. */
+void atcproc_set_binary(const char *name);
+
+/* Has ATC run with a library preloaded and an FD passed to it as VCLOCK_FD, both announced in its environment. */
+void atcproc_set_preload(const char *library, int clock_fd);
+
+/* Has ATC run with a terminal FD as its standard output and error, in place of atcd's own, or -1 to go back to atcd's. */
+void atcproc_set_terminal(int fd);
+
+/* Has writes to ATC done by a function like writev(), e.g. one that sends them along with other output, in place of writev() itself. */
+void atcproc_set_writer(ssize_t (*writer)(int fd, const struct iovec *iov, int iovcnt));
+
+/* Has ATC scheduled as configured and, if cgroup is not nullptr, run in a cgroup (v2) directory. */
+void atcproc_set_tuning(const struct tuning *tuning, const char *cgroup);
+
+/* Forks a standby process that waits, ready to become ATC, so the next atcproc_start() only has to wake it. Returns true on success (or if one is already waiting), false on failure. */
+bool atcproc_prepare(void);
+
+/* Kills and reaps any standby process. */
+void atcproc_discard_standby(void);
+
+/* Launches an ATC process, using the standby process if there is one. Returns true on success, false on failure. */
 bool atcproc_start(const char *game);
 
 /* Stops any running process. Returns true on success, false on failure. */
@@ -15,11 +41,26 @@ bool atcproc_pause(void);
 /* Resumes a paused ATC process. Returns true on success, false on failure. */
 bool atcproc_resume(void);
 
+/* Sends a signal to a running ATC process. Returns true on success, false on failure. */
+bool atcproc_signal(int signum);
+
 /* Checks whether a child process is already running. Returns true if so, false if not. */
 bool atcproc_is_running(void);
 
-/* Sends data to a running process. Returns true on success, false on failure. */
-bool atcproc_send(const char *string);
+/* Checks whether the running process is paused. Returns true if so, false if not (or if none is running). */
+bool atcproc_is_paused(void);
+
+/* Sends data, gathered from several buffers, to a running process without blocking. Returns the number of bytes accepted (possibly fewer than the total), or -1 on failure (errno=EAGAIN if the pipe is full). */
+ssize_t atcproc_sendv(const struct iovec *iov, int iovcnt);
+
+/* Gets the write end of the pipe to the running process, for waiting on writability. Returns -1 if no process is running. */
+int atcproc_get_fd(void);
+
+/* Gets the running ATC process, the write end of its pipe and whether it is paused, for handing over across exec. Returns true if one is running, false if not. */
+bool atcproc_get_child(pid_t *pid, int *fd, bool *paused);
+
+/* Takes over an ATC process and pipe inherited across exec. Returns true if it is still running, false (having reaped it) if it already died. */
+bool atcproc_adopt(pid_t pid, int fd, bool paused);
 
 /* Specifies what function should be invoked when the ATC process dies. */
 void atcproc_set_cb(void (*cb)(void));
@@ -1,52 +1,87 @@
 #include "auth.h"
+#include <ctype.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <grp.h>
 #include <pwd.h>
 
 
 
+/* A user seen by the ACL check: the groups they were last found to be in, and whether the ACL lets them in. */
+struct member {
+	uid_t uid;
+	bool used;
+
+	/* Whether the groups have been looked up, and what they are. */
+	bool groups_known;
+	size_t group_count;
+	gid_t *groups;
+
+	/* Whether the user is allowed, as worked out for an ACL generation; the answer is stale once the ACL changes. */
+	unsigned long generation;
+	bool allowed;
+};
+
 static size_t allowed_count = 0, allowed_alloc = 0;
 static uid_t *allowed = nullptr;
 
+static size_t groups_count = 0, groups_alloc = 0;
+static gid_t *allowed_groups = nullptr;
+
+/* Incremented on every change to the ACL. */
+static unsigned long generation = 1;
+
+/* The users seen so far, hashed by UID with linear probing; the table size is zero or a power of two. */
+static size_t members_count = 0, members_alloc = 0;
+static struct member *members = nullptr;
 
 
-/* Ensures the array is large enough to store at least one more element. */
-static bool grow_array(void) {
+
+/* Ensures an array is large enough to store at least one more element. Returns the array, which may have moved, or nullptr (leaving the old one as it was) if there is no memory. */
+static void *grow_array(void *array, size_t count, size_t *alloc, size_t size) {
 	/* Check whether the array needs growing at all. */
-	if (allowed_count < allowed_alloc)
-		return true;
+	if (count < *alloc)
+		return array;
 
 	/* Decide how much to grow the array. */
 	size_t new_alloc;
-	if (allowed_alloc == 0)
+	if (*alloc == 0)
 		new_alloc = 1;
-	else if (allowed_alloc < 4)
+	else if (*alloc < 4)
 		new_alloc = 4;
 	else
-		new_alloc = allowed_alloc * 2;
+		new_alloc = *alloc * 2;
 
 	/* Grow the array. */
-	uid_t *new;
-	if (allowed)
-		new = realloc(allowed, new_alloc * sizeof(*allowed));
+	void *new;
+	if (array)
+		new = realloc(array, new_alloc * size);
 	else
-		new = malloc(new_alloc * sizeof(*allowed));
+		new = malloc(new_alloc * size);
 	if (!new)
-		return false;
+		return nullptr;
 
-	allowed = new;
-	allowed_alloc = new_alloc;
+	*alloc = new_alloc;
 
-	return true;
+	return new;
 }
 
 
 
 /* Translates a string into a UID. Returns true on success, false on failure. */
 static bool to_uid(const char *name, uid_t *uid) {
+	/* An empty name is not user 0. */
+	if (!*name) {
+		errno = EINVAL;
+		return false;
+	}
+
 	/* Try first translating it numerically. */
 	char *endptr;
 	*uid = strtoul(name, &endptr, 10);
@@ -56,6 +91,7 @@ static bool to_uid(const char *name, uid_t *uid) {
 	/* Try translating it through /etc/passwd. */
 	struct passwd *pwd;
 	do {
+		errno = 0;
 		pwd = getpwnam(name);
 	} while (!pwd && errno == EINTR);
 	if (pwd) {
@@ -63,6 +99,89 @@ static bool to_uid(const char *name, uid_t *uid) {
 		return true;
 	}
 
+	if (!errno)
+		errno = ENOENT;
+	return false;
+}
+
+/* Translates a string into a GID. Returns true on success, false on failure. */
+static bool to_gid(const char *name, gid_t *gid) {
+	/* An empty name is not group 0. */
+	if (!*name) {
+		errno = EINVAL;
+		return false;
+	}
+
+	/* Try first translating it numerically. */
+	char *endptr;
+	*gid = strtoul(name, &endptr, 10);
+	if (*endptr == '\0')
+		return true;
+
+	/* Try translating it through /etc/group. */
+	struct group *grp;
+	do {
+		errno = 0;
+		grp = getgrnam(name);
+	} while (!grp && errno == EINTR);
+	if (grp) {
+		*gid = grp->gr_gid;
+		return true;
+	}
+
+	if (!errno)
+		errno = ENOENT;
+	return false;
+}
+
+
+
+/* Finds a user's entry in the index, adding an empty one if there is none. Returns nullptr if there is no memory for it. */
+static struct member *find_member(uid_t uid) {
+	/* Look for it. */
+	size_t mask = members_alloc - 1;
+	size_t i = members_alloc ? ((uint32_t) uid * 2654435761u) & mask : 0;
+	if (members_alloc) {
+		for (; members[i].used; i = (i + 1) & mask)
+			if (members[i].uid == uid)
+				return &members[i];
+	}
+
+	/* Keep the table at most three quarters full, rehashing into a bigger one if need be. */
+	if ((members_count + 1) * 4 > members_alloc * 3) {
+		size_t new_alloc = members_alloc ? members_alloc * 2 : 16;
+		struct member *new = calloc(new_alloc, sizeof(*new));
+		if (!new)
+			return nullptr;
+		for (size_t j = 0; j < members_alloc; j++) {
+			if (!members[j].used)
+				continue;
+			size_t k = ((uint32_t) members[j].uid * 2654435761u) & (new_alloc - 1);
+			while (new[k].used)
+				k = (k + 1) & (new_alloc - 1);
+			new[k] = members[j];
+		}
+		free(members);
+		members = new;
+		members_alloc = new_alloc;
+		mask = new_alloc - 1;
+		for (i = ((uint32_t) uid * 2654435761u) & mask; members[i].used; i = (i + 1) & mask);
+	}
+
+	members_count++;
+	members[i] = (struct member) {.uid = uid, .used = true};
+	return &members[i];
+}
+
+/* Works out whether the ACL lets a user in. */
+static bool decide(uid_t uid, const gid_t *groups, size_t count) {
+	for (size_t i = 0; i < allowed_count; i++)
+		if (allowed[i] == uid)
+			return true;
+	for (size_t i = 0; i < groups_count; i++)
+		for (size_t j = 0; j < count; j++)
+			if (allowed_groups[i] == groups[j])
+				return true;
 	return false;
 }
 
@@ -82,30 +201,82 @@ bool auth_init(void) {
 
 
 void auth_cleanup(void) {
-	/* Deallocate the array. */
+	/* Deallocate the arrays. */
 	free(allowed);
 	allowed = nullptr;
 	allowed_count = allowed_alloc = 0;
+	free(allowed_groups);
+	allowed_groups = nullptr;
+	groups_count = groups_alloc = 0;
+	for (size_t i = 0; i < members_alloc; i++)
+		free(members[i].groups);
+	free(members);
+	members = nullptr;
+	members_count = members_alloc = 0;
+	generation++;
 }
 
 
 
 bool auth_add(const char *name) {
+	/* Translate to GID and add a group. */
+	if (name[0] == '@') {
+		gid_t gid;
+		if (!to_gid(name + 1, &gid))
+			return false;
+		return auth_add_gid(gid);
+	}
+
 	/* Translate to UID. */
 	uid_t uid;
 	if (!to_uid(name, &uid))
 		return false;
 
 	/* Add to array. */
-	if (!grow_array())
+	return auth_add_uid(uid);
+}
+
+
+
+bool auth_add_uid(uid_t uid) {
+	uid_t *new = grow_array(allowed, allowed_count, &allowed_alloc, sizeof(*allowed));
+	if (!new)
 		return false;
+	allowed = new;
 	allowed[allowed_count++] = uid;
+	generation++;
+	return true;
+}
+
+
+
+bool auth_add_gid(gid_t gid) {
+	gid_t *new = grow_array(allowed_groups, groups_count, &groups_alloc, sizeof(*allowed_groups));
+	if (!new)
+		return false;
+	allowed_groups = new;
+	allowed_groups[groups_count++] = gid;
+	generation++;
 	return true;
 }
 
 
 
 bool auth_remove(const char *name) {
+	/* Copy the group array to itself, filtering out anything matching the target GID. */
+	if (name[0] == '@') {
+		gid_t gid;
+		if (!to_gid(name + 1, &gid))
+			return false;
+		size_t wr = 0;
+		for (size_t rd = 0; rd < groups_count; rd++)
+			if (allowed_groups[rd] != gid)
+				allowed_groups[wr++] = allowed_groups[rd];
+		groups_count = wr;
+		generation++;
+		return true;
+	}
+
 	/* Translate to UID. */
 	uid_t uid;
 	if (!to_uid(name, &uid))
@@ -117,19 +288,113 @@ bool auth_remove(const char *name) {
 		if (allowed[rd] != uid)
 			allowed[wr++] = allowed[rd];
 	allowed_count = wr;
+	generation++;
 
 	return true;
 }
 
 
 
+bool auth_load(const char *path, unsigned int *line) {
+	*line = 0;
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return false;
+
+	char buffer[512];
+	bool ok = true;
+	while (ok && fgets(buffer, sizeof(buffer), fp)) {
+		++*line;
+
+		/* Drop any comment and surrounding whitespace; what is left, if anything, is one entry. */
+		buffer[strcspn(buffer, "#\n")] = '\0';
+		char *entry = buffer;
+		while (isspace((unsigned char) *entry))
+			entry++;
+		size_t length = strlen(entry);
+		while (length && isspace((unsigned char) entry[length - 1]))
+			entry[--length] = '\0';
+		if (*entry)
+			ok = auth_add(entry);
+	}
+	if (ok && ferror(fp)) {
+		*line = 0;
+		ok = false;
+	}
+
+	int saved_errno = errno;
+	fclose(fp);
+	errno = saved_errno;
+	return ok;
+}
+
+
+
+void auth_set_groups(uid_t uid, const gid_t *groups, size_t count) {
+	struct member *m = find_member(uid);
+	if (!m)
+		return;
+	gid_t *copy = malloc((count ? count : 1) * sizeof(*copy));
+	free(m->groups);
+	m->groups = copy;
+	m->group_count = copy ? count : 0;
+	m->groups_known = copy != nullptr;
+	if (copy)
+		memcpy(copy, groups, count * sizeof(*copy));
+	m->generation = 0;
+}
+
+
+
+bool auth_add_member_group(uid_t uid, gid_t gid) {
+	struct member *m = find_member(uid);
+	if (!m)
+		return false;
+	if (!m->groups_known) {
+		free(m->groups);
+		m->groups = nullptr;
+		m->group_count = 0;
+		m->groups_known = true;
+	}
+	gid_t *new = realloc(m->groups, (m->group_count + 1) * sizeof(*new));
+	if (!new)
+		return false;
+	m->groups = new;
+	m->groups[m->group_count++] = gid;
+	m->generation = 0;
+	return true;
+}
+
+
+
+bool auth_get_member_groups(uid_t uid, const gid_t **groups, size_t *count) {
+	struct member *m = find_member(uid);
+	if (!m || !m->groups_known)
+		return false;
+	*groups = m->groups;
+	*count = m->group_count;
+	return true;
+}
+
+
+
 bool auth_check(uid_t uid) {
-	/* Scan the array. */
-	for (size_t i = 0; i < allowed_count; ++i)
-		if (allowed[i] == uid)
-			return true;
+	/* Use the answer worked out since the ACL last changed, or work it out afresh from the user's groups, if known; they are never looked up here, on the game thread, so a user whose groups are unknown matches no group entries. */
+	bool ok;
+	struct member *m = find_member(uid);
+	if (m) {
+		if (m->generation != generation) {
+			m->allowed = decide(uid, m->groups, m->group_count);
+			m->generation = generation;
+		}
+		ok = m->allowed;
+	} else {
+		ok = decide(uid, nullptr, 0);
+	}
 
-	return false;
+	if (!ok)
+		errno = EACCES;
+	return ok;
 }
 
 
@@ -139,3 +404,9 @@ size_t auth_get_acl(const uid_t **acl) {
 	return allowed_count;
 }
 
+
+
+size_t auth_get_groups(const gid_t **groups) {
+	*groups = allowed_groups;
+	return groups_count;
+}
@@ -11,17 +11,37 @@ bool auth_init(void);
 /* Deinitializes the authentication library. */
 void auth_cleanup(void);
 
-/* Adds a user to the list of allowed UIDs. Returns true on success, false on failure. */
+/* Adds a user, or a group if written as "@group", to the ACL. Returns true on success, false on failure. */
 bool auth_add(const char *name);
 
-/* Removes a user from the list of allowed UIDs. Returns true on success, false on failure. */
+/* Adds a UID to the list of allowed UIDs. Returns true on success, false on failure. */
+bool auth_add_uid(uid_t uid);
+
+/* Adds a GID to the list of allowed groups. Returns true on success, false on failure. */
+bool auth_add_gid(gid_t gid);
+
+/* Removes a user, or a group if written as "@group", from the ACL. Returns true on success, false on failure. */
 bool auth_remove(const char *name);
 
-/* Checks whether a UID is permitted to connect. Returns true if allowed, false with errno=EACCES if not. */
+/* Adds every entry in a file, one per line, with "#" starting a comment, to the ACL. Returns true on success, false on failure (storing the offending line number in *line, or zero if the file could not be read). */
+bool auth_load(const char *path, unsigned int *line);
+
+/* Remembers the groups a user was just found to be in (by the handshake threads), so that checking them needs no lookup. If there is no memory for them, the user is checked by UID alone. */
+void auth_set_groups(uid_t uid, const gid_t *groups, size_t count);
+
+/* Adds one group to those remembered for a user, e.g. as carried over a restart. Returns true on success, false on failure. */
+bool auth_add_member_group(uid_t uid, gid_t gid);
+
+/* Gets the groups remembered for a user. Returns false if they are not known. */
+bool auth_get_member_groups(uid_t uid, const gid_t **groups, size_t *count);
+
+/* Checks whether a UID is permitted to connect, by the UID and the groups remembered for it, if any; a user whose groups are not known matches no group entries. Returns true if allowed, false with errno=EACCES if not. */
 bool auth_check(uid_t uid);
 
 /* Gets the list of permitted UIDs. Returns ACL size. */
 size_t auth_get_acl(const uid_t **acl);
 
-#endif
+/* Gets the list of permitted GIDs. Returns its size. */
+size_t auth_get_groups(const gid_t **groups);
 
+#endif
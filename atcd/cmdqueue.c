@@ -0,0 +1,312 @@
+#include "cmdqueue.h"
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "atcproc.h"
+#include "trace.h"
+#include "../shared/commands.h"
+#include "../shared/monotime.h"
+
+
+
+/* The longest input that can be queued, including the trailing newline. */
+#define CMDQUEUE_TEXT_MAX 32
+
+/* The number of distinct plane letters. */
+#define PLANE_COUNT 52
+
+/* A single queued piece of input. */
+struct entry {
+	/* The plane letter the command applies to, or NUL if the input is not a plane command and must never be replaced. */
+	char plane;
+
+	/* The connection that sent the input; it may have closed since. */
+	cmdqueue_owner owner;
+
+	/* The time at which the input becomes eligible for delivery. */
+	uint64_t due;
+
+	/* The command's trace ID, or zero if it is not traced, and when it was queued. */
+	uint64_t trace, queued;
+
+	/* The length of the text. */
+	size_t length;
+
+	/* The text to write to ATC. */
+	char text[CMDQUEUE_TEXT_MAX];
+};
+
+/* The queue, as a ring indexed by free-running positions. */
+static struct entry queue[CMDQUEUE_MAX];
+static size_t queue_head = 0, queue_tail = 0;
+
+/* The number of bytes of the head entry already written to ATC. */
+static size_t head_written = 0;
+
+/* For each plane, one plus the position of its replaceable queued command, or zero if none. */
+static size_t by_plane[PLANE_COUNT];
+
+/* Whether the last flush stopped because the pipe was full. */
+static bool blocked = false;
+
+/* How long to hold commands before delivery. */
+static uint64_t hold_delay = 0;
+
+
+
+/* Maps a plane letter to an index into by_plane, or -1 if the character is not a plane letter. */
+static int plane_index(char plane) {
+	if (plane >= 'a' && plane <= 'z')
+		return plane - 'a';
+	else if (plane >= 'A' && plane <= 'Z')
+		return plane - 'A' + 26;
+	else
+		return -1;
+}
+
+
+
+/* Checks that input is something atcc would send, for one of the given planes. Returns true and stores the plane letter (or NUL) on success, false with errno=EINVAL or ESRCH on failure. */
+static bool validate(const char *input, size_t length, plane_set planes, char *plane) {
+	/* Control-L and space are passed through on their own. */
+	if (strcmp(input, "\x0c") == 0 || strcmp(input, " ") == 0) {
+		*plane = '\0';
+		return true;
+	}
+
+	/* Anything else must be exactly one newline-terminated line. */
+	if (length == 0 || length > CMDQUEUE_TEXT_MAX || input[length - 1] != '\n' || memchr(input, '\n', length - 1)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	/* The line must be a complete command. */
+	char command[CMDQUEUE_TEXT_MAX];
+	memcpy(command, input, length - 1);
+	command[length - 1] = '\0';
+	char description[256];
+	bool terminal;
+	if (!parse_command(command, planes, description, sizeof(description), &terminal) || !terminal || command[0] == '/') {
+		errno = plane_bit(command[0]) && !(plane_bit(command[0]) & planes) ? ESRCH : EINVAL;
+		return false;
+	}
+
+	*plane = command[0];
+	return true;
+}
+
+
+
+void cmdqueue_set_delay(uint64_t delay) {
+	hold_delay = delay;
+}
+
+
+
+bool cmdqueue_push(const char *input, plane_set planes, cmdqueue_owner owner, uint64_t trace, cmdqueue_owner *superseded) {
+	*superseded = 0;
+
+	/* Check the input. */
+	size_t length = strlen(input);
+	char plane;
+	if (!validate(input, length, planes, &plane))
+		return false;
+
+	/* If there is an unsent command for the same plane, replace it in place, keeping its place in line. */
+	int index = plane_index(plane);
+	if (index >= 0 && by_plane[index]) {
+		struct entry *entry = &queue[(by_plane[index] - 1) % CMDQUEUE_MAX];
+		*superseded = entry->owner;
+		entry->owner = owner;
+		entry->trace = trace;
+		entry->queued = trace ? monotime_now() : 0;
+		entry->length = length;
+		memcpy(entry->text, input, length);
+		return true;
+	}
+
+	/* Otherwise append a new entry. */
+	if (queue_tail - queue_head == CMDQUEUE_MAX) {
+		errno = ENOBUFS;
+		return false;
+	}
+	struct entry *entry = &queue[queue_tail % CMDQUEUE_MAX];
+	entry->plane = plane;
+	entry->owner = owner;
+	entry->queued = monotime_now();
+	entry->due = entry->queued + hold_delay;
+	entry->trace = trace;
+	entry->length = length;
+	memcpy(entry->text, input, length);
+	if (index >= 0)
+		by_plane[index] = queue_tail + 1;
+	queue_tail++;
+	return true;
+}
+
+
+
+bool cmdqueue_push_batch(const char *const *inputs, size_t count, plane_set planes, cmdqueue_owner owner, cmdqueue_owner *superseded, size_t *failed) {
+	/* Check every input, and count the queued commands it replaces: the unsent one, if any, for each plane in the batch. */
+	char letters[CMDQUEUE_MAX];
+	bool claimed[PLANE_COUNT] = {false};
+	size_t replaced = 0;
+	if (count > CMDQUEUE_MAX) {
+		*failed = count;
+		errno = ENOBUFS;
+		return false;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (!validate(inputs[i], strlen(inputs[i]), planes, &letters[i])) {
+			*failed = i;
+			return false;
+		}
+		int index = plane_index(letters[i]);
+		if (index >= 0 && by_plane[index] && !claimed[index])
+			replaced++;
+		if (index >= 0)
+			claimed[index] = true;
+	}
+	if (count - replaced > CMDQUEUE_MAX - (queue_tail - queue_head)) {
+		*failed = count;
+		errno = ENOBUFS;
+		return false;
+	}
+
+	/* Take the replaced commands out of the queue, closing up the gaps, so that the whole batch can go at the back in the order given. */
+	bool gone[CMDQUEUE_MAX] = {false};
+	for (size_t i = 0; i < count; i++) {
+		int index = plane_index(letters[i]);
+		superseded[i] = 0;
+		if (index >= 0 && by_plane[index]) {
+			size_t pos = by_plane[index] - 1;
+			superseded[i] = queue[pos % CMDQUEUE_MAX].owner;
+			gone[pos % CMDQUEUE_MAX] = true;
+			by_plane[index] = 0;
+		}
+	}
+	if (replaced) {
+		size_t kept = queue_head;
+		for (size_t pos = queue_head; pos != queue_tail; pos++) {
+			if (gone[pos % CMDQUEUE_MAX])
+				continue;
+			if (kept != pos)
+				queue[kept % CMDQUEUE_MAX] = queue[pos % CMDQUEUE_MAX];
+			int index = plane_index(queue[kept % CMDQUEUE_MAX].plane);
+			if (index >= 0 && by_plane[index] == pos + 1)
+				by_plane[index] = kept + 1;
+			kept++;
+		}
+		queue_tail = kept;
+	}
+
+	/* Append the batch, all due at once. Only a plane's first command in it can be replaced later; the rest follow it as they are. */
+	uint64_t now = monotime_now();
+	memset(claimed, 0, sizeof(claimed));
+	for (size_t i = 0; i < count; i++) {
+		size_t length = strlen(inputs[i]);
+		int index = plane_index(letters[i]);
+		struct entry *entry = &queue[queue_tail % CMDQUEUE_MAX];
+		entry->plane = index >= 0 && claimed[index] ? '\0' : letters[i];
+		entry->owner = owner;
+		entry->queued = now;
+		entry->due = now + hold_delay;
+		entry->trace = 0;
+		entry->length = length;
+		memcpy(entry->text, inputs[i], length);
+		if (index >= 0 && !claimed[index]) {
+			by_plane[index] = queue_tail + 1;
+			claimed[index] = true;
+		}
+		queue_tail++;
+	}
+	return true;
+}
+
+
+
+bool cmdqueue_flush(uint64_t now) {
+	blocked = false;
+	while (queue_head != queue_tail) {
+		/* Gather every due command into one write, stopping at the first still being held. */
+		struct iovec iov[CMDQUEUE_MAX];
+		int count = 0;
+		for (size_t pos = queue_head; pos != queue_tail; pos++) {
+			struct entry *entry = &queue[pos % CMDQUEUE_MAX];
+			if (entry->due > now && !(pos == queue_head && head_written))
+				break;
+			size_t skip = pos == queue_head ? head_written : 0;
+			iov[count].iov_base = entry->text + skip;
+			iov[count].iov_len = entry->length - skip;
+			count++;
+		}
+		if (!count)
+			return true;
+
+		/* Write as much as the pipe will take. */
+		uint64_t write_start = monotime_now();
+		ssize_t written = atcproc_sendv(iov, count);
+		if (written < 0) {
+			if (errno == EAGAIN) {
+				blocked = true;
+				return true;
+			}
+			return false;
+		}
+
+		/* Move past what was written; once any of a command has been written, it can no longer be replaced. */
+		for (int i = 0; i < count && written; i++) {
+			struct entry *entry = &queue[queue_head % CMDQUEUE_MAX];
+			int index = plane_index(entry->plane);
+			if (index >= 0 && by_plane[index] == queue_head + 1)
+				by_plane[index] = 0;
+			size_t part = (size_t) written < iov[i].iov_len ? (size_t) written : iov[i].iov_len;
+			head_written += part;
+			written -= part;
+			if (head_written == entry->length) {
+				if (entry->trace) {
+					uint64_t write_end = monotime_now();
+					trace_span(entry->trace, TRACE_QUEUE, entry->queued, write_start);
+					trace_span(entry->trace, TRACE_WRITE, write_start, write_end);
+					trace_await_echo(entry->trace, write_end);
+				}
+				queue_head++;
+				head_written = 0;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+
+bool cmdqueue_is_empty(void) {
+	return queue_head == queue_tail;
+}
+
+
+
+bool cmdqueue_next_due(uint64_t *due) {
+	if (queue_head == queue_tail)
+		return false;
+	*due = head_written ? 0 : queue[queue_head % CMDQUEUE_MAX].due;
+	return true;
+}
+
+
+
+bool cmdqueue_is_blocked(void) {
+	return blocked;
+}
+
+
+
+void cmdqueue_clear(void) {
+	queue_head = queue_tail = 0;
+	head_written = 0;
+	memset(by_plane, 0, sizeof(by_plane));
+	blocked = false;
+}
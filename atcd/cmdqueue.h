@@ -0,0 +1,62 @@
+#if !defined CMDQUEUE_H
+#define CMDQUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "../shared/commands.h"
+
+/* A handle identifying the connection a command came from, or zero if none. */
+typedef uint64_t cmdqueue_owner;
+
+/* The maximum number of commands that can be waiting for delivery to ATC. */
+#define CMDQUEUE_MAX 64
+
+/* Sets how long, in nanoseconds, a command is held before delivery so that a newer command for the same plane can replace it. */
+void cmdqueue_set_delay(uint64_t delay);
+
+/*
+ * Validates input received from a client and queues it for delivery to ATC.
+ *
+ * A complete command for a plane replaces any older command for the same
+ * plane that has not yet been sent; in that case the owner of the older
+ * command is stored in *superseded (otherwise zero is stored). A nonzero
+ * trace ID has the command's time in the queue and its write to ATC traced
+ * (see trace.h). Returns true
+ * on success, false with errno=EINVAL if the input is not a valid command,
+ * false with errno=ESRCH if it is for a plane not in planes, or false with
+ * errno=ENOBUFS if the queue is full.
+ */
+bool cmdqueue_push(const char *input, plane_set planes, cmdqueue_owner owner, uint64_t trace, cmdqueue_owner *superseded);
+
+/*
+ * Validates a batch of input from one client and queues it for delivery to
+ * ATC as a whole, in order at the back of the queue and all due at once, so
+ * that it goes out in a single write.
+ *
+ * Commands in the batch take the place of older unsent commands for the same
+ * planes, which are dropped from the queue, but not of each other. The owner
+ * of whatever each command replaced, or zero, is stored in superseded[].
+ * Nothing is queued unless everything can be: on failure, the index of the
+ * offending input is stored in *failed (or count, if the queue has no room
+ * for the batch) and errno is set as for cmdqueue_push(). Returns true on
+ * success, false on failure.
+ */
+bool cmdqueue_push_batch(const char *const *inputs, size_t count, plane_set planes, cmdqueue_owner owner, cmdqueue_owner *superseded, size_t *failed);
+
+/* Writes as many due commands to ATC as the pipe will accept. Returns true on success, false on failure. */
+bool cmdqueue_flush(uint64_t now);
+
+/* Checks whether any commands are waiting for delivery. */
+bool cmdqueue_is_empty(void);
+
+/* Gets the time at which the oldest waiting command becomes due. Returns false if the queue is empty. */
+bool cmdqueue_next_due(uint64_t *due);
+
+/* Checks whether the last flush stopped because the pipe to ATC was full. */
+bool cmdqueue_is_blocked(void);
+
+/* Discards every waiting command, e.g. because the game ended. */
+void cmdqueue_clear(void);
+
+#endif
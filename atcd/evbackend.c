@@ -0,0 +1,115 @@
+#include "evbackend.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+
+
+/* The io_uring backend, in evuring.c. */
+extern const struct evbackend evbackend_uring;
+
+/* Where the result of each send goes. */
+static void (*send_cb)(uint32_t tag, const char *data, ssize_t result);
+
+/* The FDs to wait on in the current round, and the ones found ready by the last wait. */
+static fd_set want_read, want_write, got_read, got_write;
+static int max_watched_fd = -1;
+
+
+
+static bool select_init(size_t max_watched __attribute__((unused)), void (*sent)(uint32_t tag, const char *data, ssize_t result)) {
+	send_cb = sent;
+	return true;
+}
+
+
+
+static void select_clear(void) {
+	FD_ZERO(&want_read);
+	FD_ZERO(&want_write);
+	FD_ZERO(&got_read);
+	FD_ZERO(&got_write);
+	max_watched_fd = -1;
+}
+
+
+
+static void select_watch(int fd, unsigned int events) {
+	if (events & EV_READ)
+		FD_SET(fd, &want_read);
+	if (events & EV_WRITE)
+		FD_SET(fd, &want_write);
+	if (fd > max_watched_fd)
+		max_watched_fd = fd;
+}
+
+
+
+static int select_wait(const struct timespec *timeout, const sigset_t *sigmask) {
+	got_read = want_read;
+	got_write = want_write;
+	int ret = pselect(max_watched_fd + 1, &got_read, &got_write, nullptr, timeout, sigmask);
+	if (ret < 0) {
+		FD_ZERO(&got_read);
+		FD_ZERO(&got_write);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+static unsigned int select_ready(int fd) {
+	return (FD_ISSET(fd, &got_read) ? EV_READ : 0) | (FD_ISSET(fd, &got_write) ? EV_WRITE : 0);
+}
+
+
+
+static void select_send_all(const int *fds, const uint32_t *tags, size_t count, const char *data) {
+	size_t length = strlen(data);
+	for (size_t i = 0; i < count; i++) {
+		ssize_t ret;
+		do {
+			ret = send(fds[i], data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+		} while (ret < 0 && errno == EINTR);
+		send_cb(tags[i], data, ret < 0 ? -errno : ret);
+	}
+}
+
+
+
+static ssize_t select_flush(int fd, const struct iovec *iov, int iovcnt) {
+	return fd >= 0 ? writev(fd, iov, iovcnt) : 0;
+}
+
+
+
+/* The portable backend, using pselect(), one send() per socket, and sending everything right away. */
+static const struct evbackend evbackend_select = {
+	.name = "select",
+	.init = &select_init,
+	.clear = &select_clear,
+	.watch = &select_watch,
+	.wait = &select_wait,
+	.ready = &select_ready,
+	.send_all = &select_send_all,
+	.flush = &select_flush,
+};
+
+
+
+const struct evbackend *evbackend_find(const char *name) {
+	if (strcmp(name, evbackend_select.name) == 0)
+		return &evbackend_select;
+	else if (strcmp(name, evbackend_uring.name) == 0)
+		return &evbackend_uring;
+	else
+		return nullptr;
+}
+
+
+
+const struct evbackend *evbackend_default(void) {
+	return &evbackend_select;
+}
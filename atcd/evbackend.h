@@ -0,0 +1,49 @@
+#if !defined EVBACKEND_H
+#define EVBACKEND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Readiness flags. */
+#define EV_READ 0x01
+#define EV_WRITE 0x02
+
+/* A way of waiting for I/O readiness and doing the sends that fan out from it. */
+struct evbackend {
+	/* The name used to pick the backend on the command line. */
+	const char *name;
+
+	/* Prepares the backend to watch up to a given number of FDs at once, and to report each send's result, the number of bytes sent or a negative errno, to a callback along with the tag and message it was given. Returns true on success, false on failure. */
+	bool (*init)(size_t max_watched, void (*sent)(uint32_t tag, const char *data, ssize_t result));
+
+	/* Starts a new round of declaring which FDs to wait on. */
+	void (*clear)(void);
+
+	/* Adds an FD to the current round, waiting for any of the given readiness flags. */
+	void (*watch)(int fd, unsigned int events);
+
+	/* Waits, with the given signal mask, until a watched FD is ready, the timeout (if not nullptr) expires, or a signal arrives. Returns 0 on success or -1 on failure (errno=EINTR if interrupted by a signal), like pselect(). */
+	int (*wait)(const struct timespec *timeout, const sigset_t *sigmask);
+
+	/* Gets the readiness flags found for an FD by the last wait. */
+	unsigned int (*ready)(int fd);
+
+	/* Sends the same NUL-terminated message on each of several sockets, fds[i] being tagged tags[i], without blocking and in order after everything sent on them before, either right away or at the next flush; once a send on a socket fails, later ones on it in the same flush are not tried and fail with -ECANCELED. */
+	void (*send_all)(const int *fds, const uint32_t *tags, size_t count, const char *data);
+
+	/* Does every send still waiting and then, if fd is not negative, writes gathered buffers to it without blocking, in as few system calls as the backend can. Returns the number of bytes written, or -1 on failure (or 0 if fd is negative), like writev(). */
+	ssize_t (*flush)(int fd, const struct iovec *iov, int iovcnt);
+};
+
+/* Finds a backend by name. Returns nullptr if there is no such backend. */
+const struct evbackend *evbackend_find(const char *name);
+
+/* The backend used if none is chosen. */
+const struct evbackend *evbackend_default(void);
+
+#endif
@@ -0,0 +1,459 @@
+#include "evbackend.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+
+
+/* What a completion is for, in the top bits of its user data; polls carry the FD and, above it, the round they were made in, and sends the index of the send. */
+#define TAG_WRITE (UINT64_C(1) << 61)
+#define TAG_SEND (UINT64_C(1) << 62)
+#define TAG_REMOVE (UINT64_C(1) << 63)
+#define ROUND_MASK UINT64_C(0xffffff)
+
+/* The ring, which stays mapped for the life of the process. */
+static int ring_fd = -1;
+static unsigned int sq_entries;
+static _Atomic unsigned int *sq_head, *sq_tail;
+static unsigned int *sq_mask;
+static struct io_uring_sqe *sqes;
+static _Atomic unsigned int *cq_head, *cq_tail;
+static unsigned int *cq_mask;
+static struct io_uring_cqe *cqes;
+
+/* The FDs watched in the current round, and those polled in the last wait. */
+static int *watched = nullptr, *polled = nullptr;
+static size_t watched_count = 0, polled_count = 0, watched_alloc = 0;
+
+/* For each FD, the readiness flags it is watched for, those found by the last wait, and whether its poll from the last wait is still armed. */
+static uint8_t *interest = nullptr, *readiness = nullptr, *armed = nullptr;
+static size_t fd_alloc = 0;
+
+/* The number of the last wait, which tells its polls' completions from those of earlier ones. */
+static uint64_t wait_round = 0;
+
+/* A send waiting for the next flush, and its result once done. */
+struct send {
+	int fd;
+	uint32_t tag;
+
+	/* Where its message is in the message buffer. */
+	size_t message;
+
+	ssize_t result;
+};
+
+/* The sends waiting for the next flush, in the order they were asked for, and the same sorted by FD. */
+static struct send *sends = nullptr;
+static size_t *by_fd = nullptr;
+static size_t sends_count = 0, sends_alloc = 0;
+
+/* The messages of the waiting sends, each NUL-terminated and kept once however many sockets it goes to. */
+static char *messages = nullptr;
+static size_t messages_size = 0, messages_alloc = 0;
+
+/* Where the result of each send goes. */
+static void (*send_cb)(uint32_t tag, const char *data, ssize_t result);
+
+/* The number of sends and writes submitted but not yet completed, and the result of the last write. */
+static size_t outstanding = 0;
+static ssize_t write_result;
+
+
+
+/* Gets the next free submission queue entry, cleared. The ring is sized so it never fills. */
+static struct io_uring_sqe *next_sqe(uint64_t user_data) {
+	unsigned int tail = atomic_load_explicit(sq_tail, memory_order_relaxed);
+	struct io_uring_sqe *sqe = &sqes[tail & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user_data;
+	return sqe;
+}
+
+/* Makes the entry from next_sqe() visible to the kernel. */
+static void commit_sqe(void) {
+	atomic_fetch_add_explicit(sq_tail, 1, memory_order_release);
+}
+
+
+
+/* Submits everything queued and waits for at least a number of completions. Returns like io_uring_enter(). */
+static int enter(unsigned int min_complete, unsigned int flags, const void *arg, size_t argsz) {
+	unsigned int to_submit = atomic_load_explicit(sq_tail, memory_order_relaxed) - atomic_load_explicit(sq_head, memory_order_acquire);
+	return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags | (min_complete ? IORING_ENTER_GETEVENTS : 0), arg, argsz);
+}
+
+
+
+/* Handles every completion waiting in the ring, noting what the last wait's polls found only if asked to; a poll that fires later is simply made again by the next wait. */
+static void reap(bool take_readiness) {
+	unsigned int head = atomic_load_explicit(cq_head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(cq_tail, memory_order_acquire);
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+		if (cqe->user_data & TAG_REMOVE) {
+			/* Nothing to do. */
+		} else if (cqe->user_data & (TAG_WRITE | TAG_SEND)) {
+			/* One left over from a submission that failed part way is ignored. */
+			size_t index = cqe->user_data & ~TAG_SEND;
+			if (!outstanding)
+				continue;
+			if (cqe->user_data & TAG_WRITE)
+				write_result = cqe->res;
+			else if (index < sends_count)
+				sends[index].result = cqe->res;
+			outstanding--;
+		} else {
+			/* Polls from earlier waits are stale. An error counts as ready for whatever was asked, as select() would report it. */
+			int fd = (int) (uint32_t) cqe->user_data;
+			if ((cqe->user_data >> 32) != wait_round)
+				continue;
+			armed[fd] = 0;
+			if (cqe->res == -ECANCELED || !take_readiness)
+				continue;
+			unsigned int found = 0;
+			if (cqe->res < 0 || (cqe->res & (POLLIN | POLLHUP | POLLERR)))
+				found |= EV_READ;
+			if (cqe->res < 0 || (cqe->res & (POLLOUT | POLLHUP | POLLERR)))
+				found |= EV_WRITE;
+			readiness[fd] = found & interest[fd];
+		}
+	}
+	atomic_store_explicit(cq_head, head, memory_order_release);
+}
+
+
+
+/* Checks whether the kernel supports every operation we use. */
+static bool supports_ops(void) {
+	static const uint8_t needed[] = {IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_SEND, IORING_OP_WRITEV};
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (!probe)
+		return false;
+	bool ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	for (size_t i = 0; ok && i < sizeof(needed); i++)
+		ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+
+
+static bool uring_init(size_t max_watched, void (*sent)(uint32_t tag, const char *data, ssize_t result)) {
+	send_cb = sent;
+
+	/* Make room for a poll per watched FD plus the removal of one left from the wait before. */
+	unsigned int entries = 8;
+	while (entries < 2 * max_watched)
+		entries *= 2;
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring_fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+	if (ring_fd < 0)
+		return false;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) || !supports_ops()) {
+		close(ring_fd);
+		ring_fd = -1;
+		errno = ENOSYS;
+		return false;
+	}
+
+	/* Map the rings. */
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	char *rings = mmap(nullptr, sq_size > cq_size ? sq_size : cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED)
+		return false;
+	sqes = mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return false;
+	sq_entries = params.sq_entries;
+	sq_head = (_Atomic unsigned int *) (rings + params.sq_off.head);
+	sq_tail = (_Atomic unsigned int *) (rings + params.sq_off.tail);
+	sq_mask = (unsigned int *) (rings + params.sq_off.ring_mask);
+	cq_head = (_Atomic unsigned int *) (rings + params.cq_off.head);
+	cq_tail = (_Atomic unsigned int *) (rings + params.cq_off.tail);
+	cq_mask = (unsigned int *) (rings + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+
+	/* Entries are always submitted in order, so the indirection array never changes. */
+	unsigned int *array = (unsigned int *) (rings + params.sq_off.array);
+	for (unsigned int i = 0; i < sq_entries; i++)
+		array[i] = i;
+
+	watched = calloc(entries / 2, sizeof(*watched));
+	polled = calloc(entries / 2, sizeof(*polled));
+	if (!watched || !polled)
+		return false;
+	watched_alloc = entries / 2;
+	return true;
+}
+
+
+
+static void uring_clear(void) {
+	for (size_t i = 0; i < watched_count; i++)
+		interest[watched[i]] = readiness[watched[i]] = 0;
+	watched_count = 0;
+}
+
+
+
+static void uring_watch(int fd, unsigned int events) {
+	/* Grow the per-FD arrays if needed. */
+	if ((size_t) fd >= fd_alloc) {
+		size_t new_alloc = fd_alloc ? fd_alloc : 64;
+		while (new_alloc <= (size_t) fd)
+			new_alloc *= 2;
+		uint8_t *new_interest = realloc(interest, new_alloc);
+		if (new_interest)
+			interest = new_interest;
+		uint8_t *new_readiness = realloc(readiness, new_alloc);
+		if (new_readiness)
+			readiness = new_readiness;
+		uint8_t *new_armed = realloc(armed, new_alloc);
+		if (new_armed)
+			armed = new_armed;
+		if (!new_interest || !new_readiness || !new_armed)
+			return;
+		memset(interest + fd_alloc, 0, new_alloc - fd_alloc);
+		memset(readiness + fd_alloc, 0, new_alloc - fd_alloc);
+		memset(armed + fd_alloc, 0, new_alloc - fd_alloc);
+		fd_alloc = new_alloc;
+	}
+
+	if (!interest[fd] && watched_count < watched_alloc)
+		watched[watched_count++] = fd;
+	interest[fd] |= events;
+}
+
+
+
+static ssize_t uring_flush(int fd, const struct iovec *iov, int iovcnt);
+
+static int uring_wait(const struct timespec *timeout, const sigset_t *sigmask) {
+	/* Nothing must be left unsent while we sleep. */
+	uring_flush(-1, nullptr, 0);
+
+	/*
+	 * Remove the polls left armed by the last wait, ahead of this wait's own,
+	 * so that none keeps a file open once its FD is closed, or watches the
+	 * old file behind a reused FD. Each removal completes at once, and so
+	 * does the poll it removes (or has just lost the race to), so there are
+	 * that many more completions to wait for than the one that matters.
+	 */
+	reap(false);
+	unsigned int stale = 0;
+	for (size_t i = 0; i < polled_count; i++) {
+		int fd = polled[i];
+		if (!armed[fd])
+			continue;
+		struct io_uring_sqe *sqe = next_sqe(TAG_REMOVE);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = (wait_round << 32) | (uint32_t) fd;
+		commit_sqe();
+		armed[fd] = 0;
+		stale += 2;
+	}
+
+	/* Queue a poll for every watched FD. */
+	wait_round = (wait_round + 1) & ROUND_MASK;
+	for (size_t i = 0; i < watched_count; i++) {
+		int fd = watched[i];
+		struct io_uring_sqe *sqe = next_sqe((wait_round << 32) | (uint32_t) fd);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = ((interest[fd] & EV_READ) ? POLLIN : 0) | ((interest[fd] & EV_WRITE) ? POLLOUT : 0);
+		commit_sqe();
+		polled[i] = fd;
+		armed[fd] = 1;
+	}
+	polled_count = watched_count;
+
+	/* Submit it all and wait for the first poll, with the signal mask swapped in as pselect() would, in one system call. */
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg = {
+		.sigmask = (uint64_t) (uintptr_t) sigmask,
+		.sigmask_sz = _NSIG / 8,
+	};
+	if (timeout) {
+		ts.tv_sec = timeout->tv_sec;
+		ts.tv_nsec = timeout->tv_nsec;
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+	}
+	int ret = enter(stale + 1, IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	int saved_errno = errno;
+	reap(true);
+
+	/* Running out of time is not an error. */
+	if (ret < 0 && saved_errno != ETIME) {
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
+}
+
+
+
+static unsigned int uring_ready(int fd) {
+	return (size_t) fd < fd_alloc ? readiness[fd] : 0;
+}
+
+
+
+/* Orders sends by FD, keeping the order they were asked for among those on the same FD. */
+static int compare_sends(const void *a, const void *b) {
+	size_t i = *(const size_t *) a, j = *(const size_t *) b;
+	if (sends[i].fd != sends[j].fd)
+		return sends[i].fd < sends[j].fd ? -1 : 1;
+	return i < j ? -1 : i > j;
+}
+
+
+
+/* Submits everything queued and waits until every send and write among it is done. Returns true on success, false on failure. */
+static bool submit_and_reap(void) {
+	while (outstanding) {
+		if (enter(outstanding, 0, nullptr, 0) < 0 && errno != EINTR) {
+			/* Take back whatever the kernel did not take, so that it is never submitted with its buffers gone. */
+			atomic_store_explicit(sq_tail, atomic_load_explicit(sq_head, memory_order_acquire), memory_order_relaxed);
+			outstanding = 0;
+			return false;
+		}
+		reap(false);
+	}
+	return true;
+}
+
+
+
+static void uring_send_all(const int *fds, const uint32_t *tags, size_t count, const char *data) {
+	/* Make room for the sends and a copy of the message, or failing that, send everything now. */
+	size_t length = strlen(data) + 1;
+	if (sends_count + count > sends_alloc) {
+		size_t new_alloc = sends_alloc ? sends_alloc : 64;
+		while (new_alloc < sends_count + count)
+			new_alloc *= 2;
+		struct send *new_sends = realloc(sends, new_alloc * sizeof(*new_sends));
+		if (new_sends)
+			sends = new_sends;
+		size_t *new_by_fd = realloc(by_fd, new_alloc * sizeof(*new_by_fd));
+		if (new_by_fd)
+			by_fd = new_by_fd;
+		if (new_sends && new_by_fd)
+			sends_alloc = new_alloc;
+	}
+	if (messages_size + length > messages_alloc) {
+		size_t new_alloc = messages_alloc ? messages_alloc : 4096;
+		while (new_alloc < messages_size + length)
+			new_alloc *= 2;
+		char *new_messages = realloc(messages, new_alloc);
+		if (new_messages) {
+			messages = new_messages;
+			messages_alloc = new_alloc;
+		}
+	}
+	if (sends_count + count > sends_alloc || messages_size + length > messages_alloc) {
+		uring_flush(-1, nullptr, 0);
+		for (size_t i = 0; i < count; i++) {
+			ssize_t ret;
+			do {
+				ret = send(fds[i], data, length - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+			} while (ret < 0 && errno == EINTR);
+			send_cb(tags[i], data, ret < 0 ? -errno : ret);
+		}
+		return;
+	}
+
+	/* Queue them for the next flush. */
+	memcpy(messages + messages_size, data, length);
+	for (size_t i = 0; i < count; i++)
+		sends[sends_count++] = (struct send) {.fd = fds[i], .tag = tags[i], .message = messages_size, .result = -ECANCELED};
+	messages_size += length;
+}
+
+
+
+static ssize_t uring_flush(int fd, const struct iovec *iov, int iovcnt) {
+	/*
+	 * Submit the sends grouped by socket, each group linked so that once one
+	 * fails the rest are cancelled rather than overtake it, as many at once
+	 * as fit, with the write after the last of them. A group split between
+	 * submissions is carried on only if its first part went through.
+	 */
+	for (size_t i = 0; i < sends_count; i++)
+		by_fd[i] = i;
+	qsort(by_fd, sends_count, sizeof(*by_fd), &compare_sends);
+	bool ok = true, write_queued = false;
+	size_t next = 0;
+	while (ok && (next < sends_count || (fd >= 0 && !write_queued))) {
+		while (next && next < sends_count && sends[by_fd[next]].fd == sends[by_fd[next - 1]].fd && sends[by_fd[next - 1]].result < 0)
+			next++;
+		unsigned int queued = 0;
+		for (; next < sends_count && queued < sq_entries; next++) {
+			const struct send *send = &sends[by_fd[next]];
+			struct io_uring_sqe *sqe = next_sqe(TAG_SEND | by_fd[next]);
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = send->fd;
+			sqe->addr = (uint64_t) (uintptr_t) (messages + send->message);
+			sqe->len = strlen(messages + send->message);
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+			if (next + 1 < sends_count && sends[by_fd[next + 1]].fd == send->fd && queued + 1 < sq_entries)
+				sqe->flags = IOSQE_IO_LINK;
+			commit_sqe();
+			queued++;
+		}
+		if (next == sends_count && fd >= 0 && queued < sq_entries) {
+			struct io_uring_sqe *sqe = next_sqe(TAG_WRITE);
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->fd = fd;
+			sqe->addr = (uint64_t) (uintptr_t) iov;
+			sqe->len = iovcnt;
+			sqe->off = (uint64_t) -1;
+			commit_sqe();
+			queued++;
+			write_result = -ECANCELED;
+			write_queued = true;
+		}
+		outstanding = queued;
+		ok = submit_and_reap();
+	}
+	int saved_errno = errno;
+
+	/* Report the results in the order the sends were asked for, those never done as cancelled, then forget them. */
+	for (size_t i = 0; i < sends_count; i++)
+		send_cb(sends[i].tag, messages + sends[i].message, sends[i].result);
+	sends_count = 0;
+	messages_size = 0;
+
+	if (fd < 0)
+		return 0;
+	if (!ok || write_result < 0) {
+		errno = ok ? (int) -write_result : saved_errno;
+		return -1;
+	}
+	return write_result;
+}
+
+
+
+/* The io_uring backend, which submits the polls for a round in one system call, and holds back sends until the next flush or wait, then submits them, with any write to ATC, in another. */
+const struct evbackend evbackend_uring = {
+	.name = "io_uring",
+	.init = &uring_init,
+	.clear = &uring_clear,
+	.watch = &uring_watch,
+	.wait = &uring_wait,
+	.ready = &uring_ready,
+	.send_all = &uring_send_all,
+	.flush = &uring_flush,
+};
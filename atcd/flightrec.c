@@ -0,0 +1,263 @@
+#include "flightrec.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+/* The number of events kept; older ones are overwritten. */
+#define RING_EVENTS 4096
+
+/* The most text kept with an event, including the NUL. */
+#define TEXT_MAX 40
+
+struct entry {
+	/* One plus the event's position in the log once it is completely written, or zero while it is being written. */
+	_Atomic uint64_t seq;
+
+	uint64_t time;
+	enum flightrec_type type;
+	int fd;
+	long uid;
+	long value;
+	char text[TEXT_MAX];
+};
+
+static const char * const TYPE_NAMES[FLIGHTREC_TYPES] = {
+	[FLIGHTREC_CONNECT] = "connect",
+	[FLIGHTREC_DENY] = "deny",
+	[FLIGHTREC_ADMIT] = "admit",
+	[FLIGHTREC_CLOSE] = "close",
+	[FLIGHTREC_COMMAND] = "command",
+	[FLIGHTREC_INPUT] = "input",
+	[FLIGHTREC_REJECT] = "reject",
+	[FLIGHTREC_SEND_FAILED] = "send-failed",
+	[FLIGHTREC_OVERFLOW] = "overflow",
+	[FLIGHTREC_ATC_START] = "atc-start",
+	[FLIGHTREC_ATC_STOP] = "atc-stop",
+	[FLIGHTREC_ATC_DEATH] = "atc-death",
+	[FLIGHTREC_SIGNAL] = "signal",
+};
+
+static struct entry ring[RING_EVENTS];
+
+/* The position the next event is written at; every event ever logged has had one. */
+static _Atomic uint64_t next_position = 0;
+
+/* Where dumps go, or empty for standard error. */
+static char dump_path[PATH_MAX] = "";
+
+/* Whether a fatal signal is already being handled, in case the dump itself faults. */
+static volatile sig_atomic_t dying = 0;
+
+
+
+/* Reads the coarse monotonic clock, which costs a few nanoseconds rather than tens and is fine for telling events apart. */
+static uint64_t coarse_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+
+
+void flightrec_log(enum flightrec_type type, int fd, long uid, long value, const char *text) {
+	uint64_t position = atomic_fetch_add_explicit(&next_position, 1, memory_order_relaxed);
+	struct entry *entry = &ring[position % RING_EVENTS];
+	atomic_store_explicit(&entry->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	entry->time = coarse_now();
+	entry->type = type;
+	entry->fd = fd;
+	entry->uid = uid;
+	entry->value = value;
+	size_t length = 0;
+	if (text)
+		while (length < TEXT_MAX - 1 && text[length]) {
+			/* Keep each event on one line. */
+			entry->text[length] = text[length] == '\n' ? ' ' : text[length];
+			length++;
+		}
+	entry->text[length] = '\0';
+	atomic_store_explicit(&entry->seq, position + 1, memory_order_release);
+}
+
+
+
+bool flightrec_set_path(const char *path) {
+	if (strlen(path) >= sizeof(dump_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(dump_path, path);
+	return true;
+}
+
+
+
+/* Appends a string to a line being built, as far as it fits. */
+static void append(char *line, size_t *length, size_t size, const char *string) {
+	while (*string && *length < size - 1)
+		line[(*length)++] = *string++;
+	line[*length] = '\0';
+}
+
+/* Appends a number to a line being built; snprintf() is not async-signal-safe. */
+static void append_number(char *line, size_t *length, size_t size, long long number, unsigned int min_digits) {
+	char digits[24];
+	size_t count = 0;
+	unsigned long long magnitude = number < 0 ? 0ull - (unsigned long long) number : (unsigned long long) number;
+	do {
+		digits[count++] = (char) ('0' + magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude || count < min_digits);
+	if (number < 0)
+		digits[count++] = '-';
+	char reversed[sizeof(digits) + 1];
+	for (size_t i = 0; i < count; i++)
+		reversed[i] = digits[count - 1 - i];
+	reversed[count] = '\0';
+	append(line, length, size, reversed);
+}
+
+/* Writes all of a buffer. */
+static bool write_all(int fd, const char *buffer, size_t length) {
+	while (length) {
+		ssize_t ret = write(fd, buffer, length);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return false;
+		buffer += ret;
+		length -= (size_t) ret;
+	}
+	return true;
+}
+
+
+
+bool flightrec_dump(const char *reason, size_t *count) {
+	*count = 0;
+	int saved_errno = errno;
+	int fd = 2;
+	if (dump_path[0]) {
+		do {
+			fd = open(dump_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+		} while (fd < 0 && errno == EINTR);
+		if (fd < 0)
+			return false;
+	}
+
+	/* Start with when the dump was taken on both clocks, so that event times can be matched up with other logs. */
+	char line[256];
+	size_t length = 0;
+	struct timespec real;
+	clock_gettime(CLOCK_REALTIME, &real);
+	uint64_t now = coarse_now();
+	append(line, &length, sizeof(line), "atcd flight recorder: pid ");
+	append_number(line, &length, sizeof(line), getpid(), 1);
+	append(line, &length, sizeof(line), ", ");
+	append(line, &length, sizeof(line), reason);
+	append(line, &length, sizeof(line), ", at ");
+	append_number(line, &length, sizeof(line), real.tv_sec, 1);
+	append(line, &length, sizeof(line), " (Unix time), ");
+	append_number(line, &length, sizeof(line), (long long) (now / 1000000000u), 1);
+	append(line, &length, sizeof(line), ".");
+	append_number(line, &length, sizeof(line), (long long) (now % 1000000000u / 1000000u), 3);
+	append(line, &length, sizeof(line), " (monotonic)\n");
+	bool ok = write_all(fd, line, length);
+
+	/* Then each event still in the ring, skipping any being overwritten as we read. */
+	uint64_t end = atomic_load_explicit(&next_position, memory_order_acquire);
+	for (uint64_t position = end > RING_EVENTS ? end - RING_EVENTS : 0; ok && position < end; position++) {
+		struct entry *slot = &ring[position % RING_EVENTS];
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != position + 1)
+			continue;
+		struct entry copy;
+		copy.time = slot->time;
+		copy.type = slot->type;
+		copy.fd = slot->fd;
+		copy.uid = slot->uid;
+		copy.value = slot->value;
+		memcpy(copy.text, slot->text, sizeof(copy.text));
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != position + 1 || copy.type >= FLIGHTREC_TYPES)
+			continue;
+		copy.text[TEXT_MAX - 1] = '\0';
+
+		length = 0;
+		append_number(line, &length, sizeof(line), (long long) (copy.time / 1000000000u), 1);
+		append(line, &length, sizeof(line), ".");
+		append_number(line, &length, sizeof(line), (long long) (copy.time % 1000000000u / 1000000u), 3);
+		append(line, &length, sizeof(line), " ");
+		append(line, &length, sizeof(line), TYPE_NAMES[copy.type]);
+		if (copy.fd >= 0) {
+			append(line, &length, sizeof(line), " fd=");
+			append_number(line, &length, sizeof(line), copy.fd, 1);
+		}
+		if (copy.uid >= 0) {
+			append(line, &length, sizeof(line), " uid=");
+			append_number(line, &length, sizeof(line), copy.uid, 1);
+		}
+		append(line, &length, sizeof(line), " value=");
+		append_number(line, &length, sizeof(line), copy.value, 1);
+		if (copy.text[0]) {
+			append(line, &length, sizeof(line), " ");
+			append(line, &length, sizeof(line), copy.text);
+		}
+		append(line, &length, sizeof(line), "\n");
+		ok = write_all(fd, line, length);
+		if (ok)
+			++*count;
+	}
+
+	if (fd != 2)
+		close(fd);
+	if (ok)
+		errno = saved_errno;
+	return ok;
+}
+
+
+
+static void dump_sig_handler(int signum __attribute__((unused))) {
+	size_t count;
+	flightrec_log(FLIGHTREC_SIGNAL, -1, -1, SIGUSR1, nullptr);
+	flightrec_dump("SIGUSR1", &count);
+}
+
+/* Dumps the ring and then dies of the signal, which the handler has been reset to the default for. */
+static void fatal_sig_handler(int signum) {
+	if (!dying) {
+		dying = 1;
+		size_t count;
+		flightrec_log(FLIGHTREC_SIGNAL, -1, -1, signum, nullptr);
+		flightrec_dump(sigabbrev_np(signum) ? sigabbrev_np(signum) : "fatal signal", &count);
+	}
+	raise(signum);
+}
+
+
+
+bool flightrec_install(void) {
+	struct sigaction sa;
+	sa.sa_handler = &dump_sig_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sa, nullptr) < 0)
+		return false;
+
+	static const int fatal[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+	sa.sa_handler = &fatal_sig_handler;
+	sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+	for (size_t i = 0; i < sizeof(fatal) / sizeof(*fatal); i++)
+		if (sigaction(fatal[i], &sa, nullptr) < 0)
+			return false;
+	return true;
+}
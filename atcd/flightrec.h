@@ -0,0 +1,67 @@
+#if !defined FLIGHTREC_H
+#define FLIGHTREC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A flight recorder: a fixed-size ring of the most recent notable events,
+ * kept in memory at the cost of a few stores per event and written out when
+ * something has gone wrong. Any thread, and signal handlers, may log events;
+ * nothing locks. The ring is dumped, as one line per event, on SIGUSR1, on
+ * a fatal signal, and by //flightrec.
+ */
+
+/* The kinds of event recorded. */
+enum flightrec_type {
+	/* A client connected (value: whether on the admin socket). */
+	FLIGHTREC_CONNECT,
+
+	/* A client was turned away (text: why). */
+	FLIGHTREC_DENY,
+
+	/* A client finished the handshake and joined (text: the username). */
+	FLIGHTREC_ADMIT,
+
+	/* A connection was closed (value: messages still waiting to be sent to it). */
+	FLIGHTREC_CLOSE,
+
+	/* A server command (text: the command). */
+	FLIGHTREC_COMMAND,
+
+	/* A game command was queued (text: the command). */
+	FLIGHTREC_INPUT,
+
+	/* A game command was refused (value: errno, text: the command). */
+	FLIGHTREC_REJECT,
+
+	/* A message could not be sent to a client (value: errno). */
+	FLIGHTREC_SEND_FAILED,
+
+	/* A queue overflowed (text: which). */
+	FLIGHTREC_OVERFLOW,
+
+	/* A game was started or stopped, or ended on its own (value: PID, or for a death the wait status). */
+	FLIGHTREC_ATC_START,
+	FLIGHTREC_ATC_STOP,
+	FLIGHTREC_ATC_DEATH,
+
+	/* A signal was caught (value: the signal number). */
+	FLIGHTREC_SIGNAL,
+
+	FLIGHTREC_TYPES,
+};
+
+/* Records an event; the fd and uid are -1 if they do not apply, and text may be nullptr. Safe to call from any thread or signal handler. */
+void flightrec_log(enum flightrec_type type, int fd, long uid, long value, const char *text);
+
+/* Sets the file dumps are appended to, instead of standard error. Returns true on success, false on failure. */
+bool flightrec_set_path(const char *path);
+
+/* Installs the handlers that dump the ring on SIGUSR1 and on fatal signals (SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT) before dying. Returns true on success, false on failure. */
+bool flightrec_install(void);
+
+/* Dumps the ring, oldest event first, with a reason in the heading, storing how many events were written in *count. Async-signal-safe. Returns true on success, false on failure. */
+bool flightrec_dump(const char *reason, size_t *count);
+
+#endif
@@ -0,0 +1,238 @@
+#include "gameclock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "atcproc.h"
+#include "../shared/monotime.h"
+#include "../shared/vclock.h"
+
+
+
+/* How long to leave between stepped expiries, so that atc handles each SIGALRM before the next and none are merged. */
+#define STEP_GAP 2000000u
+
+/* The clock and its memfd, or nullptr and -1 if time control is off. */
+static struct vclock *vclock = nullptr;
+static int vclock_fd = -1;
+
+/* The shim to preload. */
+static const char *shim_path = nullptr;
+
+/* Expiries queued by gameclock_step(), and the earliest real time the next may be delivered. */
+static unsigned int steps_pending = 0;
+static uint64_t next_step = 0;
+
+
+
+/* Set when the game has armed its timer since gameclock_take_wakeup() last looked. */
+static volatile sig_atomic_t woken = 0;
+
+
+
+static void wake_sig_handler(int signum __attribute__((unused))) {
+	woken = 1;
+}
+
+
+
+/* Moves the clock's base point, changing the fields the game reads under the sequence count. */
+static void set_base(uint64_t real, uint64_t virtual, unsigned int rate) {
+	unsigned int seq = atomic_load_explicit(&vclock->sequence, memory_order_relaxed);
+	atomic_store_explicit(&vclock->sequence, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&vclock->base_real, real, memory_order_relaxed);
+	atomic_store_explicit(&vclock->base_virtual, virtual, memory_order_relaxed);
+	atomic_store_explicit(&vclock->rate, rate, memory_order_relaxed);
+	atomic_store_explicit(&vclock->sequence, seq + 2, memory_order_release);
+}
+
+
+
+/* Restarts the clock from where it is now, at the rate its settings call for. */
+static void rebase(uint64_t now) {
+	bool held = atomic_load_explicit(&vclock->held, memory_order_relaxed);
+	set_base(now, vclock_read(vclock, now), held ? 0 : atomic_load_explicit(&vclock->speed, memory_order_relaxed));
+}
+
+
+
+/* Maps a clock memfd, moving it above the FD the game expects it on so it cannot be in the way there. Returns true on success, false on failure. */
+static bool attach(int fd) {
+	if (fd <= VCLOCK_FD) {
+		int moved = fcntl(fd, F_DUPFD_CLOEXEC, VCLOCK_FD + 1);
+		close(fd);
+		if (moved < 0)
+			return false;
+		fd = moved;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	void *page = mmap(nullptr, sizeof(struct vclock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	if (vclock) {
+		munmap(vclock, sizeof(struct vclock));
+		close(vclock_fd);
+	}
+	vclock = page;
+	vclock_fd = fd;
+
+	/* Wake up when the game arms its timer. */
+	struct sigaction sa;
+	sa.sa_handler = &wake_sig_handler;
+	sigfillset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(VCLOCK_WAKE_SIGNAL, &sa, nullptr);
+
+	if (shim_path)
+		atcproc_set_preload(shim_path, vclock_fd);
+	return true;
+}
+
+
+
+bool gameclock_init(const char *shim, unsigned int speed) {
+	shim_path = shim;
+	int fd = memfd_create("atcd-clock", MFD_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (ftruncate(fd, sizeof(struct vclock)) < 0) {
+		close(fd);
+		return false;
+	}
+	if (!attach(fd))
+		return false;
+	atomic_store_explicit(&vclock->speed, speed, memory_order_relaxed);
+	gameclock_reset(monotime_now());
+	return true;
+}
+
+
+
+bool gameclock_adopt(int fd) {
+	return attach(fd);
+}
+
+
+
+bool gameclock_enabled(void) {
+	return vclock;
+}
+
+
+
+int gameclock_get_fd(void) {
+	return vclock_fd;
+}
+
+
+
+void gameclock_reset(uint64_t now) {
+	if (!vclock)
+		return;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	atomic_store_explicit(&vclock->realtime_offset, (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec - now, memory_order_relaxed);
+	atomic_store_explicit(&vclock->timer_due, 0, memory_order_relaxed);
+	atomic_store_explicit(&vclock->timer_interval, 0, memory_order_relaxed);
+	atomic_store_explicit(&vclock->held, false, memory_order_relaxed);
+	atomic_store_explicit(&vclock->ticks, 0, memory_order_relaxed);
+	set_base(now, now, atomic_load_explicit(&vclock->speed, memory_order_relaxed));
+	steps_pending = 0;
+}
+
+
+
+void gameclock_set_speed(unsigned int speed, uint64_t now) {
+	atomic_store_explicit(&vclock->speed, speed, memory_order_relaxed);
+	if (speed)
+		steps_pending = 0;
+	rebase(now);
+}
+
+
+
+void gameclock_get_stats(unsigned int *speed, uint64_t *ticks) {
+	*speed = atomic_load_explicit(&vclock->speed, memory_order_relaxed);
+	*ticks = atomic_load_explicit(&vclock->ticks, memory_order_relaxed);
+}
+
+
+
+void gameclock_hold(bool held, uint64_t now) {
+	if (!vclock || atomic_load_explicit(&vclock->held, memory_order_relaxed) == held)
+		return;
+	atomic_store_explicit(&vclock->held, held, memory_order_relaxed);
+	rebase(now);
+}
+
+
+
+bool gameclock_step(unsigned int ticks) {
+	if (atomic_load_explicit(&vclock->speed, memory_order_relaxed)) {
+		errno = EBUSY;
+		return false;
+	}
+	steps_pending = ticks > UINT_MAX - steps_pending ? UINT_MAX : steps_pending + ticks;
+	return true;
+}
+
+
+
+void gameclock_run(uint64_t now) {
+	if (!vclock || !atcproc_is_running())
+		return;
+	uint64_t due = atomic_load_explicit(&vclock->timer_due, memory_order_acquire);
+	if (!due)
+		return;
+
+	/* When stepping, jump the clock to the next expiry. */
+	uint64_t virtual = vclock_read(vclock, now);
+	if (steps_pending && now >= next_step && !atomic_load_explicit(&vclock->held, memory_order_relaxed)) {
+		if (due > virtual)
+			set_base(now, virtual = due, 0);
+		steps_pending--;
+		next_step = now + STEP_GAP;
+	}
+	if (due > virtual)
+		return;
+
+	/* Reload the timer past now, as the kernel would, since expiries that pile up are merged into one signal anyway; the game may rearm it meanwhile, in which case its setting wins. */
+	uint64_t interval = atomic_load_explicit(&vclock->timer_interval, memory_order_relaxed);
+	uint64_t new_due = interval ? due + interval * ((virtual - due) / interval + 1) : 0;
+	if (atomic_compare_exchange_strong_explicit(&vclock->timer_due, &due, new_due, memory_order_acq_rel, memory_order_relaxed) && atcproc_signal(SIGALRM))
+		atomic_fetch_add_explicit(&vclock->ticks, 1, memory_order_relaxed);
+}
+
+
+
+bool gameclock_take_wakeup(void) {
+	bool ret = woken;
+	woken = 0;
+	return ret;
+}
+
+
+
+bool gameclock_next_due(uint64_t now, uint64_t *due) {
+	if (!vclock || !atcproc_is_running())
+		return false;
+	uint64_t timer_due = atomic_load_explicit(&vclock->timer_due, memory_order_acquire);
+	if (!timer_due)
+		return false;
+	if (steps_pending && !atomic_load_explicit(&vclock->held, memory_order_relaxed)) {
+		*due = next_step > now ? next_step : now;
+		return true;
+	}
+	unsigned int rate = atomic_load_explicit(&vclock->rate, memory_order_relaxed);
+	if (!rate)
+		return false;
+	uint64_t virtual = vclock_read(vclock, now);
+	*due = timer_due <= virtual ? now : now + (timer_due - virtual + rate - 1) / rate;
+	return true;
+}
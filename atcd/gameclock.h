@@ -0,0 +1,46 @@
+#if !defined GAMECLOCK_H
+#define GAMECLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The fastest a game can be run. */
+#define GAMECLOCK_SPEED_MAX 1000
+
+/* Creates the virtual clock and has games started with the time shim at a path preloaded, running at a speed (zero to step by hand). Returns true on success, false on failure. */
+bool gameclock_init(const char *shim, unsigned int speed);
+
+/* Takes over a clock inherited across exec, in place of any created by gameclock_init(), so the running game keeps its time. Returns true on success, false on failure. */
+bool gameclock_adopt(int fd);
+
+/* Checks whether games run by the virtual clock. */
+bool gameclock_enabled(void);
+
+/* Gets the memfd holding the clock, for handing over across exec, or -1 if time control is off. */
+int gameclock_get_fd(void);
+
+/* Starts the clock afresh for a new game, at real time and with no timer armed. */
+void gameclock_reset(uint64_t now);
+
+/* Sets the speed of the clock, as a multiple of real time, or zero to step it by hand. */
+void gameclock_set_speed(unsigned int speed, uint64_t now);
+
+/* Gets the speed of the clock and the number of timer expiries delivered to the current game. */
+void gameclock_get_stats(unsigned int *speed, uint64_t *ticks);
+
+/* Stops or restarts the clock, as the game is paused or resumed. */
+void gameclock_hold(bool held, uint64_t now);
+
+/* Queues expiries of the game's timer to be delivered one at a time, jumping the clock forward to each. Returns false with errno=EBUSY unless the clock is being stepped by hand. */
+bool gameclock_step(unsigned int ticks);
+
+/* Delivers the game's timer expiry or queued step, if one is due. */
+void gameclock_run(uint64_t now);
+
+/* Checks, and forgets, whether the game has armed its timer, which calls for working out when to wake up again. */
+bool gameclock_take_wakeup(void);
+
+/* Gets the real time at which gameclock_run() next has something to do. Returns false if there is nothing coming. */
+bool gameclock_next_due(uint64_t now, uint64_t *due);
+
+#endif
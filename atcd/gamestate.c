@@ -0,0 +1,346 @@
+#include "gamestate.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "screen.h"
+
+
+
+/* The rows at the bottom of the screen that ATC gives to its input and credit windows. */
+#define INPUT_LINES 3
+
+/* The first row of the planes window listing planes, below the clock and the column headings. */
+#define PLANE_LIST_ROW 3
+
+/* The most planes (one per letter of either case) and beacons, exits or airports (one per digit) a game can have. */
+#define PLANES_MAX 52
+#define PLACES_MAX 10
+
+/* How ATC draws an airport for each direction planes take off in, and the direction keys those are. */
+static const char AIRPORT_SYMBOLS[] = "^>v<";
+static const char AIRPORT_DIRECTIONS[] = "wdxa";
+
+/* The longest event sent; atcc shows longer packets, but keep well within what it reads in one go. */
+#define EVENT_MAX 240
+
+struct plane {
+	bool present, airborne, low_fuel;
+
+	/* Whether the plane was found on the radar this time. */
+	bool located;
+
+	unsigned int altitude, x, y;
+
+	/* The direction key the plane was last seen moving in, or '?'. */
+	char heading;
+
+	/* 'A' or 'E', and the number of the airport or exit. */
+	char dest_type;
+	unsigned int dest;
+};
+
+struct place {
+	bool present;
+	unsigned int x, y;
+
+	/* For an airport, the direction key planes take off in. */
+	char dir;
+};
+
+struct state {
+	bool showing;
+	unsigned long clock;
+	unsigned int safe;
+	struct plane planes[PLANES_MAX];
+};
+
+/* The state last published. */
+static struct state published;
+
+/* The map, gathered a piece at a time since planes can hide parts of it, and whether it has grown since it was last published. */
+static unsigned int map_width = 0, map_height = 0;
+static struct place beacons[PLACES_MAX], exits[PLACES_MAX], airports[PLACES_MAX];
+static bool map_changed = false;
+
+/* An event being built, and the text each continuation of it starts with. */
+struct event {
+	gamestate_emit emit;
+	void *arg;
+	char head[32];
+	char text[EVENT_MAX + 1];
+	size_t length;
+};
+
+
+
+static int plane_index(char name) {
+	if (name >= 'a' && name <= 'z')
+		return name - 'a';
+	else if (name >= 'A' && name <= 'Z')
+		return name - 'A' + 26;
+	else
+		return -1;
+}
+
+static char plane_name(int index) {
+	return index < 26 ? (char) ('a' + index) : (char) ('A' + index - 26);
+}
+
+static bool is_digit(char ch) {
+	return ch >= '0' && ch <= '9';
+}
+
+
+
+/* Gets the direction key for a move of one square, or '?' for anything else. */
+static char heading_of(int dx, int dy) {
+	static const char keys[3][3] = {{'q', 'w', 'e'}, {'a', '?', 'd'}, {'z', 'x', 'c'}};
+	if (dx < -1 || dx > 1 || dy < -1 || dy > 1)
+		return '?';
+	return keys[dy + 1][dx + 1];
+}
+
+
+
+/* Notes a beacon, exit or airport seen on the radar. */
+static void note_place(struct place *places, char digit, unsigned int x, unsigned int y, char dir) {
+	struct place *place = &places[digit - '0'];
+	if (place->present && place->x == x && place->y == y && place->dir == dir)
+		return;
+	*place = (struct place) {.present = true, .x = x, .y = y, .dir = dir};
+	map_changed = true;
+}
+
+
+
+/* Reads the clock, the planes window and the radar into a state. Returns false if the screen does not show a game. */
+static bool parse(struct state *state) {
+	unsigned int rows, cols;
+	screen_get_size(&rows, &cols);
+	if (rows < PLANE_LIST_ROW + INPUT_LINES)
+		return false;
+
+	/* The planes window starts where the clock is shown, on the top row. */
+	const char *top = screen_row(0);
+	const char *clock = memmem(top, cols, "Time:", 5);
+	if (!clock)
+		return false;
+	unsigned int panel = (unsigned int) (clock - top);
+	char text[64];
+	snprintf(text, sizeof(text), "%.*s", (int) (cols - panel), clock);
+	if (sscanf(text, "Time: %lu Safe: %u", &state->clock, &state->safe) != 2)
+		return false;
+
+	/* The radar's top border, exits and all, gives its width; its bottom border is the next row with a '-' where the left border's blank would be. */
+	unsigned int length = 0;
+	while (length < panel && (top[length] == '-' || is_digit(top[length])))
+		length++;
+	if (length < 3 || length % 2 == 0)
+		return false;
+	unsigned int width = (length + 1) / 2, height = 0;
+	for (unsigned int row = 1; row < rows - INPUT_LINES && !height; row++)
+		if (screen_row(row)[1] == '-')
+			height = row + 1;
+	if (!height)
+		return false;
+	if (width != map_width || height != map_height) {
+		map_width = width;
+		map_height = height;
+		memset(beacons, 0, sizeof(beacons));
+		memset(exits, 0, sizeof(exits));
+		memset(airports, 0, sizeof(airports));
+		map_changed = true;
+	}
+
+	/* Each plane has a line in the planes window, those in the air first and then, after a blank line, those waiting on the ground. */
+	memset(state->planes, 0, sizeof(state->planes));
+	bool ground = false;
+	for (unsigned int row = PLANE_LIST_ROW; row < rows - INPUT_LINES && cols - panel >= 6; row++) {
+		const char *line = screen_row(row) + panel;
+		if (memcmp(line, "      ", 6) == 0) {
+			ground = true;
+			continue;
+		}
+		int index = plane_index(line[0]);
+		if (index < 0 || !is_digit(line[1]) || (line[2] != ' ' && line[2] != '*') || (line[3] != 'A' && line[3] != 'E') || !is_digit(line[4]) || line[5] != ':')
+			continue;
+		state->planes[index] = (struct plane) {
+			.present = true,
+			.airborne = !ground,
+			.low_fuel = line[2] == '*',
+			.altitude = (unsigned int) (line[1] - '0'),
+			.heading = '?',
+			.dest_type = line[3],
+			.dest = (unsigned int) (line[4] - '0'),
+		};
+	}
+
+	/* Each square of the radar is two characters: a plane's name and altitude, a beacon, an airport, an exit on the border, or background. */
+	for (unsigned int y = 0; y < height; y++) {
+		const char *line = screen_row(y);
+		for (unsigned int x = 0; x < width; x++) {
+			char first = line[x * 2], second = line[x * 2 + 1];
+			bool border = y == 0 || y == height - 1 || x == 0 || x == width - 1;
+			int index = plane_index(first);
+			struct plane *plane = index >= 0 ? &state->planes[index] : nullptr;
+			if (plane && plane->airborne && is_digit(second) && plane->altitude == (unsigned int) (second - '0')) {
+				plane->x = x;
+				plane->y = y;
+				plane->located = true;
+			} else if (first == '*' && is_digit(second)) {
+				note_place(beacons, second, x, y, '\0');
+			} else if (!border && is_digit(second) && first && strchr(AIRPORT_SYMBOLS, first)) {
+				note_place(airports, second, x, y, AIRPORT_DIRECTIONS[strchr(AIRPORT_SYMBOLS, first) - AIRPORT_SYMBOLS]);
+			} else if (border && is_digit(first)) {
+				note_place(exits, first, x, y, '\0');
+			}
+		}
+	}
+	state->showing = true;
+	return true;
+}
+
+
+
+/* Starts an event with some text, which every continuation of it also starts with. */
+static void event_start(struct event *event, const char *head) {
+	snprintf(event->head, sizeof(event->head), "%s", head);
+	event->length = (size_t) snprintf(event->text, sizeof(event->text), "%s", head);
+}
+
+/* Adds a token to an event, sending what there is first if it would not fit. */
+static void event_add(struct event *event, const char *token) {
+	size_t length = strlen(token);
+	if (event->length + 1 + length > EVENT_MAX && event->length > strlen(event->head)) {
+		event->emit(event->text, event->arg);
+		event->length = (size_t) snprintf(event->text, sizeof(event->text), "%s", event->head);
+	}
+	event->length += (size_t) snprintf(event->text + event->length, sizeof(event->text) - event->length, " %s", token);
+	if (event->length > EVENT_MAX)
+		event->length = EVENT_MAX;
+}
+
+/* Sends what is left of an event. */
+static void event_finish(struct event *event) {
+	event->emit(event->text, event->arg);
+}
+
+
+
+static void emit_map(gamestate_emit emit, void *arg) {
+	struct event event = {.emit = emit, .arg = arg};
+	char token[32];
+	snprintf(token, sizeof(token), "[map] %ux%u", map_width, map_height);
+	event_start(&event, token);
+	for (int i = 0; i < PLACES_MAX; i++)
+		if (beacons[i].present) {
+			snprintf(token, sizeof(token), "b%d@%u,%u", i, beacons[i].x, beacons[i].y);
+			event_add(&event, token);
+		}
+	for (int i = 0; i < PLACES_MAX; i++)
+		if (exits[i].present) {
+			snprintf(token, sizeof(token), "e%d@%u,%u", i, exits[i].x, exits[i].y);
+			event_add(&event, token);
+		}
+	for (int i = 0; i < PLACES_MAX; i++)
+		if (airports[i].present) {
+			snprintf(token, sizeof(token), "a%d@%u,%u:%c", i, airports[i].x, airports[i].y, airports[i].dir);
+			event_add(&event, token);
+		}
+	event_finish(&event);
+}
+
+
+
+/* Sends the changes from one state to another. */
+static void emit_changes(const struct state *from, const struct state *to, gamestate_emit emit, void *arg) {
+	struct event event = {.emit = emit, .arg = arg};
+	char token[32];
+	snprintf(token, sizeof(token), "[state] t%lu", to->clock);
+	event_start(&event, token);
+	if (!from->showing || from->safe != to->safe) {
+		snprintf(token, sizeof(token), "s%u", to->safe);
+		event_add(&event, token);
+	}
+	for (int i = 0; i < PLANES_MAX; i++) {
+		const struct plane *old = &from->planes[i], *new = &to->planes[i];
+		if (!new->present) {
+			if (old->present) {
+				snprintf(token, sizeof(token), "-%c", plane_name(i));
+				event_add(&event, token);
+			}
+			continue;
+		}
+		if (old->present && old->airborne == new->airborne && old->low_fuel == new->low_fuel && old->altitude == new->altitude
+				&& old->x == new->x && old->y == new->y && old->heading == new->heading && old->dest_type == new->dest_type && old->dest == new->dest)
+			continue;
+		if (new->airborne)
+			snprintf(token, sizeof(token), "%c%u@%u,%u:%c%c%u%s", plane_name(i), new->altitude, new->x, new->y, new->heading, new->dest_type, new->dest, new->low_fuel ? "!" : "");
+		else
+			snprintf(token, sizeof(token), "%c%u@-:%c%c%u%s", plane_name(i), new->altitude, new->heading, new->dest_type, new->dest, new->low_fuel ? "!" : "");
+		event_add(&event, token);
+	}
+	event_finish(&event);
+}
+
+
+
+void gamestate_reset(void) {
+	memset(&published, 0, sizeof(published));
+	map_width = map_height = 0;
+	map_changed = false;
+}
+
+
+
+void gamestate_update(gamestate_emit emit, void *arg) {
+	/* Wait for the clock to move, so that each update is seen whole and sent once. */
+	struct state next;
+	if (!parse(&next) || (published.showing && next.clock == published.clock))
+		return;
+
+	/* Work out headings from how planes have moved, keeping each plane where it was last seen if something is drawn over it. */
+	for (int i = 0; i < PLANES_MAX; i++) {
+		struct plane *plane = &next.planes[i];
+		const struct plane *old = &published.planes[i];
+		if (!plane->present || !plane->airborne || !old->present || !old->airborne)
+			continue;
+		if (!plane->located) {
+			plane->x = old->x;
+			plane->y = old->y;
+		}
+		if (plane->x == old->x && plane->y == old->y)
+			plane->heading = old->heading;
+		else
+			plane->heading = heading_of((int) plane->x - (int) old->x, (int) plane->y - (int) old->y);
+	}
+
+	if (map_changed) {
+		emit_map(emit, arg);
+		map_changed = false;
+	}
+	emit_changes(&published, &next, emit, arg);
+	published = next;
+}
+
+
+
+void gamestate_describe(gamestate_emit emit, void *arg) {
+	if (!published.showing)
+		return;
+	static const struct state empty;
+	emit_map(emit, arg);
+	emit_changes(&empty, &published, emit, arg);
+}
+
+
+
+plane_set gamestate_planes(void) {
+	if (!published.showing)
+		return PLANES_ALL;
+	plane_set planes = 0;
+	for (int i = 0; i < PLANES_MAX; i++)
+		if (published.planes[i].present)
+			planes |= plane_bit(plane_name(i));
+	return planes;
+}
@@ -0,0 +1,43 @@
+#if !defined GAMESTATE_H
+#define GAMESTATE_H
+
+/*
+ * The game state, as read from ATC's screen, and the events atcd sends to
+ * clients that ask for it with //state on. Each event is one packet.
+ *
+ * "[map] WxH <places>" describes the airspace when a game begins, with one
+ * token per beacon ("b<n>@<x>,<y>"), exit ("e<n>@<x>,<y>") and airport
+ * ("a<n>@<x>,<y>:<dir>").
+ *
+ * "[state] t<clock> [s<safe>] <changes>" follows each update of the game,
+ * giving the game's clock, the number of planes landed or left safely (if
+ * it changed) and a token for each plane that is new or changed:
+ * "<name><altitude>@<x>,<y>:<heading><A|E><n>[!]", where the heading is
+ * unknown ("?") until the plane has moved, the destination is an airport or
+ * exit, and "!" marks a plane low on fuel. A plane waiting on the ground is
+ * at "-". "-<name>" means a plane is gone. A long update is split across
+ * several events, each starting with the clock.
+ *
+ * Directions are given as ATC's own direction keys (w for north, e for
+ * north-east, d for east and so on round to q for north-west), and
+ * coordinates count grid squares from the top left.
+ */
+
+#include "../shared/commands.h"
+
+/* A function to send an event to, with an argument passed through. */
+typedef void (*gamestate_emit)(const char *event, void *arg);
+
+/* Forgets the state, e.g. because a game is starting or has ended. */
+void gamestate_reset(void);
+
+/* Reads the state from the screen and emits events for what changed, once the game's clock has moved on. */
+void gamestate_update(gamestate_emit emit, void *arg);
+
+/* Emits the map and the whole state, e.g. for a client that has just asked for events. Emits nothing if no game is showing. */
+void gamestate_describe(gamestate_emit emit, void *arg);
+
+/* Gets the planes in the game, in the air or waiting on the ground, or every plane if no game is showing. */
+plane_set gamestate_planes(void);
+
+#endif
@@ -0,0 +1,363 @@
+#include "handshake.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <grp.h>
+#include <poll.h>
+#include <pwd.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "flightrec.h"
+#include "timerwheel.h"
+#include "../shared/monotime.h"
+#include "../shared/probes.h"
+
+
+
+/* A connection in the handshake, owned by one handshake thread. */
+struct pending {
+	/* The socket, or -1 if the slot is free. */
+	int fd;
+
+	bool admin;
+
+	/* When the connection was accepted. */
+	uint64_t accepted;
+
+	/* Closes the connection if it does not finish the handshake in time. */
+	struct timer timer;
+};
+
+/* The state of one handshake thread. */
+struct worker {
+	pthread_t thread;
+	struct pending *pending;
+	struct pollfd *pollfds;
+	size_t *pollslots;
+};
+
+/* How long a client has to finish the handshake, in nanoseconds. */
+static uint64_t timeout = 10000000000u;
+
+/* The most handshakes allowed in progress at once, across all threads. */
+static unsigned int max_pending = 64;
+
+static unsigned int thread_count = 1;
+static struct worker *workers = nullptr;
+
+/* The listening sockets, shared by every thread. */
+static int listen_fd = -1, admin_fd = -1;
+
+/* Results waiting for the game thread, as a lock-free stack (newest first) that the game thread empties in one go. */
+static _Atomic(struct handshake_result *) results = nullptr;
+
+/* An eventfd written when the stack goes from empty to non-empty. */
+static int wake_fd = -1;
+
+static atomic_uint pending_count = 0;
+static atomic_ulong timed_out = 0, rejected = 0;
+
+
+
+/* Hands a result to the game thread, waking it if it may be asleep. */
+static void publish(struct handshake_result *result) {
+	result->next = atomic_load_explicit(&results, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&results, &result->next, result, memory_order_release, memory_order_relaxed));
+	if (!result->next) {
+		uint64_t one = 1;
+		[[maybe_unused]] ssize_t ssz = write(wake_fd, &one, sizeof(one));
+	}
+}
+
+
+
+/* Sends a message about a failed handshake to debugging clients. */
+static void notify(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void notify(const char *format, ...) {
+	struct handshake_result *result = malloc(sizeof(*result));
+	if (!result)
+		return;
+	result->fd = -1;
+	va_list args;
+	va_start(args, format);
+	vsnprintf(result->text, sizeof(result->text), format, args);
+	va_end(args);
+	publish(result);
+}
+
+
+
+/* Closes a pending connection and frees its slot. */
+static void drop(struct pending *p) {
+	timerwheel_remove(&p->timer);
+	while (close(p->fd) < 0 && errno == EINTR);
+	p->fd = -1;
+	atomic_fetch_sub_explicit(&pending_count, 1, memory_order_relaxed);
+}
+
+
+
+static void expired(struct timer *timer) {
+	struct pending *p = (struct pending *) ((char *) timer - offsetof(struct pending, timer));
+	atomic_fetch_add_explicit(&timed_out, 1, memory_order_relaxed);
+	PROBE3(atcd, handshake_denied, p->fd, monotime_now() - p->accepted, "timeout");
+	flightrec_log(FLIGHTREC_DENY, p->fd, -1, 0, "handshake timeout");
+	notify("[server] client dropped for not finishing the handshake in time");
+	drop(p);
+}
+
+
+
+/* Sends a reply during the handshake; the socket buffer is empty, so it cannot block. */
+static void reply(int fd, const char *string) {
+	while (send(fd, string, strlen(string), MSG_NOSIGNAL | MSG_DONTWAIT) < 0 && errno == EINTR);
+}
+
+
+
+/* Handles the greeting from a pending connection, passing it to the game thread if it is acceptable. */
+static void finish(struct pending *p) {
+	/* Receive a message. */
+	char databuf[256];
+	ssize_t ret;
+	do {
+		ret = recv(p->fd, databuf, sizeof(databuf) - 1, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (ret <= 0) {
+		drop(p);
+		return;
+	}
+	databuf[ret] = '\0';
+
+	/* Check for an acceptable protocol version. */
+	if (strcmp(databuf, "MATC 1") != 0) {
+		notify("[server] client denied for bad protocol version");
+		PROBE3(atcd, handshake_denied, p->fd, monotime_now() - p->accepted, "version");
+		flightrec_log(FLIGHTREC_DENY, p->fd, -1, 0, "protocol version");
+		reply(p->fd, "MATC VERSION");
+		drop(p);
+		return;
+	}
+
+	/* Ask for receive timestamps so control command latency can be measured from when the client sent it. */
+	int on = 1;
+	if (setsockopt(p->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+		drop(p);
+		return;
+	}
+
+	/* Get the user ID of the connecting client. */
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	if (getsockopt(p->fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0 || credlen != sizeof(cred)) {
+		drop(p);
+		return;
+	}
+
+	/* Look up the username; this can be slow, which is why it happens here and not on the game thread. */
+	struct handshake_result *result = malloc(sizeof(*result));
+	if (!result) {
+		drop(p);
+		return;
+	}
+	char pwbuf[1024];
+	struct passwd pwd, *pwdptr;
+	int err;
+	do {
+		err = getpwuid_r(cred.uid, &pwd, pwbuf, sizeof(pwbuf), &pwdptr);
+	} while (err == EINTR);
+	if (!pwdptr || strlen(pwd.pw_name) >= sizeof(result->text)) {
+		free(result);
+		notify("[server] user denied for no passwd entry: %ld", (long) cred.uid);
+		PROBE3(atcd, handshake_denied, p->fd, monotime_now() - p->accepted, "passwd");
+		flightrec_log(FLIGHTREC_DENY, p->fd, cred.uid, 0, "no passwd entry");
+		reply(p->fd, "MATC ACCESS");
+		drop(p);
+		return;
+	}
+
+	/* Look up the user's groups too, for the ACL's group entries; glibc fills in as many as fit if there are more. */
+	int group_count = HANDSHAKE_GROUPS_MAX;
+	if (getgrouplist(pwd.pw_name, pwd.pw_gid, result->groups, &group_count) < 0)
+		group_count = HANDSHAKE_GROUPS_MAX;
+
+	/* Hand the connection over; the game thread checks the ACL and welcomes the user, and it counts as pending until taken. */
+	timerwheel_remove(&p->timer);
+	PROBE3(atcd, handshake, p->fd, cred.uid, monotime_now() - p->accepted);
+	result->fd = p->fd;
+	result->admin = p->admin;
+	result->uid = cred.uid;
+	result->group_count = group_count;
+	strcpy(result->text, pwd.pw_name);
+	p->fd = -1;
+	publish(result);
+}
+
+
+
+/* Accepts every waiting connection on a listener into the thread's pending slots. */
+static void accept_pending(struct worker *w, int listenfd, bool admin) {
+	for (;;) {
+		int newfd = accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (newfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+
+		/* Refuse the connection if too many are already in the handshake. */
+		if (atomic_fetch_add_explicit(&pending_count, 1, memory_order_relaxed) >= max_pending) {
+			atomic_fetch_sub_explicit(&pending_count, 1, memory_order_relaxed);
+			atomic_fetch_add_explicit(&rejected, 1, memory_order_relaxed);
+			PROBE2(atcd, accept_rejected, newfd, admin);
+			flightrec_log(FLIGHTREC_OVERFLOW, newfd, -1, max_pending, "handshakes");
+			close(newfd);
+			continue;
+		}
+
+		/* Take a free slot, of which there is always one since no thread can hold more than the limit, and start the handshake clock. */
+		struct pending *p = w->pending;
+		while (p->fd >= 0)
+			p++;
+		p->fd = newfd;
+		p->admin = admin;
+		p->accepted = monotime_now();
+		PROBE2(atcd, accept, newfd, admin);
+		flightrec_log(FLIGHTREC_CONNECT, newfd, -1, admin, nullptr);
+		timerwheel_add(&p->timer, p->accepted + timeout);
+	}
+}
+
+
+
+static void *run_worker(void *arg) {
+	struct worker *w = arg;
+	for (;;) {
+		/* Wait on the listeners and this thread's pending connections. */
+		nfds_t count = 0;
+		w->pollfds[count++] = (struct pollfd) {.fd = listen_fd, .events = POLLIN};
+		w->pollfds[count++] = (struct pollfd) {.fd = admin_fd, .events = POLLIN};
+		for (size_t i = 0; i < max_pending; i++)
+			if (w->pending[i].fd >= 0) {
+				w->pollslots[count] = i;
+				w->pollfds[count++] = (struct pollfd) {.fd = w->pending[i].fd, .events = POLLIN};
+			}
+		int wait = -1;
+		uint64_t next;
+		if (timerwheel_next(&next)) {
+			uint64_t now = monotime_now();
+			wait = next > now ? (int) ((next - now + 999999u) / 1000000u) : 0;
+		}
+		if (poll(w->pollfds, count, wait) < 0 && errno != EINTR)
+			return nullptr;
+
+		/* Deal with greetings, then drop clients that have taken too long, then take on new ones. */
+		for (nfds_t i = 2; i < count; i++)
+			if (w->pollfds[i].revents)
+				finish(&w->pending[w->pollslots[i]]);
+		timerwheel_advance(monotime_now());
+		if (w->pollfds[1].revents & POLLIN)
+			accept_pending(w, admin_fd, true);
+		if (w->pollfds[0].revents & POLLIN)
+			accept_pending(w, listen_fd, false);
+	}
+}
+
+
+
+void handshake_configure(uint64_t new_timeout, unsigned int new_max_pending, unsigned int threads) {
+	timeout = new_timeout;
+	max_pending = new_max_pending;
+	thread_count = threads;
+}
+
+
+
+bool handshake_start(int listenfd, int adminfd) {
+	listen_fd = listenfd;
+	admin_fd = adminfd;
+
+	/* Make the wakeup FD. */
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd < 0)
+		return false;
+
+	/* Allocate each thread's state. */
+	workers = calloc(thread_count, sizeof(*workers));
+	if (!workers)
+		return false;
+	for (unsigned int i = 0; i < thread_count; i++) {
+		struct worker *w = &workers[i];
+		w->pending = calloc(max_pending, sizeof(*w->pending));
+		w->pollfds = calloc(max_pending + 2, sizeof(*w->pollfds));
+		w->pollslots = calloc(max_pending + 2, sizeof(*w->pollslots));
+		if (!w->pending || !w->pollfds || !w->pollslots)
+			return false;
+		for (size_t j = 0; j < max_pending; j++) {
+			w->pending[j].fd = -1;
+			timer_init(&w->pending[j].timer, &expired);
+		}
+	}
+
+	/* Start the threads with every signal blocked, so that signals keep going to the game thread. */
+	sigset_t mask, oldmask;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	bool ok = true;
+	for (unsigned int i = 0; ok && i < thread_count; i++) {
+		int err = pthread_create(&workers[i].thread, nullptr, &run_worker, &workers[i]);
+		if (err) {
+			errno = err;
+			ok = false;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldmask, nullptr);
+	return ok;
+}
+
+
+
+int handshake_get_fd(void) {
+	return wake_fd;
+}
+
+
+
+struct handshake_result *handshake_take(void) {
+	/* Clear the wakeup before emptying the stack, so a result published in between is not missed. */
+	uint64_t count;
+	[[maybe_unused]] ssize_t ssz = read(wake_fd, &count, sizeof(count));
+	struct handshake_result *stack = atomic_exchange_explicit(&results, nullptr, memory_order_acquire);
+
+	/* Reverse the stack into arrival order, and stop counting the connections as pending. */
+	struct handshake_result *list = nullptr;
+	while (stack) {
+		struct handshake_result *next = stack->next;
+		if (stack->fd >= 0)
+			atomic_fetch_sub_explicit(&pending_count, 1, memory_order_relaxed);
+		stack->next = list;
+		list = stack;
+		stack = next;
+	}
+	return list;
+}
+
+
+
+void handshake_get_stats(struct handshake_stats *stats) {
+	stats->threads = thread_count;
+	stats->pending = atomic_load_explicit(&pending_count, memory_order_relaxed);
+	stats->max_pending = max_pending;
+	stats->timed_out = atomic_load_explicit(&timed_out, memory_order_relaxed);
+	stats->rejected = atomic_load_explicit(&rejected, memory_order_relaxed);
+}
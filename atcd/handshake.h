@@ -0,0 +1,57 @@
+#if !defined HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The most groups of a client's passed on with it; any more are not considered by the ACL. */
+#define HANDSHAKE_GROUPS_MAX 256
+
+/* A client that has finished the handshake, or a message about one that failed, passed to the game thread. */
+struct handshake_result;
+struct handshake_result {
+	struct handshake_result *next;
+
+	/* The client's socket, or -1 if this is only a message for debugging clients. */
+	int fd;
+
+	/* Whether the client came in on the admin socket. */
+	bool admin;
+
+	/* The client's user ID. */
+	uid_t uid;
+
+	/* The groups the client's user is in. */
+	size_t group_count;
+	gid_t groups[HANDSHAKE_GROUPS_MAX];
+
+	/* The client's username, or the message. */
+	char text[256];
+};
+
+/* Handshake statistics. */
+struct handshake_stats {
+	unsigned int threads;
+	unsigned int pending;
+	unsigned int max_pending;
+	unsigned long timed_out;
+	unsigned long rejected;
+};
+
+/* Sets how long, in nanoseconds, a client has to finish the handshake, how many handshakes may be in progress at once, and how many threads run them. */
+void handshake_configure(uint64_t timeout, unsigned int max_pending, unsigned int threads);
+
+/* Starts the handshake threads, which accept connections on the listeners (adminfd may be -1). Returns true on success, false on failure. */
+bool handshake_start(int listenfd, int adminfd);
+
+/* Gets an FD that becomes readable when results are waiting. */
+int handshake_get_fd(void);
+
+/* Takes all waiting results, oldest first. The caller owns the list and must free() each entry. */
+struct handshake_result *handshake_take(void);
+
+/* Gets the handshake statistics. */
+void handshake_get_stats(struct handshake_stats *stats);
+
+#endif
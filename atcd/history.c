@@ -0,0 +1,666 @@
+#include "history.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../shared/monotime.h"
+
+
+
+/* How often the writer wakes up to write what has been logged, in nanoseconds. */
+#define WRITE_INTERVAL 100000000u
+
+/* How many messages may be waiting before more are dropped rather than stall the game. */
+#define PENDING_MAX 4096
+
+/* A message waiting to be written. */
+struct message {
+	uint64_t time;
+	uid_t uid;
+
+	/* Its line for the log, newline included. */
+	char *line;
+	size_t length;
+};
+
+/* The history directory, or -1 if none is open. */
+static int dir_fd = -1;
+
+/* The segment being appended to, and its log and index (used only by the writer, once started). */
+static unsigned int write_segment = 0;
+static int log_fd = -1, index_fd = -1;
+static uint64_t log_size = 0;
+
+/* Protects everything below. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signalled to wake the writer, and by the writer when it has written everything it took. */
+static pthread_cond_t wake, written;
+
+/* Messages logged but not yet written, oldest at head; the writer removes them only once they are in the index. */
+static struct message pending[PENDING_MAX];
+static size_t pending_head = 0, pending_count = 0;
+
+/* The time of the last message, which the next may not be before. */
+static uint64_t last_time = 0;
+
+/* The oldest segment and the one being appended to, and how many entries of the latter's index are completely written. */
+static unsigned int first_segment = 1, current_segment = 1;
+static size_t committed = 0;
+
+/* Where each user's last message is in the segment being appended to, sorted by user ID, as of the committed entries. The writer keeps its own copy, which runs ahead of this one while it writes a batch; the two always have the same room. */
+static struct history_user *users = nullptr, *write_users = nullptr;
+static size_t users_count = 0, write_users_count = 0, users_alloc = 0;
+
+/* The number of flushes asked for and the number the writer has finished. */
+static unsigned long flushes_requested = 0, flushes_done = 0;
+
+static unsigned long logged = 0, dropped = 0;
+
+
+
+/* Writes a whole buffer to a file. Returns true on success, false on failure. */
+static bool write_all(int fd, const void *data, size_t length) {
+	const char *p = data;
+	while (length) {
+		ssize_t ret = write(fd, p, length);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += ret;
+		length -= ret;
+	}
+	return true;
+}
+
+
+
+/* Finds where a user is, or would go, in a summary sorted by user ID. */
+static size_t user_position(const struct history_user *list, size_t count, uint32_t uid) {
+	size_t lo = 0, hi = count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (list[mid].uid < uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Finds a user in a summary sorted by user ID. Returns nullptr if they are not in it. */
+static const struct history_user *find_user(const struct history_user *list, size_t count, uint32_t uid) {
+	size_t i = user_position(list, count, uid);
+	return i < count && list[i].uid == uid ? &list[i] : nullptr;
+}
+
+
+
+/* Records in the writer's copy of the summary that a user's last message is now at one less than last, storing where the one before it was (zero if nowhere) in *previous. Returns true on success, false on failure. */
+static bool note_user(uint32_t uid, uint32_t last, uint64_t *previous) {
+	size_t i = user_position(write_users, write_users_count, uid);
+	if (i < write_users_count && write_users[i].uid == uid) {
+		*previous = write_users[i].last;
+		write_users[i].last = last;
+		return true;
+	}
+
+	/* Make room for a new user in both copies. */
+	if (write_users_count == users_alloc) {
+		size_t new_alloc = users_alloc ? users_alloc * 2 : 16;
+		struct history_user *new = realloc(write_users, new_alloc * sizeof(*new));
+		if (!new)
+			return false;
+		write_users = new;
+		pthread_mutex_lock(&lock);
+		new = realloc(users, new_alloc * sizeof(*new));
+		if (new)
+			users = new;
+		pthread_mutex_unlock(&lock);
+		if (!new)
+			return false;
+		users_alloc = new_alloc;
+	}
+	memmove(&write_users[i + 1], &write_users[i], (write_users_count - i) * sizeof(*write_users));
+	write_users[i] = (struct history_user) {.uid = uid, .last = last};
+	write_users_count++;
+	*previous = 0;
+	return true;
+}
+
+/* Puts the writer's copy of the summary back as it was at the last commit, after a batch failed. */
+static void forget_users(void) {
+	memcpy(write_users, users, users_count * sizeof(*users));
+	write_users_count = users_count;
+}
+
+
+
+/* Writes the summary of the segment being closed, as of its last commit. Without one, queries look through every message in the segment instead. */
+static void write_summary(unsigned int segment) {
+	char name[32], temp[32];
+	snprintf(name, sizeof(name), "%08u.usr", segment);
+	snprintf(temp, sizeof(temp), "%08u.usr.new", segment);
+	int fd = openat(dir_fd, temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+	bool ok = write_all(fd, users, users_count * sizeof(*users));
+	close(fd);
+	if (!ok || renameat(dir_fd, temp, dir_fd, name) < 0)
+		unlinkat(dir_fd, temp, 0);
+}
+
+
+
+/* Opens a segment for appending, dropping any index entries for lines that never made it into the log, and closing the summary of the segment it replaces. Returns true on success, false on failure. */
+static bool open_segment(unsigned int segment) {
+	char name[32];
+	snprintf(name, sizeof(name), "%08u.log", segment);
+	int new_log = openat(dir_fd, name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (new_log < 0)
+		return false;
+	snprintf(name, sizeof(name), "%08u.idx", segment);
+	int new_index = openat(dir_fd, name, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (new_index < 0) {
+		close(new_log);
+		return false;
+	}
+
+	/* Trim a torn entry off the end of the index, then any entries past the end of the log. */
+	struct stat log_st, index_st;
+	if (fstat(new_log, &log_st) < 0 || fstat(new_index, &index_st) < 0)
+		goto fail;
+	size_t entries = index_st.st_size / sizeof(struct history_entry);
+	struct history_entry last = {0};
+	while (entries) {
+		if (pread(new_index, &last, sizeof(last), (entries - 1) * sizeof(last)) != sizeof(last))
+			goto fail;
+		if (last.offset + last.length <= (uint64_t) log_st.st_size)
+			break;
+		entries--;
+	}
+	if ((off_t) (entries * sizeof(last)) != index_st.st_size && ftruncate(new_index, entries * sizeof(last)) < 0)
+		goto fail;
+
+	/* Work out where each user's last message is from the entries already there. */
+	write_users_count = 0;
+	for (size_t done = 0; done < entries;) {
+		struct history_entry chunk[256];
+		size_t want = entries - done < 256 ? entries - done : 256;
+		ssize_t ret = pread(new_index, chunk, want * sizeof(*chunk), done * sizeof(*chunk));
+		if (ret != (ssize_t) (want * sizeof(*chunk))) {
+			if (ret >= 0)
+				errno = EIO;
+			goto fail_users;
+		}
+		for (size_t i = 0; i < want; i++) {
+			uint64_t previous;
+			if (!note_user(chunk[i].uid, done + i + 1, &previous))
+				goto fail_users;
+		}
+		done += want;
+	}
+
+	if (log_fd >= 0) {
+		write_summary(write_segment);
+		close(log_fd);
+		close(index_fd);
+	}
+	log_fd = new_log;
+	index_fd = new_index;
+	log_size = log_st.st_size;
+	write_segment = segment;
+	pthread_mutex_lock(&lock);
+	current_segment = segment;
+	committed = entries;
+	memcpy(users, write_users, write_users_count * sizeof(*users));
+	users_count = write_users_count;
+	if (entries && last.time > last_time)
+		last_time = last.time;
+	pthread_mutex_unlock(&lock);
+	return true;
+
+fail_users:
+	forget_users();
+fail:;
+	int saved_errno = errno;
+	close(new_log);
+	close(new_index);
+	errno = saved_errno;
+	return false;
+}
+
+
+
+/* Writes a batch of messages to the current segment, starting a new one first if the log would grow too big. Returns true on success, false on failure. */
+static bool write_batch(const struct message *batch[], size_t n) {
+	size_t total = 0;
+	for (size_t i = 0; i < n; i++)
+		total += batch[i]->length;
+	if (log_size && log_size + total > HISTORY_SEGMENT_MAX && !open_segment(write_segment + 1))
+		return false;
+
+	/* Write the lines, then the entries pointing at them, so that the index never points past the log. */
+	char *lines = malloc(total);
+	struct history_entry *entries = malloc(n * sizeof(*entries));
+	bool ok = lines && entries;
+	size_t offset = 0;
+	for (size_t i = 0; ok && i < n; i++) {
+		memcpy(lines + offset, batch[i]->line, batch[i]->length);
+		uint64_t previous;
+		if (!(ok = note_user((uint32_t) batch[i]->uid, committed + i + 1, &previous)))
+			break;
+		entries[i] = (struct history_entry) {
+			.time = batch[i]->time,
+			.offset = log_size + offset,
+			.length = (uint32_t) batch[i]->length,
+			.uid = (uint32_t) batch[i]->uid,
+			.previous = previous,
+		};
+		offset += batch[i]->length;
+	}
+	if (ok && !write_all(log_fd, lines, total)) {
+		/* Take back any part of the lines, so that later entries point at the right place. */
+		[[maybe_unused]] int ret = ftruncate(log_fd, log_size);
+		ok = false;
+	}
+	if (ok) {
+		log_size += total;
+		if (!write_all(index_fd, entries, n * sizeof(*entries))) {
+			/* Take back any part of an entry, so that later ones stay aligned. */
+			[[maybe_unused]] int ret = ftruncate(index_fd, committed * sizeof(*entries));
+			ok = false;
+		}
+	}
+
+	/* Let queries see the new entries, or put the summary back if they were not written. */
+	if (ok) {
+		pthread_mutex_lock(&lock);
+		memcpy(users, write_users, write_users_count * sizeof(*users));
+		users_count = write_users_count;
+		committed += n;
+		pthread_mutex_unlock(&lock);
+	} else {
+		forget_users();
+	}
+	free(lines);
+	free(entries);
+	return ok;
+}
+
+
+
+static void *run_writer(void *arg __attribute__((unused))) {
+	static const struct message *batch[PENDING_MAX];
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		/* Sleep until someone wants a flush, or it is time anyway. */
+		if (flushes_done == flushes_requested) {
+			struct timespec deadline = monotime_to_timespec(monotime_now() + WRITE_INTERVAL);
+			pthread_cond_timedwait(&wake, &lock, &deadline);
+		}
+
+		/* Take everything logged so far; it stays pending, for queries to see, until it is in the index. */
+		size_t n = pending_count;
+		for (size_t i = 0; i < n; i++)
+			batch[i] = &pending[(pending_head + i) % PENDING_MAX];
+		unsigned long target = flushes_requested;
+		pthread_mutex_unlock(&lock);
+
+		/* Write it out without holding the lock; if the disk fails, the messages are lost. */
+		bool ok = n && write_batch(batch, n);
+
+		pthread_mutex_lock(&lock);
+		for (size_t i = 0; i < n; i++)
+			free(pending[(pending_head + i) % PENDING_MAX].line);
+		pending_head = (pending_head + n) % PENDING_MAX;
+		pending_count -= n;
+		if (!ok)
+			dropped += n;
+		flushes_done = target;
+		pthread_cond_broadcast(&written);
+	}
+	return nullptr;
+}
+
+
+
+bool history_open(const char *path) {
+	/* Open the directory, making it if need be. */
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		return false;
+	dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0)
+		return false;
+
+	/* Find the oldest and newest segments, and carry on appending to the newest. */
+	DIR *dir = opendir(path);
+	if (!dir)
+		goto fail;
+	unsigned int lowest = 0, highest = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		unsigned int segment;
+		char suffix[8];
+		if (sscanf(ent->d_name, "%8u.%7s", &segment, suffix) == 2 && strcmp(suffix, "idx") == 0 && segment) {
+			if (!lowest || segment < lowest)
+				lowest = segment;
+			if (segment > highest)
+				highest = segment;
+		}
+	}
+	closedir(dir);
+	first_segment = lowest ? lowest : 1;
+	if (!open_segment(highest ? highest : 1))
+		goto fail;
+
+	/* Time the writer's sleeps by the monotonic clock. */
+	pthread_condattr_t attr;
+	int err = pthread_condattr_init(&attr);
+	if (err) {
+		errno = err;
+		goto fail;
+	}
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	err = pthread_cond_init(&wake, &attr);
+	if (!err && (err = pthread_cond_init(&written, &attr)))
+		pthread_cond_destroy(&wake);
+	pthread_condattr_destroy(&attr);
+	if (err) {
+		errno = err;
+		goto fail;
+	}
+
+	/* Start the writer with every signal blocked, so that signals keep going to the game thread. */
+	sigset_t mask, oldmask;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	pthread_t thread;
+	err = pthread_create(&thread, nullptr, &run_writer, nullptr);
+	pthread_sigmask(SIG_SETMASK, &oldmask, nullptr);
+	if (err) {
+		pthread_cond_destroy(&wake);
+		pthread_cond_destroy(&written);
+		errno = err;
+		goto fail;
+	}
+	return true;
+
+fail:
+	err = errno;
+	if (log_fd >= 0) {
+		close(log_fd);
+		close(index_fd);
+		log_fd = index_fd = -1;
+	}
+	close(dir_fd);
+	dir_fd = -1;
+	errno = err;
+	return false;
+}
+
+
+
+bool history_enabled(void) {
+	return dir_fd >= 0;
+}
+
+
+
+void history_log(uid_t uid, const char *username, const char *text) {
+	if (dir_fd < 0)
+		return;
+
+	/* Make the line, on one line whatever the text holds. */
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct tm tm;
+	char stamp[32];
+	gmtime_r(&now.tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	char *line;
+	int length = asprintf(&line, "%s <%s> %s\n", stamp, username, text);
+	if (length < 0) {
+		pthread_mutex_lock(&lock);
+		dropped++;
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	for (char *p = line; p < line + length - 1; p++)
+		if (*p == '\n' || *p == '\r')
+			*p = ' ';
+
+	/* Queue it, unless the writer has fallen too far behind. */
+	uint64_t time = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+	pthread_mutex_lock(&lock);
+	if (pending_count == PENDING_MAX) {
+		dropped++;
+		free(line);
+	} else {
+		if (time < last_time)
+			time = last_time;
+		last_time = time;
+		pending[(pending_head + pending_count) % PENDING_MAX] = (struct message) {.time = time, .uid = uid, .line = line, .length = length};
+		pending_count++;
+		logged++;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+
+
+/* Finds where a user's last message is in a closed segment from its summary, storing one more than its index, or zero if they have none there, in *last. Returns true on success, false (with errno=ENOENT if the segment has no summary) on failure. */
+static bool look_up_user(unsigned int segment, uid_t uid, uint32_t *last) {
+	char name[32];
+	snprintf(name, sizeof(name), "%08u.usr", segment);
+	int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+	*last = 0;
+	size_t n = st.st_size / sizeof(struct history_user);
+	if (!n) {
+		close(fd);
+		return true;
+	}
+	const struct history_user *list = mmap(nullptr, n * sizeof(*list), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (list == MAP_FAILED)
+		return false;
+	const struct history_user *user = find_user(list, n, (uint32_t) uid);
+	if (user)
+		*last = user->last;
+	munmap((void *) list, n * sizeof(*list));
+	return true;
+}
+
+
+
+/* Adds the latest matching messages of a segment, newest first, looking at no more than max_entries of its index. For one user, follows the links between their messages back from their last, as given by *last or, if last is nullptr, by the segment's summary, and looks at every message only if there is no summary. Sets *older if earlier segments can hold nothing recent enough. Returns true on success, false on failure. */
+static bool search_segment(unsigned int segment, size_t max_entries, const uint32_t *last, uid_t uid, bool any_user, uint64_t since, char **lines, size_t limit, size_t *count, bool *older) {
+	/* Find where the user's messages end, if that can be known without looking through them. */
+	bool linked = false;
+	uint32_t head = 0;
+	if (!any_user) {
+		if (last) {
+			head = *last;
+			linked = true;
+		} else if (look_up_user(segment, uid, &head)) {
+			linked = true;
+		} else if (errno != ENOENT) {
+			return false;
+		}
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "%08u.idx", segment);
+	int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+	size_t n = st.st_size / sizeof(struct history_entry);
+	if (n > max_entries)
+		n = max_entries;
+	if (!n) {
+		close(fd);
+		return true;
+	}
+	const struct history_entry *entries = mmap(nullptr, n * sizeof(*entries), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (entries == MAP_FAILED)
+		return false;
+
+	/* Entries are in time order, so if the first is too old, so are all earlier segments. */
+	*older = entries[0].time < since;
+
+	/* Read the lines of matching entries, newest first, stopping at the first too old. */
+	bool ok = true;
+	int text_fd = -1;
+	if (head > n)
+		linked = false;
+	size_t next = linked ? head : n;
+	while (next && *count < limit) {
+		const struct history_entry *e = &entries[next - 1];
+		if (e->time < since)
+			break;
+
+		/* Go on to the user's previous message, or just the one before; a link that does not lead back is damage, and ends the search. */
+		size_t previous = linked ? e->previous : next - 1;
+		if (previous >= next)
+			previous = 0;
+		next = previous;
+		if ((!any_user && e->uid != uid) || !e->length)
+			continue;
+
+		if (text_fd < 0) {
+			snprintf(name, sizeof(name), "%08u.log", segment);
+			text_fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+			if (text_fd < 0) {
+				ok = false;
+				break;
+			}
+		}
+		char *line = malloc(e->length);
+		if (!line) {
+			ok = false;
+			break;
+		}
+		ssize_t ret = pread(text_fd, line, e->length, e->offset);
+		if (ret != (ssize_t) e->length) {
+			free(line);
+			if (ret >= 0)
+				errno = EIO;
+			ok = false;
+			break;
+		}
+		line[e->length - 1] = '\0';
+		lines[(*count)++] = line;
+	}
+
+	int saved_errno = errno;
+	if (text_fd >= 0)
+		close(text_fd);
+	munmap((void *) entries, n * sizeof(*entries));
+	errno = saved_errno;
+	return ok;
+}
+
+
+
+bool history_query(uid_t uid, bool any_user, uint64_t since, char **lines, size_t limit, size_t *count) {
+	*count = 0;
+	if (dir_fd < 0) {
+		errno = ENOTCONN;
+		return false;
+	}
+
+	/* Start with the newest messages, those still waiting to be written, and note how much of the disk to look at. */
+	pthread_mutex_lock(&lock);
+	bool ok = true;
+	for (size_t i = pending_count; i-- > 0 && *count < limit;) {
+		const struct message *m = &pending[(pending_head + i) % PENDING_MAX];
+		if (m->time < since)
+			break;
+		if (!any_user && m->uid != uid)
+			continue;
+		char *line = strndup(m->line, m->length - 1);
+		if (!line) {
+			ok = false;
+			break;
+		}
+		lines[(*count)++] = line;
+	}
+	unsigned int newest = current_segment, oldest = first_segment;
+	size_t newest_entries = committed;
+	const struct history_user *user = find_user(users, users_count, (uint32_t) uid);
+	uint32_t newest_last = user ? user->last : 0;
+	pthread_mutex_unlock(&lock);
+
+	/* Then go back through the segments until enough are found or the rest are too old. */
+	for (unsigned int segment = newest; ok && segment >= oldest && *count < limit; segment--) {
+		bool older = false;
+		ok = search_segment(segment, segment == newest ? newest_entries : SIZE_MAX, segment == newest ? &newest_last : nullptr, uid, any_user, since, lines, limit, count, &older);
+		if (older)
+			break;
+	}
+
+	if (!ok) {
+		int saved_errno = errno;
+		for (size_t i = 0; i < *count; i++)
+			free(lines[i]);
+		*count = 0;
+		errno = saved_errno;
+		return false;
+	}
+
+	/* Put them oldest first. */
+	for (size_t i = 0; i < *count / 2; i++) {
+		char *temp = lines[i];
+		lines[i] = lines[*count - 1 - i];
+		lines[*count - 1 - i] = temp;
+	}
+	return true;
+}
+
+
+
+void history_flush(void) {
+	if (dir_fd < 0)
+		return;
+	pthread_mutex_lock(&lock);
+	unsigned long target = ++flushes_requested;
+	pthread_cond_signal(&wake);
+	while (flushes_done < target)
+		pthread_cond_wait(&written, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+
+
+bool history_get_stats(unsigned long *logged_ret, unsigned long *dropped_ret) {
+	if (dir_fd < 0)
+		return false;
+	pthread_mutex_lock(&lock);
+	*logged_ret = logged;
+	*dropped_ret = dropped;
+	pthread_mutex_unlock(&lock);
+	return true;
+}
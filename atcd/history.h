@@ -0,0 +1,66 @@
+#if !defined HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Chat history, kept in a directory of numbered segments. Each segment is a
+ * log, NNNNNNNN.log, with one line per message ("<UTC time> <user> text"),
+ * and an index, NNNNNNNN.idx, of fixed-size entries in time order giving
+ * each message's time, user ID and place in the log, and linking it to the
+ * same user's previous message in the segment. A new segment is begun once
+ * the log passes HISTORY_SEGMENT_MAX bytes, and the one closed gets a
+ * summary, NNNNNNNN.usr, of where each user's last message in it is, sorted
+ * by user ID. Messages are written by a background thread; queries map the
+ * indexes, follow one user's links without looking at anyone else's
+ * messages, and read only the lines they return.
+ */
+
+/* The size past which a segment's log is closed and a new segment begun. */
+#define HISTORY_SEGMENT_MAX (64u * 1024u * 1024u)
+
+/* An index entry, in host byte order. */
+struct history_entry {
+	/* When the message was sent, in CLOCK_REALTIME nanoseconds; never less than the entry before. */
+	uint64_t time;
+
+	/* Where its line starts in the segment's log, and its length including the newline. */
+	uint64_t offset;
+	uint32_t length;
+
+	uint32_t uid;
+
+	/* One more than the index of the same user's previous entry in the segment, or zero if this is their first. */
+	uint64_t previous;
+};
+
+/* A summary entry, in host byte order. */
+struct history_user {
+	uint32_t uid;
+
+	/* One more than the index of the user's last entry in the segment. */
+	uint32_t last;
+};
+
+/* Starts keeping chat history in a directory, created if need be, carrying on from the last segment in it, with writes done on a background thread. Returns true on success, false on failure. */
+bool history_open(const char *path);
+
+/* Checks whether chat history is being kept. */
+bool history_enabled(void);
+
+/* Adds a chat message. Returns immediately; the message is written later. Does nothing if no history is being kept. */
+void history_log(uid_t uid, const char *username, const char *text);
+
+/* Finds the latest messages (up to limit of them) at or after a time, from one user or, if any_user is set, from anyone, storing their lines oldest first in lines[] and their number in *count. The caller must free() each line. Returns true on success, false on failure. */
+bool history_query(uid_t uid, bool any_user, uint64_t since, char **lines, size_t limit, size_t *count);
+
+/* Waits until everything logged so far has been written, e.g. before exiting. */
+void history_flush(void);
+
+/* Gets the number of messages logged and the number dropped because the disk could not keep up. Returns false if no history is being kept. */
+bool history_get_stats(unsigned long *logged, unsigned long *dropped);
+
+#endif
@@ -0,0 +1,67 @@
+#include "intern.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+
+/* The interned strings, as an open-addressed hash table whose size is a power of two. */
+static const char **table = nullptr;
+static size_t table_count = 0, table_size = 0;
+
+
+
+/* Hashes a string using FNV-1a. */
+static uint32_t hash(const char *string) {
+	uint32_t h = 2166136261u;
+	for (; *string; string++)
+		h = (h ^ (unsigned char) *string) * 16777619u;
+	return h;
+}
+
+
+
+/* Doubles the size of the table, rehashing every string. Returns true on success, false on failure. */
+static bool grow_table(void) {
+	size_t new_size = table_size ? table_size * 2 : 16;
+	const char **new = calloc(new_size, sizeof(*new));
+	if (!new)
+		return false;
+	for (size_t i = 0; i < table_size; i++)
+		if (table[i]) {
+			size_t pos = hash(table[i]) & (new_size - 1);
+			while (new[pos])
+				pos = (pos + 1) & (new_size - 1);
+			new[pos] = table[i];
+		}
+	free(table);
+	table = new;
+	table_size = new_size;
+	return true;
+}
+
+
+
+const char *intern(const char *string) {
+	/* Keep the table at most half full so probe sequences stay short. */
+	if ((table_count + 1) * 2 > table_size && !grow_table())
+		return nullptr;
+
+	/* Look for an existing copy, stopping at the first empty slot. */
+	size_t pos = hash(string) & (table_size - 1);
+	while (table[pos]) {
+		if (strcmp(table[pos], string) == 0)
+			return table[pos];
+		pos = (pos + 1) & (table_size - 1);
+	}
+
+	/* Make a new copy in the empty slot. */
+	char *copy = strdup(string);
+	if (!copy)
+		return nullptr;
+	table[pos] = copy;
+	table_count++;
+	return copy;
+}
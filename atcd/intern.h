@@ -0,0 +1,7 @@
+#if !defined INTERN_H
+#define INTERN_H
+
+/* Returns the single shared copy of a string, making one if this is the first time it has been seen. The copy lives until exit. Returns nullptr on failure. */
+const char *intern(const char *string);
+
+#endif
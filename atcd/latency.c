@@ -0,0 +1,57 @@
+#include "latency.h"
+#include <stddef.h>
+
+
+
+/* Histogram of latencies; bucket i counts latencies below 2^i nanoseconds (and at least 2^(i-1)). */
+static unsigned long histogram[64];
+
+static unsigned long count = 0, over_target = 0;
+static uint64_t target = 1000000u, max = 0;
+
+
+
+/* Finds the histogram bucket for a latency. */
+static unsigned int bucket_of(uint64_t latency) {
+	return latency ? 64 - __builtin_clzll(latency) : 0;
+}
+
+/* Finds the upper bound of the bucket containing a given fraction (in percent) of the samples. */
+static uint64_t percentile(unsigned int percent) {
+	unsigned long wanted = (count * percent + 99) / 100, seen = 0;
+	for (unsigned int i = 0; i < 64; i++) {
+		seen += histogram[i];
+		if (seen >= wanted && seen)
+			return i < 63 ? (uint64_t) 1 << i : UINT64_MAX;
+	}
+	return 0;
+}
+
+
+
+void latency_set_target(uint64_t new_target) {
+	target = new_target;
+}
+
+
+
+void latency_record(uint64_t latency) {
+	unsigned int bucket = bucket_of(latency);
+	histogram[bucket < 64 ? bucket : 63]++;
+	count++;
+	if (latency > target)
+		over_target++;
+	if (latency > max)
+		max = latency;
+}
+
+
+
+void latency_get_summary(struct latency_summary *summary) {
+	summary->count = count;
+	summary->over_target = over_target;
+	summary->target = target;
+	summary->p50 = percentile(50);
+	summary->p99 = percentile(99);
+	summary->max = max;
+}
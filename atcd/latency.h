@@ -0,0 +1,25 @@
+#if !defined LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+/* A summary of recorded control command latencies, in nanoseconds. Percentiles are upper bounds of power-of-two buckets. */
+struct latency_summary {
+	unsigned long count;
+	unsigned long over_target;
+	uint64_t target;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t max;
+};
+
+/* Sets the latency target (service level objective), in nanoseconds. */
+void latency_set_target(uint64_t target);
+
+/* Records the time taken to carry out one control command, from the client sending it to completion. */
+void latency_record(uint64_t latency);
+
+/* Summarizes the latencies recorded so far. */
+void latency_get_summary(struct latency_summary *summary);
+
+#endif
@@ -0,0 +1,202 @@
+#include "macro.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+
+/* A user's macro. */
+struct macro {
+	uid_t uid;
+	char name[MACRO_NAME_MAX + 1];
+	char body[MACRO_BODY_MAX + 1];
+};
+
+static size_t macros_count = 0, macros_alloc = 0;
+static struct macro *macros = nullptr;
+
+
+
+/* Finds a user's macro by name, which need not be NUL-terminated. Returns nullptr if there is none. */
+static struct macro *find_macro(uid_t uid, const char *name, size_t length) {
+	for (size_t i = 0; i < macros_count; i++)
+		if (macros[i].uid == uid && strlen(macros[i].name) == length && memcmp(macros[i].name, name, length) == 0)
+			return &macros[i];
+	return nullptr;
+}
+
+
+
+/* Strips leading and trailing spaces from a span of text, in place. */
+static void trim(const char **text, size_t *length) {
+	while (*length && **text == ' ') {
+		++*text;
+		--*length;
+	}
+	while (*length && (*text)[*length - 1] == ' ')
+		--*length;
+}
+
+/* Checks that a span of text is a nonempty run of plane letters. */
+static bool is_plane_list(const char *text, size_t length) {
+	if (!length)
+		return false;
+	for (size_t i = 0; i < length; i++)
+		if (!isalpha((unsigned char) text[i]))
+			return false;
+	return true;
+}
+
+/* Adds a command, made of an optional plane letter and some text, to an expansion. Returns true on success, false on failure. */
+static bool emit(char plane, const char *text, size_t length, char commands[][MACRO_COMMAND_MAX], size_t *count) {
+	if (!length || memchr(text, ' ', length) || (plane != '\0') + length + 2 > MACRO_COMMAND_MAX) {
+		errno = EINVAL;
+		return false;
+	}
+	if (*count == MACRO_EXPANSION_MAX) {
+		errno = E2BIG;
+		return false;
+	}
+	char *command = commands[(*count)++];
+	if (plane)
+		*command++ = plane;
+	memcpy(command, text, length);
+	command[length] = '\n';
+	command[length + 1] = '\0';
+	return true;
+}
+
+
+
+/* Expands the items in a batch or macro body, with planes (if not nullptr) standing for "*" before a ":", and with names looked up as macros only if allowed. Returns true on success, false on failure. */
+static bool expand(uid_t uid, const char *text, const char *planes, size_t planes_length, bool allow_macros, char commands[][MACRO_COMMAND_MAX], size_t *count) {
+	for (;;) {
+		/* Take the next item. */
+		const char *end = strchrnul(text, ';');
+		const char *item = text;
+		size_t length = end - text;
+		trim(&item, &length);
+
+		const char *colon = memchr(item, ':', length);
+		const char *space = memchr(item, ' ', length);
+		if (colon) {
+			/* Give each plane in the list the command after the colon. */
+			const char *list = item, *command = colon + 1;
+			size_t list_length = colon - item, command_length = length - list_length - 1;
+			trim(&list, &list_length);
+			trim(&command, &command_length);
+			if (list_length == 1 && *list == '*' && planes) {
+				list = planes;
+				list_length = planes_length;
+			}
+			if (!is_plane_list(list, list_length))
+				goto invalid;
+			for (size_t i = 0; i < list_length; i++)
+				if (!emit(list[i], command, command_length, commands, count))
+					return false;
+		} else {
+			/* Run a macro if the first word names one, or else take the item as it is. */
+			size_t name_length = space ? (size_t) (space - item) : length;
+			struct macro *macro = allow_macros ? find_macro(uid, item, name_length) : nullptr;
+			if (macro) {
+				const char *args = item + name_length;
+				size_t args_length = length - name_length;
+				trim(&args, &args_length);
+				if (args_length && !is_plane_list(args, args_length))
+					goto invalid;
+				if (!expand(uid, macro->body, args_length ? args : nullptr, args_length, false, commands, count))
+					return false;
+			} else if (!emit('\0', item, length, commands, count)) {
+				return false;
+			}
+		}
+
+		if (!*end)
+			break;
+		text = end + 1;
+	}
+	return true;
+
+invalid:
+	errno = EINVAL;
+	return false;
+}
+
+
+
+bool macro_define(uid_t uid, const char *name, const char *body) {
+	/* Names are short words that start with a letter. */
+	size_t name_length = strlen(name);
+	if (!name_length || name_length > MACRO_NAME_MAX || !isalpha((unsigned char) name[0]))
+		goto invalid;
+	for (size_t i = 0; i < name_length; i++)
+		if (!isalnum((unsigned char) name[i]) && name[i] != '_' && name[i] != '-')
+			goto invalid;
+
+	/* The body must expand cleanly, as far as can be told without knowing the planes it will be given. */
+	char commands[MACRO_EXPANSION_MAX][MACRO_COMMAND_MAX];
+	size_t count = 0;
+	if (strlen(body) > MACRO_BODY_MAX || !expand(uid, body, "a", 1, false, commands, &count))
+		goto invalid;
+
+	/* Replace an existing definition, or add a new one. */
+	struct macro *macro = find_macro(uid, name, name_length);
+	if (!macro) {
+		size_t owned = 0;
+		for (size_t i = 0; i < macros_count; i++)
+			if (macros[i].uid == uid)
+				owned++;
+		if (owned == MACRO_PER_USER) {
+			errno = ENOSPC;
+			return false;
+		}
+		if (macros_count == macros_alloc) {
+			size_t new_alloc = macros_alloc ? macros_alloc * 2 : 4;
+			struct macro *new = realloc(macros, new_alloc * sizeof(*new));
+			if (!new)
+				return false;
+			macros = new;
+			macros_alloc = new_alloc;
+		}
+		macro = &macros[macros_count++];
+		macro->uid = uid;
+		memcpy(macro->name, name, name_length + 1);
+	}
+	strcpy(macro->body, body);
+	return true;
+
+invalid:
+	errno = EINVAL;
+	return false;
+}
+
+
+
+bool macro_remove(uid_t uid, const char *name) {
+	struct macro *macro = find_macro(uid, name, strlen(name));
+	if (!macro) {
+		errno = ENOENT;
+		return false;
+	}
+	*macro = macros[--macros_count];
+	return true;
+}
+
+
+
+bool macro_get(size_t index, uid_t *uid, const char **name, const char **body) {
+	if (index >= macros_count)
+		return false;
+	*uid = macros[index].uid;
+	*name = macros[index].name;
+	*body = macros[index].body;
+	return true;
+}
+
+
+
+bool macro_expand(uid_t uid, const char *batch, char commands[][MACRO_COMMAND_MAX], size_t *count) {
+	*count = 0;
+	return expand(uid, batch, nullptr, 0, true, commands, count);
+}
@@ -0,0 +1,46 @@
+#if !defined MACRO_H
+#define MACRO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Command batches and the macros users keep for them. A batch is a list of
+ * items separated by ";", each one of:
+ *
+ *   CMD           a single command, e.g. "atw"
+ *   PLANES:CMD    the command for each of the plane letters, e.g. "abc:tw"
+ *   NAME [PLANES] a macro of the user's, with PLANES put in place of every
+ *                 "*" before a ":" in it, e.g. "turn abc" with "turn" defined
+ *                 as "*:tw;*:a5"
+ *
+ * Items in a macro's body are never taken as macros themselves.
+ */
+
+/* The most commands a batch may expand to. */
+#define MACRO_EXPANSION_MAX 32
+
+/* The longest command an item may expand to, including the trailing newline and NUL. */
+#define MACRO_COMMAND_MAX 32
+
+/* The longest macro name, and the longest body, not counting the NUL. */
+#define MACRO_NAME_MAX 15
+#define MACRO_BODY_MAX 200
+
+/* The most macros one user may keep. */
+#define MACRO_PER_USER 16
+
+/* Defines or redefines a user's macro. Returns true on success, false with errno=EINVAL if the name or body is malformed, ENOSPC if the user has too many macros, or ENOMEM. */
+bool macro_define(uid_t uid, const char *name, const char *body);
+
+/* Removes a user's macro. Returns true on success, false with errno=ENOENT if there is no such macro. */
+bool macro_remove(uid_t uid, const char *name);
+
+/* Gets the index'th of all macros kept, of any user. Returns false if there are no more. */
+bool macro_get(size_t index, uid_t *uid, const char **name, const char **body);
+
+/* Expands a batch from a user into newline-terminated commands, storing them in commands[] and their number in *count, without checking the commands themselves. Returns true on success, false with errno=EINVAL if the batch is malformed or E2BIG if it expands to more than MACRO_EXPANSION_MAX commands. */
+bool macro_expand(uid_t uid, const char *batch, char commands[][MACRO_COMMAND_MAX], size_t *count);
+
+#endif
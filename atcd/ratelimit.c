@@ -0,0 +1,132 @@
+#include "ratelimit.h"
+#include <stdlib.h>
+
+
+
+/* A per-user token bucket, stored as a theoretical arrival time (GCRA) rather than a token count. */
+struct bucket {
+	uid_t uid;
+	const char *username;
+	uint64_t tat;
+	unsigned long served;
+	unsigned long throttled;
+
+	/* The separate, smaller allowance for control commands on the priority lane. */
+	uint64_t control_tat;
+	unsigned long control_deferred;
+};
+
+static size_t bucket_count = 0, bucket_alloc = 0;
+static struct bucket *buckets = nullptr;
+
+/* The time between tokens, in nanoseconds, or zero if unlimited. */
+static uint64_t interval = 50000000u;
+
+/* The number of tokens a bucket can hold. */
+static uint64_t burst_size = 40;
+
+/* The time between control command tokens, and the number a bucket can hold; these are fixed, since a player never needs many. */
+#define CONTROL_INTERVAL 200000000u
+#define CONTROL_BURST 10u
+
+
+
+void ratelimit_configure(unsigned int rate, unsigned int burst) {
+	interval = rate ? 1000000000u / rate : 0;
+	burst_size = burst ? burst : 1;
+}
+
+
+
+unsigned int ratelimit_get_burst(void) {
+	return interval ? (unsigned int) burst_size : 0;
+}
+
+
+
+int ratelimit_get(uid_t uid, const char *username) {
+	/* Look for an existing bucket. */
+	for (size_t i = 0; i < bucket_count; i++)
+		if (buckets[i].uid == uid)
+			return (int) i;
+
+	/* Grow the array if needed. */
+	if (bucket_count == bucket_alloc) {
+		size_t new_alloc = bucket_alloc ? bucket_alloc * 2 : 4;
+		struct bucket *new = realloc(buckets, new_alloc * sizeof(*buckets));
+		if (!new)
+			return -1;
+		buckets = new;
+		bucket_alloc = new_alloc;
+	}
+
+	/* Create a new, full bucket. */
+	buckets[bucket_count].uid = uid;
+	buckets[bucket_count].username = username;
+	buckets[bucket_count].tat = 0;
+	buckets[bucket_count].served = 0;
+	buckets[bucket_count].throttled = 0;
+	buckets[bucket_count].control_tat = 0;
+	buckets[bucket_count].control_deferred = 0;
+	return (int) bucket_count++;
+}
+
+
+
+bool ratelimit_take(int bucket, uint64_t now) {
+	return ratelimit_take_many(bucket, 1, now);
+}
+
+
+
+bool ratelimit_take_many(int bucket, unsigned int count, uint64_t now) {
+	struct bucket *b = &buckets[bucket];
+
+	/* The tokens are available if spending them would not push the arrival time more than a full burst ahead of now. */
+	uint64_t tat = b->tat > now ? b->tat : now;
+	if (tat + count * interval - now > burst_size * interval)
+		return false;
+
+	b->tat = tat + count * interval;
+	b->served += count;
+	return true;
+}
+
+
+
+bool ratelimit_take_control(int bucket, uint64_t now) {
+	struct bucket *b = &buckets[bucket];
+	uint64_t tat = b->control_tat > now ? b->control_tat : now;
+	if (tat + CONTROL_INTERVAL - now > CONTROL_BURST * CONTROL_INTERVAL) {
+		b->control_deferred++;
+		return false;
+	}
+	b->control_tat = tat + CONTROL_INTERVAL;
+	return true;
+}
+
+
+
+uint64_t ratelimit_next(int bucket) {
+	const struct bucket *b = &buckets[bucket];
+	uint64_t window = (burst_size - 1) * interval;
+	return b->tat > window ? b->tat - window : 0;
+}
+
+
+
+void ratelimit_count_throttled(int bucket) {
+	buckets[bucket].throttled++;
+}
+
+
+
+bool ratelimit_get_stats(int bucket, const char **username, unsigned long *served, unsigned long *throttled, unsigned long *control_deferred) {
+	if (bucket < 0 || (size_t) bucket >= bucket_count)
+		return false;
+	*username = buckets[bucket].username;
+	*served = buckets[bucket].served;
+	*throttled = buckets[bucket].throttled;
+	*control_deferred = buckets[bucket].control_deferred;
+	return true;
+}
@@ -0,0 +1,36 @@
+#if !defined RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Sets the sustained rate (packets per second, zero for unlimited) and burst size allowed to each user. */
+void ratelimit_configure(unsigned int rate, unsigned int burst);
+
+/* Gets the burst size, the most tokens that can ever be taken at once, or zero if there is no limit. */
+unsigned int ratelimit_get_burst(void);
+
+/* Finds or creates the token bucket for a user, keeping a pointer to the (interned) username. Returns the bucket number, or -1 on failure. */
+int ratelimit_get(uid_t uid, const char *username);
+
+/* Takes a token from a bucket. Returns true if one was available, false if the user must wait. */
+bool ratelimit_take(int bucket, uint64_t now);
+
+/* Takes a number of tokens from a bucket, all or none of them. Returns true if they were all available, false if the user must wait (or can never have that many at once). */
+bool ratelimit_take_many(int bucket, unsigned int count, uint64_t now);
+
+/* Takes a token from a bucket's separate allowance for control commands. Returns true if one was available, false (counting the command as deferred) if not. */
+bool ratelimit_take_control(int bucket, uint64_t now);
+
+/* Gets the time at which a token will next be available in a bucket. */
+uint64_t ratelimit_next(int bucket);
+
+/* Records that a packet from a bucket's user had to wait for a token. */
+void ratelimit_count_throttled(int bucket);
+
+/* Gets the statistics for a bucket. Returns false if there is no such bucket. */
+bool ratelimit_get_stats(int bucket, const char **username, unsigned long *served, unsigned long *throttled, unsigned long *control_deferred);
+
+#endif
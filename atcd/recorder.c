@@ -0,0 +1,231 @@
+#include "recorder.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../shared/monotime.h"
+
+
+
+/* How often the writer wakes up to write what has been logged, in nanoseconds. */
+#define WRITE_INTERVAL 100000000u
+
+/* How much may be waiting before the writer is woken early. */
+#define WAKE_THRESHOLD 65536u
+
+/* How much may be waiting before records are dropped rather than stall the game. */
+#define BUFFER_LIMIT (16u * 1024u * 1024u)
+
+/* A growable byte buffer. */
+struct buffer {
+	uint8_t *data;
+	size_t length, alloc;
+};
+
+/* The recording, or -1 if none is open. */
+static int file_fd = -1;
+
+/* Protects everything below. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signalled to wake the writer, and by the writer when it has written everything it took. */
+static pthread_cond_t wake, written;
+
+/* Records logged but not yet taken by the writer, and how many there are. */
+static struct buffer pending = {nullptr, 0, 0};
+static unsigned long pending_records = 0;
+
+/* The timestamp of the last record, which the next one is stored relative to. */
+static uint64_t last_time = 0;
+
+/* The number of flushes asked for and the number the writer has finished. */
+static unsigned long flushes_requested = 0, flushes_done = 0;
+
+static unsigned long logged = 0, dropped = 0;
+
+
+
+/* Makes room in a buffer for more bytes. Returns true on success, false if the buffer would grow past the limit or memory is short. */
+static bool reserve(struct buffer *buf, size_t more) {
+	if (buf->length + more <= buf->alloc)
+		return true;
+	if (buf->length + more > BUFFER_LIMIT)
+		return false;
+	size_t new_alloc = buf->alloc ? buf->alloc : 4096;
+	while (new_alloc < buf->length + more)
+		new_alloc *= 2;
+	uint8_t *new = realloc(buf->data, new_alloc);
+	if (!new)
+		return false;
+	buf->data = new;
+	buf->alloc = new_alloc;
+	return true;
+}
+
+
+
+/* Writes a whole buffer to the file. Returns true on success, false on failure. */
+static bool write_all(const uint8_t *data, size_t length) {
+	while (length) {
+		ssize_t ret = write(file_fd, data, length);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += ret;
+		length -= ret;
+	}
+	return true;
+}
+
+
+
+static void *run_writer(void *arg __attribute__((unused))) {
+	struct buffer out = {nullptr, 0, 0};
+	pthread_mutex_lock(&lock);
+	while (file_fd >= 0) {
+		/* Sleep until there is plenty to write, someone wants a flush, or it is time anyway. */
+		if (pending.length < WAKE_THRESHOLD && flushes_done == flushes_requested) {
+			struct timespec deadline = monotime_to_timespec(monotime_now() + WRITE_INTERVAL);
+			pthread_cond_timedwait(&wake, &lock, &deadline);
+		}
+
+		/* Take everything logged so far, leaving an empty buffer in its place. */
+		struct buffer temp = pending;
+		pending = out;
+		out = temp;
+		unsigned long target = flushes_requested, records = pending_records;
+		pending_records = 0;
+		pthread_mutex_unlock(&lock);
+
+		/* Write it out without holding the lock; if the disk fails, the records are lost. */
+		if (out.length && !write_all(out.data, out.length)) {
+			pthread_mutex_lock(&lock);
+			dropped += records;
+			pthread_mutex_unlock(&lock);
+		}
+		out.length = 0;
+
+		pthread_mutex_lock(&lock);
+		flushes_done = target;
+		pthread_cond_broadcast(&written);
+	}
+	pthread_mutex_unlock(&lock);
+	return nullptr;
+}
+
+
+
+bool recorder_open(const char *path) {
+	/* Open the file, starting it off with the magic string if it is new. */
+	file_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (file_fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(file_fd, &st) < 0 || (st.st_size == 0 && !write_all((const uint8_t *) RECORDING_MAGIC, RECORDING_MAGIC_LENGTH)))
+		goto fail;
+
+	/* Time the writer's sleeps by the monotonic clock. */
+	pthread_condattr_t attr;
+	if (pthread_condattr_init(&attr) != 0)
+		goto fail;
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wake, &attr);
+	pthread_cond_init(&written, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* Start the writer with every signal blocked, so that signals keep going to the game thread. */
+	sigset_t mask, oldmask;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	pthread_t thread;
+	int err = pthread_create(&thread, nullptr, &run_writer, nullptr);
+	pthread_sigmask(SIG_SETMASK, &oldmask, nullptr);
+	if (err) {
+		errno = err;
+		goto fail;
+	}
+
+	/* Start a new session, whose timestamp is absolute. */
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint8_t payload[VARINT_MAX];
+	last_time = 0;
+	recorder_log(RECORD_SESSION, 0, payload, varint_put(payload, (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec));
+	return true;
+
+fail:
+	err = errno;
+	close(file_fd);
+	file_fd = -1;
+	errno = err;
+	return false;
+}
+
+
+
+void recorder_log(enum record_type type, uid_t uid, const void *payload, size_t length) {
+	if (file_fd < 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	/* Build the record header. */
+	uint64_t now = monotime_now();
+	uint8_t header[1 + 2 * VARINT_MAX];
+	size_t header_length = 0;
+	header[header_length++] = (uint8_t) type;
+	header_length += varint_put(header + header_length, now - last_time);
+	header_length += varint_put(header + header_length, uid);
+	uint8_t frame[VARINT_MAX];
+	size_t frame_length = varint_put(frame, header_length + length);
+
+	/* Append it, unless the writer has fallen too far behind. */
+	if (!reserve(&pending, frame_length + header_length + length)) {
+		dropped++;
+	} else {
+		memcpy(pending.data + pending.length, frame, frame_length);
+		memcpy(pending.data + pending.length + frame_length, header, header_length);
+		memcpy(pending.data + pending.length + frame_length + header_length, payload, length);
+		pending.length += frame_length + header_length + length;
+		last_time = now;
+		logged++;
+		pending_records++;
+		if (pending.length >= WAKE_THRESHOLD)
+			pthread_cond_signal(&wake);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+
+
+void recorder_flush(void) {
+	if (file_fd < 0)
+		return;
+	pthread_mutex_lock(&lock);
+	unsigned long target = ++flushes_requested;
+	pthread_cond_signal(&wake);
+	while (flushes_done < target)
+		pthread_cond_wait(&written, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+
+
+bool recorder_get_stats(unsigned long *logged_ret, unsigned long *dropped_ret) {
+	if (file_fd < 0)
+		return false;
+	pthread_mutex_lock(&lock);
+	*logged_ret = logged;
+	*dropped_ret = dropped;
+	pthread_mutex_unlock(&lock);
+	return true;
+}
@@ -0,0 +1,21 @@
+#if !defined RECORDER_H
+#define RECORDER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "../shared/recording.h"
+
+/* Starts recording to a file, appending if it already exists, with writes done on a background thread. Returns true on success, false on failure. */
+bool recorder_open(const char *path);
+
+/* Adds a record. Returns immediately; the record is written later. Does nothing if no recording is open. */
+void recorder_log(enum record_type type, uid_t uid, const void *payload, size_t length);
+
+/* Waits until everything logged so far has been written, e.g. before exiting. */
+void recorder_flush(void);
+
+/* Gets the number of records logged and the number dropped because the disk could not keep up. Returns false if no recording is open. */
+bool recorder_get_stats(unsigned long *logged, unsigned long *dropped);
+
+#endif
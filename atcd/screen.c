@@ -0,0 +1,532 @@
+#include "screen.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "atcproc.h"
+
+
+
+/* The largest screen emulated; a bigger terminal is treated as this size. */
+#define ROWS_MAX 100
+#define COLS_MAX 256
+
+/* The most numeric parameters kept for one control sequence. */
+#define PARAMS_MAX 16
+
+/* The pseudo-terminal, or -1 if there is none. */
+static int master_fd = -1, slave_fd = -1;
+
+/* A non-blocking FD for atcd's own terminal, which what ATC draws is copied to, or -1 if atcd has none; and whether it has missed some of the drawing since it was last repainted. */
+static int mirror_fd = -1;
+static bool mirror_behind = false;
+
+/* The terminal modes last copied from the pseudo-terminal to atcd's own terminal, and those atcd's terminal had to begin with. */
+static struct termios mirrored, original;
+static bool have_mirrored = false, have_original = false;
+
+/* The emulated screen. */
+static char cells[ROWS_MAX][COLS_MAX];
+static unsigned int rows = 24, cols = 80;
+
+/* The cursor, whether the next character wraps to a new line first, and the position saved by DECSC. */
+static unsigned int cursor_row = 0, cursor_col = 0, saved_row = 0, saved_col = 0;
+static bool wrap_pending = false;
+
+/* The scrolling region, first and last rows inclusive. */
+static unsigned int scroll_top = 0, scroll_bottom = 23;
+
+/* The last character drawn, for REP. */
+static char last_char = ' ';
+
+/* Where the parser is: in plain text, after ESC, after ESC and an intermediate byte, in a control sequence, or in a string (OSC, DCS and the like) that runs to BEL or ST. */
+static enum { GROUND, ESCAPE, ESCAPE_INTERMEDIATE, CSI, STRING, STRING_ESCAPE } state = GROUND;
+
+/* The current control sequence's parameters and whether it is a private one (with a ?, > or = prefix). */
+static unsigned int params[PARAMS_MAX];
+static unsigned int param_count = 0;
+static bool csi_private = false;
+
+/* Whether anything on the screen has changed since the last screen_read(). */
+static bool changed = false;
+
+
+
+/* Puts atcd's terminal back the way it was. */
+static void restore_terminal(void) {
+	if (have_original)
+		tcsetattr(STDOUT_FILENO, TCSADRAIN, &original);
+}
+
+
+
+/* Sizes the emulated screen and blanks it. */
+static void resize(unsigned int new_rows, unsigned int new_cols) {
+	rows = new_rows < 1 ? 1 : new_rows > ROWS_MAX ? ROWS_MAX : new_rows;
+	cols = new_cols < 1 ? 1 : new_cols > COLS_MAX ? COLS_MAX : new_cols;
+	scroll_top = 0;
+	scroll_bottom = rows - 1;
+	screen_clear();
+}
+
+
+
+bool screen_open(void) {
+	struct winsize size;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0 || !size.ws_row || !size.ws_col)
+		size = (struct winsize) {.ws_row = 24, .ws_col = 80};
+	int master, slave;
+	if (openpty(&master, &slave, nullptr, nullptr, &size) < 0)
+		return false;
+	if (!screen_adopt(master, slave)) {
+		close(master);
+		close(slave);
+		return false;
+	}
+	return true;
+}
+
+
+
+bool screen_adopt(int master, int slave) {
+	struct winsize size;
+	if (ioctl(master, TIOCGWINSZ, &size) < 0)
+		return false;
+	fcntl(master, F_SETFD, FD_CLOEXEC);
+	fcntl(slave, F_SETFD, FD_CLOEXEC);
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+	master_fd = master;
+	slave_fd = slave;
+	resize(size.ws_row, size.ws_col);
+	atcproc_set_terminal(slave);
+
+	/* ATC sets the modes it wants on its terminal, which is now the pseudo-terminal; atcd copies them to its own, and puts its own back on exit. */
+	if (isatty(STDOUT_FILENO) && tcgetattr(STDOUT_FILENO, &original) == 0 && !have_original) {
+		have_original = true;
+		atexit(&restore_terminal);
+	}
+
+	/* Open atcd's terminal again, rather than making standard output itself non-blocking, which would affect everything else sharing it. */
+	const char *tty = isatty(STDOUT_FILENO) ? ttyname(STDOUT_FILENO) : nullptr;
+	if (tty && mirror_fd < 0)
+		mirror_fd = open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	return true;
+}
+
+
+
+bool screen_get_fds(int *master, int *slave) {
+	*master = master_fd;
+	*slave = slave_fd;
+	return master_fd >= 0;
+}
+
+
+
+int screen_get_fd(void) {
+	return master_fd;
+}
+
+
+
+void screen_get_size(unsigned int *rows_out, unsigned int *cols_out) {
+	*rows_out = rows;
+	*cols_out = cols;
+}
+
+
+
+const char *screen_row(unsigned int row) {
+	return cells[row];
+}
+
+
+
+void screen_clear(void) {
+	memset(cells, ' ', sizeof(cells));
+	cursor_row = cursor_col = saved_row = saved_col = 0;
+	wrap_pending = false;
+	state = GROUND;
+	changed = true;
+}
+
+
+
+/* Blanks part of a row, from one column up to but not including another. */
+static void erase(unsigned int row, unsigned int from, unsigned int to) {
+	if (to > cols)
+		to = cols;
+	if (from < to) {
+		memset(cells[row] + from, ' ', to - from);
+		changed = true;
+	}
+}
+
+
+
+/* Moves the rows of the scrolling region up (count > 0) or down, blanking the rows uncovered; first is where the moving part begins. */
+static void scroll_region(unsigned int first, int count) {
+	if (first < scroll_top || first > scroll_bottom)
+		return;
+	unsigned int height = scroll_bottom - first + 1;
+	unsigned int n = (unsigned int) abs(count);
+	if (n > height)
+		n = height;
+	if (count > 0) {
+		memmove(cells[first], cells[first + n], (size_t) (height - n) * COLS_MAX);
+		for (unsigned int row = scroll_bottom - n + 1; row <= scroll_bottom; row++)
+			erase(row, 0, cols);
+	} else {
+		memmove(cells[first + n], cells[first], (size_t) (height - n) * COLS_MAX);
+		for (unsigned int row = first; row < first + n; row++)
+			erase(row, 0, cols);
+	}
+	changed = true;
+}
+
+
+
+/* Moves the cursor down a line, scrolling at the bottom of the scrolling region. */
+static void line_feed(void) {
+	wrap_pending = false;
+	if (cursor_row == scroll_bottom)
+		scroll_region(scroll_top, 1);
+	else if (cursor_row + 1 < rows)
+		cursor_row++;
+}
+
+
+
+/* Draws a character at the cursor and moves the cursor on. */
+static void put_char(char ch) {
+	if (wrap_pending) {
+		cursor_col = 0;
+		line_feed();
+	}
+	if (cells[cursor_row][cursor_col] != ch) {
+		cells[cursor_row][cursor_col] = ch;
+		changed = true;
+	}
+	last_char = ch;
+	if (cursor_col + 1 < cols)
+		cursor_col++;
+	else
+		wrap_pending = true;
+}
+
+
+
+/* Gets a control sequence parameter, or a default if it is missing or zero. */
+static unsigned int param(unsigned int index, unsigned int def) {
+	return index < param_count && params[index] ? params[index] : def;
+}
+
+/* Moves the cursor, keeping it on the screen. */
+static void move_to(long row, long col) {
+	cursor_row = row < 0 ? 0 : row >= rows ? rows - 1 : (unsigned int) row;
+	cursor_col = col < 0 ? 0 : col >= cols ? cols - 1 : (unsigned int) col;
+	wrap_pending = false;
+}
+
+
+
+/* Carries out a control sequence ending in a final byte. */
+static void run_csi(char final) {
+	if (csi_private)
+		return;
+	unsigned int n = param(0, 1);
+	switch (final) {
+		case 'A':
+			move_to((long) cursor_row - n, cursor_col);
+			break;
+
+		case 'B':
+		case 'e':
+			move_to((long) cursor_row + n, cursor_col);
+			break;
+
+		case 'C':
+		case 'a':
+			move_to(cursor_row, (long) cursor_col + n);
+			break;
+
+		case 'D':
+			move_to(cursor_row, (long) cursor_col - n);
+			break;
+
+		case 'E':
+		case 'F':
+			move_to(final == 'E' ? (long) cursor_row + n : (long) cursor_row - n, 0);
+			break;
+
+		case 'G':
+		case '`':
+			move_to(cursor_row, (long) n - 1);
+			break;
+
+		case 'd':
+			move_to((long) n - 1, cursor_col);
+			break;
+
+		case 'H':
+		case 'f':
+			move_to((long) param(0, 1) - 1, (long) param(1, 1) - 1);
+			break;
+
+		case 'J':
+			if (param(0, 0) == 0) {
+				erase(cursor_row, cursor_col, cols);
+				for (unsigned int row = cursor_row + 1; row < rows; row++)
+					erase(row, 0, cols);
+			} else if (param(0, 0) == 1) {
+				for (unsigned int row = 0; row < cursor_row; row++)
+					erase(row, 0, cols);
+				erase(cursor_row, 0, cursor_col + 1);
+			} else {
+				for (unsigned int row = 0; row < rows; row++)
+					erase(row, 0, cols);
+			}
+			break;
+
+		case 'K':
+			if (param(0, 0) == 0)
+				erase(cursor_row, cursor_col, cols);
+			else if (param(0, 0) == 1)
+				erase(cursor_row, 0, cursor_col + 1);
+			else
+				erase(cursor_row, 0, cols);
+			break;
+
+		case 'X':
+			erase(cursor_row, cursor_col, cursor_col + n);
+			break;
+
+		case 'P':
+		case '@': {
+			/* Delete or insert characters, shifting the rest of the line. */
+			char *line = cells[cursor_row];
+			if (n > cols - cursor_col)
+				n = cols - cursor_col;
+			if (final == 'P') {
+				memmove(line + cursor_col, line + cursor_col + n, cols - cursor_col - n);
+				erase(cursor_row, cols - n, cols);
+			} else {
+				memmove(line + cursor_col + n, line + cursor_col, cols - cursor_col - n);
+				erase(cursor_row, cursor_col, cursor_col + n);
+			}
+			changed = true;
+			break;
+		}
+
+		case 'L':
+		case 'M':
+			scroll_region(cursor_row, final == 'M' ? (int) n : -(int) n);
+			break;
+
+		case 'S':
+		case 'T':
+			scroll_region(scroll_top, final == 'S' ? (int) n : -(int) n);
+			break;
+
+		case 'b':
+			while (n--)
+				put_char(last_char);
+			break;
+
+		case 'r': {
+			unsigned int top = param(0, 1) - 1, bottom = param(1, rows) - 1;
+			if (top < bottom && bottom < rows) {
+				scroll_top = top;
+				scroll_bottom = bottom;
+				move_to(0, 0);
+			}
+			break;
+		}
+
+		case 's':
+			saved_row = cursor_row;
+			saved_col = cursor_col;
+			break;
+
+		case 'u':
+			move_to(saved_row, saved_col);
+			break;
+
+		default:
+			/* Attributes, modes and reports do not change the characters on the screen. */
+			break;
+	}
+}
+
+
+
+/* Feeds one byte of terminal output to the emulated screen. */
+static void feed(unsigned char ch) {
+	switch (state) {
+		case GROUND:
+			if (ch == 0x1b) {
+				state = ESCAPE;
+			} else if (ch == '\r') {
+				move_to(cursor_row, 0);
+			} else if (ch == '\n' || ch == '\v' || ch == '\f') {
+				line_feed();
+			} else if (ch == '\b') {
+				move_to(cursor_row, cursor_col ? (long) cursor_col - 1 : 0);
+			} else if (ch == '\t') {
+				move_to(cursor_row, (cursor_col / 8 + 1) * 8);
+			} else if (ch >= 0x20 && ch < 0x7f) {
+				put_char((char) ch);
+			} else if (ch >= 0xc0) {
+				/* Show anything beyond ASCII as one unknown character; continuation bytes take no room. */
+				put_char('?');
+			}
+			break;
+
+		case ESCAPE:
+			state = GROUND;
+			if (ch == '[') {
+				state = CSI;
+				param_count = 0;
+				csi_private = false;
+			} else if (ch == ']' || ch == 'P' || ch == '^' || ch == '_' || ch == 'X') {
+				state = STRING;
+			} else if (ch >= 0x20 && ch <= 0x2f) {
+				state = ESCAPE_INTERMEDIATE;
+			} else if (ch == '7') {
+				saved_row = cursor_row;
+				saved_col = cursor_col;
+			} else if (ch == '8') {
+				move_to(saved_row, saved_col);
+			} else if (ch == 'D') {
+				line_feed();
+			} else if (ch == 'E') {
+				move_to(cursor_row, 0);
+				line_feed();
+			} else if (ch == 'M') {
+				wrap_pending = false;
+				if (cursor_row == scroll_top)
+					scroll_region(scroll_top, -1);
+				else if (cursor_row)
+					cursor_row--;
+			} else if (ch == 'c') {
+				resize(rows, cols);
+			}
+			break;
+
+		case ESCAPE_INTERMEDIATE:
+			/* Character set selection and the like; nothing drawn. */
+			if (ch >= 0x30)
+				state = GROUND;
+			break;
+
+		case CSI:
+			if (ch >= '0' && ch <= '9') {
+				if (!param_count)
+					params[param_count++] = 0;
+				if (param_count <= PARAMS_MAX && params[param_count - 1] < 100000)
+					params[param_count - 1] = params[param_count - 1] * 10 + (ch - '0');
+			} else if (ch == ';') {
+				if (!param_count)
+					params[param_count++] = 0;
+				if (param_count < PARAMS_MAX)
+					params[param_count++] = 0;
+			} else if (ch == '?' || ch == '>' || ch == '=' || ch == '<') {
+				csi_private = true;
+			} else if (ch >= 0x40 && ch <= 0x7e) {
+				run_csi((char) ch);
+				state = GROUND;
+			} else if (ch < 0x20 || ch > 0x7e) {
+				state = ch == 0x1b ? ESCAPE : GROUND;
+			}
+			break;
+
+		case STRING:
+			if (ch == 0x07)
+				state = GROUND;
+			else if (ch == 0x1b)
+				state = STRING_ESCAPE;
+			break;
+
+		case STRING_ESCAPE:
+			state = ch == '\\' ? GROUND : STRING;
+			break;
+	}
+}
+
+
+
+/* Copies the terminal modes ATC has set on the pseudo-terminal to atcd's own terminal, if they have changed. */
+static void mirror_modes(void) {
+	struct termios modes;
+	if (!have_original || tcgetattr(master_fd, &modes) < 0)
+		return;
+	if (have_mirrored && memcmp(&modes, &mirrored, sizeof(modes)) == 0)
+		return;
+	mirrored = modes;
+	have_mirrored = true;
+	tcsetattr(STDOUT_FILENO, TCSADRAIN, &modes);
+}
+
+
+
+/* Writes to atcd's terminal as much as it will take without blocking. Returns true if it took everything, false if not. */
+static bool mirror_write(const char *data, size_t length) {
+	while (length) {
+		ssize_t w = write(mirror_fd, data, length);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		data += w;
+		length -= w;
+	}
+	return true;
+}
+
+/* Redraws atcd's terminal from the emulated screen, after it has missed some of what ATC drew. Returns true on success, false if it still cannot keep up. */
+static bool mirror_repaint(void) {
+	static char buffer[ROWS_MAX * (COLS_MAX + 16) + 32];
+	size_t length = (size_t) sprintf(buffer, "\x1b[H\x1b[2J");
+	for (unsigned int row = 0; row < rows; row++) {
+		length += (size_t) sprintf(buffer + length, "\x1b[%u;1H", row + 1);
+		memcpy(buffer + length, cells[row], cols);
+		length += cols;
+	}
+	length += (size_t) sprintf(buffer + length, "\x1b[%u;%uH", cursor_row + 1, cursor_col + 1);
+	return mirror_write(buffer, length);
+}
+
+
+
+bool screen_read(void) {
+	changed = false;
+	bool got = false;
+	for (;;) {
+		char buffer[4096];
+		ssize_t ret = read(master_fd, buffer, sizeof(buffer));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		got = true;
+
+		for (ssize_t i = 0; i < ret; i++)
+			feed((unsigned char) buffer[i]);
+
+		/* Show it as ATC would have, on atcd's own terminal, but never wait for a display that cannot keep up; once it has missed something, it is repainted whole when it can take it. */
+		if (mirror_fd >= 0) {
+			if (mirror_behind)
+				mirror_behind = !mirror_repaint();
+			else
+				mirror_behind = !mirror_write(buffer, ret);
+		}
+	}
+	if (got)
+		mirror_modes();
+	return changed;
+}
@@ -0,0 +1,30 @@
+#if !defined SCREEN_H
+#define SCREEN_H
+
+#include <stdbool.h>
+
+/* Creates the pseudo-terminal ATC is run on, sized like atcd's own, so that atcd sees what ATC draws. Returns true on success, false on failure. */
+bool screen_open(void);
+
+/* Takes over a pseudo-terminal inherited across exec. Returns true on success, false on failure. */
+bool screen_adopt(int master, int slave);
+
+/* Gets the pseudo-terminal's master and slave FDs, for handing over across exec. Returns false if there is none. */
+bool screen_get_fds(int *master, int *slave);
+
+/* Gets the master FD, for waiting on readability, or -1 if there is none. */
+int screen_get_fd(void);
+
+/* Reads what ATC has drawn, applying it to the emulated screen and copying it to atcd's terminal, if it has one and it can keep up. Returns true if the screen changed. */
+bool screen_read(void);
+
+/* Gets the size of the emulated screen. */
+void screen_get_size(unsigned int *rows, unsigned int *cols);
+
+/* Gets the characters in one row of the emulated screen, cols long and not NUL-terminated. */
+const char *screen_row(unsigned int row);
+
+/* Blanks the emulated screen, e.g. because a new game is starting. */
+void screen_clear(void);
+
+#endif
@@ -0,0 +1,139 @@
+#include "timerwheel.h"
+#include <stddef.h>
+
+
+
+/* The width of a slot, in nanoseconds. */
+#define TICK 100000000u
+
+/* The number of slots, one per bit of the occupancy mask; timers further away than one revolution wait in their slot for later laps. */
+#define SLOTS 64
+
+/* Each thread has its own wheel. */
+static _Thread_local struct timer *slots[SLOTS];
+
+/* A bit for each slot that may hold timers; a bit is only cleared once its slot is seen to be empty. */
+static _Thread_local uint64_t occupied = 0;
+
+/* The number of armed timers. */
+static _Thread_local unsigned long armed = 0;
+
+/* The last tick whose slot has been processed, or UINT64_MAX before the first advance. */
+static _Thread_local uint64_t current_tick = UINT64_MAX;
+
+
+
+void timer_init(struct timer *timer, void (*callback)(struct timer *timer)) {
+	timer->next = nullptr;
+	timer->prevptr = nullptr;
+	timer->expiry = 0;
+	timer->callback = callback;
+}
+
+
+
+void timerwheel_add(struct timer *timer, uint64_t expiry) {
+	timerwheel_remove(timer);
+
+	/* Push onto the front of the slot's list; a timer already overdue goes in the current slot, which the next advance visits again. */
+	uint64_t tick = expiry / TICK;
+	if (current_tick != UINT64_MAX && tick < current_tick)
+		tick = current_tick;
+	struct timer **slot = &slots[tick % SLOTS];
+	occupied |= UINT64_C(1) << (tick % SLOTS);
+	timer->expiry = expiry;
+	timer->next = *slot;
+	timer->prevptr = slot;
+	*slot = timer;
+	if (timer->next)
+		timer->next->prevptr = &timer->next;
+	armed++;
+}
+
+
+
+void timerwheel_remove(struct timer *timer) {
+	if (!timer->prevptr)
+		return;
+	if (timer->next)
+		timer->next->prevptr = timer->prevptr;
+	*(timer->prevptr) = timer->next;
+	timer->next = nullptr;
+	timer->prevptr = nullptr;
+	armed--;
+}
+
+
+
+bool timerwheel_next(uint64_t *when) {
+	if (!armed)
+		return false;
+
+	/* Before the first advance there is no current tick to start from, so look at every timer. */
+	uint64_t earliest = UINT64_MAX;
+	if (current_tick == UINT64_MAX) {
+		for (unsigned int i = 0; i < SLOTS; i++)
+			for (const struct timer *timer = slots[i]; timer; timer = timer->next)
+				if (timer->expiry < earliest)
+					earliest = timer->expiry;
+		*when = earliest;
+		return true;
+	}
+
+	/*
+	 * Visit the occupied slots in order from the current tick. The first
+	 * with a timer due within its own lap holds the earliest, since every
+	 * later slot's timers are due after it; timers in the slots before it
+	 * are all a lap or more away. Usually only that one slot is looked at.
+	 */
+	unsigned int start = current_tick % SLOTS;
+	uint64_t pending = start ? (occupied >> start) | (occupied << (SLOTS - start)) : occupied;
+	while (pending) {
+		unsigned int offset = __builtin_ctzll(pending);
+		pending &= pending - 1;
+		uint64_t tick = current_tick + offset;
+		struct timer *slot = slots[tick % SLOTS];
+		if (!slot) {
+			occupied &= ~(UINT64_C(1) << (tick % SLOTS));
+			continue;
+		}
+		bool due = false;
+		for (const struct timer *timer = slot; timer; timer = timer->next) {
+			if (timer->expiry < earliest)
+				earliest = timer->expiry;
+			if (timer->expiry / TICK <= tick)
+				due = true;
+		}
+		if (due)
+			break;
+	}
+	*when = earliest;
+	return true;
+}
+
+
+
+void timerwheel_advance(uint64_t now) {
+	uint64_t now_tick = now / TICK;
+
+	/* Start from the current tick the first time through, or skip whole revolutions after a long sleep. */
+	if (current_tick == UINT64_MAX || now_tick - current_tick > SLOTS)
+		current_tick = now_tick - (current_tick == UINT64_MAX ? 1 : SLOTS);
+
+	/* Visit every slot we have passed, including the current one again since it may gain timers mid-tick. */
+	for (uint64_t tick = current_tick; tick <= now_tick; tick++) {
+		struct timer **link = &slots[tick % SLOTS];
+		while (*link) {
+			struct timer *timer = *link;
+			if (timer->expiry <= now) {
+				timerwheel_remove(timer);
+				timer->callback(timer);
+				/* The callback may have changed the list arbitrarily, so rescan the slot. */
+				link = &slots[tick % SLOTS];
+			} else {
+				link = &timer->next;
+			}
+		}
+	}
+	current_tick = now_tick;
+}
@@ -0,0 +1,35 @@
+#if !defined TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A timer, embedded in whatever structure it belongs to. Every thread has its own wheel, and a timer must only be used by one thread. */
+struct timer;
+struct timer {
+	struct timer *next;
+	struct timer **prevptr;
+
+	/* When the timer expires. */
+	uint64_t expiry;
+
+	/* The function to invoke on expiry; the timer has already been removed, so it may be freed or re-added. */
+	void (*callback)(struct timer *timer);
+};
+
+/* Initializes a timer so that it is not armed. */
+void timer_init(struct timer *timer, void (*callback)(struct timer *timer));
+
+/* Arms a timer to expire at a given time, first disarming it if already armed. */
+void timerwheel_add(struct timer *timer, uint64_t expiry);
+
+/* Disarms a timer. Does nothing if it is not armed. */
+void timerwheel_remove(struct timer *timer);
+
+/* Gets a time no later than when the next armed timer expires. Returns false if no timers are armed. */
+bool timerwheel_next(uint64_t *when);
+
+/* Invokes the callbacks of all timers that have expired by a given time. */
+void timerwheel_advance(uint64_t now);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * The time shim, preloaded into atc by atcd --time-shim. It makes atc's
+ * clocks and interval timer follow the virtual clock in shared/vclock.h, so
+ * that atcd can run the game faster than real time or step it by hand. With
+ * no clock passed in, everything goes straight to the kernel.
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include "../shared/vclock.h"
+
+
+
+/* The clock, or nullptr if atc is running in real time. */
+static struct vclock *vclock = nullptr;
+
+
+
+/* Maps the clock passed in by atcd, and keeps it and the shim from being passed on to anything atc runs. */
+__attribute__((constructor)) static void attach(void) {
+	const char *fd_text = getenv(VCLOCK_ENV);
+	if (!fd_text)
+		return;
+	int fd = atoi(fd_text);
+	void *page = mmap(nullptr, sizeof(struct vclock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page != MAP_FAILED)
+		vclock = page;
+	unsetenv(VCLOCK_ENV);
+	unsetenv("LD_PRELOAD");
+}
+
+
+
+/* Reads a clock from the kernel. */
+static uint64_t real_clock(clockid_t id) {
+	struct timespec ts;
+	syscall(SYS_clock_gettime, id, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+
+
+/* Reads the game's CLOCK_MONOTONIC. */
+static uint64_t virtual_now(void) {
+	return vclock_read(vclock, real_clock(CLOCK_MONOTONIC));
+}
+
+
+
+int clock_gettime(clockid_t id, struct timespec *ts) {
+	uint64_t now;
+	switch (vclock ? id : -1) {
+		case CLOCK_MONOTONIC:
+		case CLOCK_MONOTONIC_RAW:
+		case CLOCK_MONOTONIC_COARSE:
+		case CLOCK_BOOTTIME:
+			now = virtual_now();
+			break;
+
+		case CLOCK_REALTIME:
+		case CLOCK_REALTIME_COARSE:
+			now = virtual_now() + atomic_load_explicit(&vclock->realtime_offset, memory_order_relaxed);
+			break;
+
+		default:
+			return (int) syscall(SYS_clock_gettime, id, ts);
+	}
+	ts->tv_sec = (time_t) (now / 1000000000u);
+	ts->tv_nsec = (long) (now % 1000000000u);
+	return 0;
+}
+
+
+
+int gettimeofday(struct timeval *restrict tv, void *restrict tz __attribute__((unused))) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+	return 0;
+}
+
+
+
+time_t time(time_t *result) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (result)
+		*result = ts.tv_sec;
+	return ts.tv_sec;
+}
+
+
+
+static uint64_t timeval_to_ns(const struct timeval *tv) {
+	return (uint64_t) tv->tv_sec * 1000000000u + (uint64_t) tv->tv_usec * 1000u;
+}
+
+static struct timeval ns_to_timeval(uint64_t ns) {
+	/* Round up, so that a timer about to expire does not read as disarmed. */
+	ns = (ns + 999u) / 1000u;
+	return (struct timeval) {.tv_sec = (time_t) (ns / 1000000u), .tv_usec = (suseconds_t) (ns % 1000000u)};
+}
+
+
+
+int getitimer(__itimer_which_t which, struct itimerval *current) {
+	if (!vclock || which != ITIMER_REAL)
+		return (int) syscall(SYS_getitimer, which, current);
+	uint64_t due = atomic_load_explicit(&vclock->timer_due, memory_order_relaxed);
+	uint64_t now = virtual_now();
+	current->it_interval = ns_to_timeval(atomic_load_explicit(&vclock->timer_interval, memory_order_relaxed));
+	current->it_value = ns_to_timeval(due ? (due > now ? due - now : 1) : 0);
+	return 0;
+}
+
+
+
+int setitimer(__itimer_which_t which, const struct itimerval *restrict value, struct itimerval *restrict old) {
+	if (!vclock || which != ITIMER_REAL)
+		return (int) syscall(SYS_setitimer, which, value, old);
+	if (value->it_value.tv_usec < 0 || value->it_value.tv_usec >= 1000000 || value->it_interval.tv_usec < 0 || value->it_interval.tv_usec >= 1000000) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (old)
+		getitimer(ITIMER_REAL, old);
+
+	/* Disarm the timer while changing it, so atcd never sees a new expiry with an old interval. */
+	uint64_t delay = timeval_to_ns(&value->it_value);
+	atomic_store_explicit(&vclock->timer_due, 0, memory_order_release);
+	atomic_store_explicit(&vclock->timer_interval, timeval_to_ns(&value->it_interval), memory_order_release);
+	if (delay) {
+		atomic_store_explicit(&vclock->timer_due, virtual_now() + delay, memory_order_release);
+		kill(getppid(), VCLOCK_WAKE_SIGNAL);
+	}
+	return 0;
+}
+
+
+
+unsigned int alarm(unsigned int seconds) {
+	struct itimerval value = {.it_value = {.tv_sec = seconds}}, old;
+	if (setitimer(ITIMER_REAL, &value, &old) < 0)
+		return 0;
+	return (unsigned int) old.it_value.tv_sec + (old.it_value.tv_usec ? 1 : 0);
+}
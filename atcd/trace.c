@@ -0,0 +1,176 @@
+#include "trace.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+
+/* The number of spans each thread's ring holds; older ones are overwritten. */
+#define RING_SPANS 16384
+
+/* The most commands waiting for their echo at once; older ones are forgotten. */
+#define ECHO_MAX 64
+
+struct span {
+	uint64_t id;
+	uint64_t start, end;
+	enum trace_stage stage;
+};
+
+/* One thread's spans, written only by that thread. */
+struct ring {
+	struct ring *next;
+	pid_t tid;
+
+	/* The number of spans ever written; the writer publishes each span by bumping this. */
+	_Atomic uint64_t written;
+
+	struct span spans[RING_SPANS];
+};
+
+static const char * const STAGE_NAMES[TRACE_STAGES] = {
+	[TRACE_CLIENT] = "client",
+	[TRACE_SOCKET] = "socket",
+	[TRACE_INBOX] = "inbox",
+	[TRACE_VALIDATE] = "validate",
+	[TRACE_QUEUE] = "queue",
+	[TRACE_WRITE] = "write",
+	[TRACE_ECHO] = "echo",
+};
+
+/* Where the trace is written, and whether tracing is on. */
+static char *trace_path = nullptr;
+static atomic_bool enabled = false;
+
+/* Every thread's ring, pushed onto the front as threads record their first span, and the calling thread's own. */
+static _Atomic(struct ring *) rings = nullptr;
+static _Thread_local struct ring *own_ring = nullptr;
+
+/* Commands written to ATC and waiting for the screen to change. */
+static struct {
+	uint64_t id, written;
+} awaiting[ECHO_MAX];
+static size_t awaiting_count = 0;
+
+
+
+bool trace_open(const char *path) {
+	char *copy = strdup(path);
+	if (!copy)
+		return false;
+	free(trace_path);
+	trace_path = copy;
+	atomic_store(&enabled, true);
+	return true;
+}
+
+
+
+bool trace_is_enabled(void) {
+	return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+
+
+uint64_t trace_parse(const char *packet, size_t length, uint64_t *keystroke) {
+	/* The tag follows the text after a NUL, and the packet is NUL-terminated after it. */
+	size_t text_length = strlen(packet);
+	if (text_length + 1 >= length)
+		return 0;
+	uint64_t id;
+	if (sscanf(packet + text_length + 1, "trace %" SCNx64 " %" SCNu64, &id, keystroke) != 2)
+		return 0;
+	return id;
+}
+
+
+
+void trace_span(uint64_t id, enum trace_stage stage, uint64_t start, uint64_t end) {
+	if (!trace_is_enabled() || !id)
+		return;
+
+	/* Give the thread a ring of its own the first time it records anything. */
+	struct ring *ring = own_ring;
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring));
+		if (!ring)
+			return;
+		ring->tid = gettid();
+		ring->next = atomic_load(&rings);
+		while (!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+		own_ring = ring;
+	}
+
+	uint64_t written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+	ring->spans[written % RING_SPANS] = (struct span) {.id = id, .start = start, .end = end > start ? end : start, .stage = stage};
+	atomic_store_explicit(&ring->written, written + 1, memory_order_release);
+}
+
+
+
+void trace_await_echo(uint64_t id, uint64_t written) {
+	if (!trace_is_enabled() || !id)
+		return;
+	if (awaiting_count == ECHO_MAX) {
+		memmove(&awaiting[0], &awaiting[1], sizeof(awaiting[0]) * (ECHO_MAX - 1));
+		awaiting_count--;
+	}
+	awaiting[awaiting_count].id = id;
+	awaiting[awaiting_count].written = written;
+	awaiting_count++;
+}
+
+
+
+void trace_echo(uint64_t now) {
+	for (size_t i = 0; i < awaiting_count; i++)
+		trace_span(awaiting[i].id, TRACE_ECHO, awaiting[i].written, now);
+	awaiting_count = 0;
+}
+
+
+
+/* Writes one trace event; times are given to Chrome in microseconds, kept exact to the nanosecond. */
+static void write_event(FILE *fp, const struct span *span, char phase, uint64_t time, pid_t pid, pid_t tid) {
+	fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"command\",\"ph\":\"%c\",\"id\":\"0x%" PRIx64 "\",\"pid\":%ld,\"tid\":%ld,\"ts\":%" PRIu64 ".%03u}",
+			STAGE_NAMES[span->stage], phase, span->id, (long) pid, (long) tid, time / 1000u, (unsigned int) (time % 1000u));
+}
+
+
+
+bool trace_dump(size_t *count) {
+	*count = 0;
+	if (!trace_path) {
+		errno = EINVAL;
+		return false;
+	}
+	FILE *fp = fopen(trace_path, "w");
+	if (!fp)
+		return false;
+
+	/* Each span is an async begin and end pair with the command's trace ID, so that each command gets a track of its own. */
+	pid_t pid = getpid();
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"args\":{\"name\":\"atcd\"}}", (long) pid);
+	for (struct ring *ring = atomic_load(&rings); ring; ring = ring->next) {
+		/* A ring's thread may overwrite the oldest spans while this reads them; a trace is a diagnostic, so that is tolerated. */
+		uint64_t written = atomic_load_explicit(&ring->written, memory_order_acquire);
+		for (uint64_t i = written > RING_SPANS ? written - RING_SPANS : 0; i < written; i++) {
+			const struct span *span = &ring->spans[i % RING_SPANS];
+			write_event(fp, span, 'b', span->start, pid, ring->tid);
+			write_event(fp, span, 'e', span->end, pid, ring->tid);
+			++*count;
+		}
+	}
+	fputs("\n]}\n", fp);
+	if (ferror(fp)) {
+		int saved_errno = errno;
+		fclose(fp);
+		errno = saved_errno;
+		return false;
+	}
+	return fclose(fp) == 0;
+}
@@ -0,0 +1,67 @@
+#if !defined TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Tracing of commands on their way from a player's keyboard to the game.
+ *
+ * A client tags a command with a trace ID and the time the key was pressed
+ * by following it, after a NUL, with "trace <id in hex> <nanoseconds>" (on
+ * the monotonic clock, which the client shares with atcd on the same host).
+ * For each tagged command, atcd then records a span for each stage it goes
+ * through. Spans go into a ring per thread, written without locks, and are
+ * written out on request as Chrome trace event JSON, which chrome://tracing
+ * and Perfetto load.
+ */
+
+/* The stages spans are recorded for. */
+enum trace_stage {
+	/* From the key press to the client sending the command. */
+	TRACE_CLIENT,
+
+	/* Waiting in the socket until atcd received it. */
+	TRACE_SOCKET,
+
+	/* Waiting in atcd's per-connection inbox (e.g. for the rate limit) until handled. */
+	TRACE_INBOX,
+
+	/* Checking the command and queueing it. */
+	TRACE_VALIDATE,
+
+	/* Waiting in the command queue until written to ATC. */
+	TRACE_QUEUE,
+
+	/* Writing it to ATC. */
+	TRACE_WRITE,
+
+	/* From the write to ATC next changing its screen (only with --game-state). */
+	TRACE_ECHO,
+
+	TRACE_STAGES,
+};
+
+/* Starts tracing, with the trace to be written to a file. Returns true on success, false on failure. */
+bool trace_open(const char *path);
+
+/* Checks whether tracing is on. */
+bool trace_is_enabled(void);
+
+/* Gets the trace ID a packet is tagged with, storing the time the key was pressed in *keystroke. Returns zero if it is not tagged. */
+uint64_t trace_parse(const char *packet, size_t length, uint64_t *keystroke);
+
+/* Records a span of a traced command, in the calling thread's ring. */
+void trace_span(uint64_t id, enum trace_stage stage, uint64_t start, uint64_t end);
+
+/* Notes that a traced command was written to ATC at a time, to be closed by trace_echo(). */
+void trace_await_echo(uint64_t id, uint64_t written);
+
+/* Notes that ATC's screen changed at a time, closing the echo span of each command written since the last change. */
+void trace_echo(uint64_t now);
+
+/* Writes every span still held to the file given to trace_open(), storing how many there were in *count. Returns true on success, false on failure. */
+bool trace_dump(size_t *count);
+
+#endif
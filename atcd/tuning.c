@@ -0,0 +1,336 @@
+#include "tuning.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/ioprio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+
+
+/* The period over which a cgroup's CPU quota is enforced, in microseconds. */
+#define CPU_PERIOD 100000u
+
+/* Where the cgroup hierarchy is mounted. */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+static const struct {
+	const char *name;
+	int policy;
+} POLICIES[] = {
+	{"other", SCHED_OTHER},
+	{"batch", SCHED_BATCH},
+	{"idle", SCHED_IDLE},
+	{"fifo", SCHED_FIFO},
+	{"rr", SCHED_RR},
+};
+
+static const char * const IO_CLASSES[] = {
+	[IOPRIO_CLASS_RT] = "rt",
+	[IOPRIO_CLASS_BE] = "be",
+	[IOPRIO_CLASS_IDLE] = "idle",
+};
+
+
+
+bool tuning_parse_cpus(struct tuning *tuning, const char *list) {
+	CPU_ZERO(&tuning->cpus);
+	const char *p = list;
+	for (;;) {
+		/* Take a CPU or a range of them. */
+		char *end;
+		if (!isdigit((unsigned char) *p))
+			goto invalid;
+		unsigned long first = strtoul(p, &end, 10), last = first;
+		if (*end == '-') {
+			p = end + 1;
+			if (!isdigit((unsigned char) *p))
+				goto invalid;
+			last = strtoul(p, &end, 10);
+		}
+		if (first > last || last >= CPU_SETSIZE)
+			goto invalid;
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, &tuning->cpus);
+
+		/* Go on to the next, if any. */
+		if (*end == '\0')
+			break;
+		if (*end != ',')
+			goto invalid;
+		p = end + 1;
+	}
+	tuning->has_cpus = true;
+	return true;
+
+invalid:
+	errno = EINVAL;
+	return false;
+}
+
+
+
+/* Parses a whole decimal number within limits. Returns true on success, false on failure. */
+static bool parse_number(const char *string, long min, long max, int *value) {
+	char *end;
+	if (!*string || isspace((unsigned char) *string))
+		return false;
+	long number = strtol(string, &end, 10);
+	if (*end || number < min || number > max)
+		return false;
+	*value = (int) number;
+	return true;
+}
+
+
+
+bool tuning_parse_policy(struct tuning *tuning, const char *spec) {
+	const char *p = spec;
+	for (;;) {
+		/* Copy out one item and split off its argument, if any. */
+		const char *end = strchrnul(p, ',');
+		char item[32];
+		if ((size_t) (end - p) >= sizeof(item))
+			goto invalid;
+		memcpy(item, p, end - p);
+		item[end - p] = '\0';
+		char *arg = strchr(item, ':');
+		if (arg)
+			*arg++ = '\0';
+
+		if (strcmp(item, "nice") == 0) {
+			if (!arg || !parse_number(arg, -20, 19, &tuning->nice))
+				goto invalid;
+			tuning->has_nice = true;
+		} else if (strcmp(item, "io-rt") == 0 || strcmp(item, "io-be") == 0 || strcmp(item, "io-idle") == 0) {
+			int class = item[3] == 'r' ? IOPRIO_CLASS_RT : item[3] == 'b' ? IOPRIO_CLASS_BE : IOPRIO_CLASS_IDLE;
+			int level = 0;
+			if (class == IOPRIO_CLASS_IDLE ? arg != nullptr : !arg || !parse_number(arg, 0, 7, &level))
+				goto invalid;
+			tuning->ioprio = IOPRIO_PRIO_VALUE(class, level);
+			tuning->has_ioprio = true;
+		} else {
+			size_t i = 0;
+			while (i < sizeof(POLICIES) / sizeof(*POLICIES) && strcmp(item, POLICIES[i].name) != 0)
+				i++;
+			if (i == sizeof(POLICIES) / sizeof(*POLICIES))
+				goto invalid;
+			tuning->policy = POLICIES[i].policy;
+			tuning->priority = 0;
+
+			/* Only the real-time policies take a priority, and need one. */
+			if (tuning->policy == SCHED_FIFO || tuning->policy == SCHED_RR) {
+				if (!arg || !parse_number(arg, sched_get_priority_min(tuning->policy), sched_get_priority_max(tuning->policy), &tuning->priority))
+					goto invalid;
+			} else if (arg) {
+				goto invalid;
+			}
+			tuning->has_policy = true;
+		}
+
+		if (!*end)
+			break;
+		p = end + 1;
+	}
+	return true;
+
+invalid:
+	errno = EINVAL;
+	return false;
+}
+
+
+
+bool tuning_apply(const struct tuning *tuning, pid_t pid) {
+	if (tuning->has_cpus && sched_setaffinity(pid, sizeof(tuning->cpus), &tuning->cpus) < 0)
+		return false;
+	if (tuning->has_policy) {
+		struct sched_param param = {.sched_priority = tuning->priority};
+		if (sched_setscheduler(pid, tuning->policy, &param) < 0)
+			return false;
+	}
+	if (tuning->has_nice && setpriority(PRIO_PROCESS, pid, tuning->nice) < 0)
+		return false;
+	if (tuning->has_ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, tuning->ioprio) < 0)
+		return false;
+	return true;
+}
+
+
+
+bool tuning_lock_memory(void) {
+	return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+}
+
+
+
+/* Writes a string to a file that already exists, such as a cgroup's control file. Returns true on success, false on failure. */
+static bool write_file(const char *path, const char *string) {
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	size_t length = strlen(string);
+	bool ok = write(fd, string, length) == (ssize_t) length;
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return ok;
+}
+
+/* Reads a small file into a buffer, NUL-terminated. Returns true on success, false on failure. */
+static bool read_file(const char *path, char *buffer, size_t size) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	ssize_t ret = read(fd, buffer, size - 1);
+	close(fd);
+	if (ret < 0)
+		return false;
+	buffer[ret] = '\0';
+	return true;
+}
+
+
+
+bool tuning_make_cgroup(const char *path, unsigned int quota) {
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		return false;
+
+	char file[PATH_MAX], limit[64];
+	if ((size_t) snprintf(file, sizeof(file), "%s/cpu.max", path) >= sizeof(file)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	if (quota)
+		snprintf(limit, sizeof(limit), "%llu %u", (unsigned long long) quota * CPU_PERIOD / 100u, CPU_PERIOD);
+	else
+		snprintf(limit, sizeof(limit), "max %u", CPU_PERIOD);
+	return write_file(file, limit);
+}
+
+
+
+bool tuning_join_cgroup(const char *path, pid_t pid) {
+	char file[PATH_MAX], id[32];
+	if ((size_t) snprintf(file, sizeof(file), "%s/cgroup.procs", path) >= sizeof(file)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	snprintf(id, sizeof(id), "%ld", (long) (pid ? pid : getpid()));
+	return write_file(file, id);
+}
+
+
+
+/* Appends to a description being built, with a comma before all but the first part, as far as it fits. */
+static void __attribute__((format(printf, 4, 5))) describe(char *buffer, size_t size, size_t *length, const char *format, ...) {
+	if (*length && *length < size)
+		*length += snprintf(buffer + *length, size - *length, ", ");
+	if (*length >= size)
+		return;
+	va_list ap;
+	va_start(ap, format);
+	*length += vsnprintf(buffer + *length, size - *length, format, ap);
+	va_end(ap);
+}
+
+
+
+void tuning_describe(pid_t pid, char *buffer, size_t size) {
+	size_t length = 0;
+	buffer[0] = '\0';
+
+	/* The CPUs it may run on, as ranges. */
+	cpu_set_t cpus;
+	if (sched_getaffinity(pid, sizeof(cpus), &cpus) == 0) {
+		char list[256] = "";
+		size_t list_length = 0;
+		for (int cpu = 0; cpu < CPU_SETSIZE && list_length < sizeof(list); cpu++) {
+			if (!CPU_ISSET(cpu, &cpus))
+				continue;
+			int last = cpu;
+			while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpus))
+				last++;
+			if (last == cpu)
+				list_length += snprintf(list + list_length, sizeof(list) - list_length, "%s%d", list_length ? "," : "", cpu);
+			else
+				list_length += snprintf(list + list_length, sizeof(list) - list_length, "%s%d-%d", list_length ? "," : "", cpu, last);
+			cpu = last;
+		}
+		describe(buffer, size, &length, "cpus %s", list);
+	}
+
+	/* Its policy, priority and nice value. */
+	int policy = sched_getscheduler(pid);
+	struct sched_param param;
+	if (policy >= 0 && sched_getparam(pid, &param) == 0) {
+		policy &= ~SCHED_RESET_ON_FORK;
+		const char *name = "unknown";
+		for (size_t i = 0; i < sizeof(POLICIES) / sizeof(*POLICIES); i++)
+			if (POLICIES[i].policy == policy)
+				name = POLICIES[i].name;
+		if (policy == SCHED_FIFO || policy == SCHED_RR)
+			describe(buffer, size, &length, "%s priority %d", name, param.sched_priority);
+		else
+			describe(buffer, size, &length, "%s", name);
+	}
+	errno = 0;
+	int nice = getpriority(PRIO_PROCESS, pid);
+	if (nice != -1 || !errno)
+		describe(buffer, size, &length, "nice %d", nice);
+
+	/* Its I/O priority; with none set, the kernel goes by the nice value. */
+	long ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, pid);
+	if (ioprio >= 0) {
+		int class = IOPRIO_PRIO_CLASS(ioprio);
+		if (class == IOPRIO_CLASS_NONE)
+			describe(buffer, size, &length, "io by nice");
+		else if (class == IOPRIO_CLASS_IDLE)
+			describe(buffer, size, &length, "io idle");
+		else if (class < (int) (sizeof(IO_CLASSES) / sizeof(*IO_CLASSES)))
+			describe(buffer, size, &length, "io %s %ld", IO_CLASSES[class], (long) IOPRIO_PRIO_DATA(ioprio));
+	}
+
+	/* How much of its memory is locked. */
+	char path[64], contents[4096];
+	if (pid)
+		snprintf(path, sizeof(path), "/proc/%ld/status", (long) pid);
+	else
+		snprintf(path, sizeof(path), "/proc/self/status");
+	const char *locked;
+	if (read_file(path, contents, sizeof(contents)) && (locked = strstr(contents, "\nVmLck:")))
+		describe(buffer, size, &length, "%ld kB locked", strtol(locked + 7, nullptr, 10));
+
+	/* Its cgroup in the unified (v2) hierarchy, and the CPU limit on it. */
+	if (pid)
+		snprintf(path, sizeof(path), "/proc/%ld/cgroup", (long) pid);
+	else
+		snprintf(path, sizeof(path), "/proc/self/cgroup");
+	char cgroup[PATH_MAX];
+	char *unified = nullptr;
+	if (read_file(path, cgroup, sizeof(cgroup))) {
+		if (strncmp(cgroup, "0::", 3) == 0)
+			unified = cgroup;
+		else if ((unified = strstr(cgroup, "\n0::")))
+			unified++;
+	}
+	if (unified) {
+		memmove(cgroup, unified + 3, strlen(unified + 3) + 1);
+		cgroup[strcspn(cgroup, "\n")] = '\0';
+		char file[PATH_MAX + 32];
+		unsigned long long quota, period;
+		snprintf(file, sizeof(file), CGROUP_ROOT "%s/cpu.max", cgroup);
+		if (read_file(file, contents, sizeof(contents)) && sscanf(contents, "%llu %llu", &quota, &period) == 2 && period)
+			describe(buffer, size, &length, "cgroup %s limited to %llu%% of a CPU", cgroup, quota * 100u / period);
+		else
+			describe(buffer, size, &length, "cgroup %s", cgroup);
+	}
+}
@@ -0,0 +1,49 @@
+#if !defined TUNING_H
+#define TUNING_H
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* How a process is to be scheduled, as far as configured. */
+struct tuning {
+	/* The CPUs it may run on. */
+	bool has_cpus;
+	cpu_set_t cpus;
+
+	/* Its scheduling policy and, for SCHED_FIFO and SCHED_RR, priority. */
+	bool has_policy;
+	int policy, priority;
+
+	/* Its nice value. */
+	bool has_nice;
+	int nice;
+
+	/* Its I/O priority, as ioprio_set() takes it. */
+	bool has_ioprio;
+	int ioprio;
+};
+
+/* Parses a list of CPUs, such as "0-3,6", into a tuning. Returns true on success, false on failure. */
+bool tuning_parse_cpus(struct tuning *tuning, const char *list);
+
+/* Parses a comma-separated list of "fifo:PRIO", "rr:PRIO", "other", "batch", "idle", "nice:N", "io-rt:LEVEL", "io-be:LEVEL" and "io-idle" into a tuning. Returns true on success, false on failure. */
+bool tuning_parse_policy(struct tuning *tuning, const char *spec);
+
+/* Applies a tuning to a process, or to the calling thread (and threads it later creates) if pid is zero. Returns true on success, false on failure. */
+bool tuning_apply(const struct tuning *tuning, pid_t pid);
+
+/* Locks all of the process's memory, current and future, into RAM. Returns true on success, false on failure. */
+bool tuning_lock_memory(void);
+
+/* Creates a cgroup (v2) directory if it does not exist, and limits it to a percentage of one CPU, or lifts the limit if zero. Returns true on success, false on failure. */
+bool tuning_make_cgroup(const char *path, unsigned int quota);
+
+/* Moves a process, or the calling one if pid is zero, into a cgroup. Returns true on success, false on failure. */
+bool tuning_join_cgroup(const char *path, pid_t pid);
+
+/* Describes how a process, or the calling thread if pid is zero, is actually being scheduled, in one line. */
+void tuning_describe(pid_t pid, char *buffer, size_t size);
+
+#endif
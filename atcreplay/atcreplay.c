@@ -0,0 +1,585 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pwd.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "logindex.h"
+#include "../shared/monotime.h"
+#include "../shared/sockaddr_union.h"
+
+
+
+static const struct option longopts[] = {
+	{"socket", required_argument, 0, 'S'},
+	{"speed", required_argument, 0, 'x'},
+	{"start", required_argument, 0, 'o'},
+	{nullptr, 0, 0, 0}
+};
+
+static const char shortopts[] = "S:x:o:";
+
+/* The fastest a replay can be played. */
+#define SPEED_MAX 64
+
+/* A client watching the replay. */
+struct viewer {
+	int fd;
+
+	/* Whether the client has finished the handshake, and whether it has gone and is waiting to be closed. */
+	bool greeted, gone;
+
+	char name[32];
+};
+
+static struct viewer *viewers = nullptr;
+static size_t viewer_count = 0, viewer_alloc = 0;
+
+/* The number of viewers that have finished the handshake. */
+static size_t audience = 0;
+
+/* A username seen in the recording. */
+struct name {
+	uid_t uid;
+	char name[32];
+};
+
+static struct name *names = nullptr;
+static size_t name_count = 0, name_alloc = 0;
+
+static struct recording rec;
+
+/* The offset of the next record to play, and the recording time reached just before it. */
+static size_t cursor;
+static uint64_t cursor_elapsed;
+
+/* The playback clock: the recording time at a point in real time, and how fast it moves from there. */
+static uint64_t base_elapsed = 0, base_time = 0;
+static unsigned int speed = 1;
+static bool playing = false;
+
+/* Whether playback is stopped only because nobody is watching. */
+static bool waiting_for_audience = true;
+
+
+
+/* Returns the recording time the playback clock shows. */
+static uint64_t position(uint64_t now) {
+	return playing ? base_elapsed + (now - base_time) * speed : base_elapsed;
+}
+
+
+
+/* Stops or starts the playback clock, keeping its position. */
+static void set_playing(bool play, uint64_t now) {
+	base_elapsed = position(now);
+	base_time = now;
+	playing = play;
+}
+
+
+
+/* Formats a recording time as [h:]mm:ss. */
+static const char *format_time(uint64_t elapsed, char *buffer, size_t size) {
+	unsigned long seconds = (unsigned long) (elapsed / 1000000000u);
+	if (seconds >= 3600)
+		snprintf(buffer, size, "%lu:%02lu:%02lu", seconds / 3600, seconds / 60 % 60, seconds % 60);
+	else
+		snprintf(buffer, size, "%lu:%02lu", seconds / 60, seconds % 60);
+	return buffer;
+}
+
+
+
+/* Parses a recording time written as [[h:]m:]s. Returns true on success, false on failure. */
+static bool parse_time(const char *text, uint64_t *elapsed) {
+	uint64_t seconds = 0;
+	unsigned int fields = 0;
+	do {
+		char *endptr;
+		unsigned long value = strtoul(text, &endptr, 10);
+		if (endptr == text || (*endptr && *endptr != ':') || ++fields > 3)
+			return false;
+		seconds = seconds * 60 + value;
+		text = *endptr ? endptr + 1 : endptr;
+	} while (*text);
+	*elapsed = seconds * 1000000000u;
+	return true;
+}
+
+
+
+/* Sends a message to one viewer. Returns true on success, false if the viewer is gone or cannot keep up. */
+static bool vputs(const struct viewer *viewer, const char *string) {
+	ssize_t ret;
+	do {
+		ret = send(viewer->fd, string, strlen(string), MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (ret < 0 && errno == EINTR);
+	return ret >= 0;
+}
+
+
+
+/* Sends a message to every viewer, marking those that cannot keep up as gone. */
+static void broadcast(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void broadcast(const char *format, ...) {
+	char buffer[1024];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	for (size_t i = 0; i < viewer_count; i++)
+		if (viewers[i].greeted && !viewers[i].gone && !vputs(&viewers[i], buffer))
+			viewers[i].gone = true;
+}
+
+
+
+/* Closes the connections of viewers that have gone, telling the rest. */
+static void sweep_viewers(void) {
+	for (size_t i = 0; i < viewer_count;) {
+		if (!viewers[i].gone) {
+			i++;
+			continue;
+		}
+		struct viewer viewer = viewers[i];
+		close(viewer.fd);
+		viewers[i] = viewers[--viewer_count];
+		if (viewer.greeted) {
+			/* Telling the others may find more that have gone, so look again from the start. */
+			audience--;
+			broadcast("[replay] %s stopped watching", viewer.name);
+			i = 0;
+		}
+	}
+}
+
+
+
+/* Remembers the username of a user who joined in the recording. */
+static void remember_name(uid_t uid, const uint8_t *name, size_t length) {
+	size_t i;
+	for (i = 0; i < name_count && names[i].uid != uid; i++);
+	if (i == name_count) {
+		if (name_count == name_alloc) {
+			size_t new_alloc = name_alloc ? name_alloc * 2 : 8;
+			struct name *new = realloc(names, new_alloc * sizeof(*names));
+			if (!new)
+				return;
+			names = new;
+			name_alloc = new_alloc;
+		}
+		names[name_count++].uid = uid;
+	}
+	if (length >= sizeof(names[i].name))
+		length = sizeof(names[i].name) - 1;
+	memcpy(names[i].name, name, length);
+	names[i].name[length] = '\0';
+}
+
+
+
+/* Finds the username of a user in the recording, from when they joined or else from the password database. */
+static const char *name_of(uid_t uid, char *buffer, size_t size) {
+	for (size_t i = 0; i < name_count; i++)
+		if (names[i].uid == uid)
+			return names[i].name;
+	char pwbuf[1024];
+	struct passwd pwd, *pwdptr;
+	if (getpwuid_r(uid, &pwd, pwbuf, sizeof(pwbuf), &pwdptr) == 0 && pwdptr)
+		snprintf(buffer, size, "%s", pwd.pw_name);
+	else
+		snprintf(buffer, size, "uid %lu", (unsigned long) uid);
+	return buffer;
+}
+
+
+
+/* Copies a payload as printable text, without a trailing newline. */
+static const char *payload_text(const struct record *record, char *buffer, size_t size) {
+	size_t length = record->length;
+	if (length && record->payload[length - 1] == '\n')
+		length--;
+	if (length >= size)
+		length = size - 1;
+	for (size_t i = 0; i < length; i++)
+		buffer[i] = record->payload[i] >= 0x20 && record->payload[i] < 0x7F ? (char) record->payload[i] : '?';
+	buffer[length] = '\0';
+	return buffer;
+}
+
+
+
+/* Shows a record to the viewers as atcd showed it to the players, plus what only the server saw. */
+static void play(const struct record *record) {
+	char name[64], text[512];
+	switch (record->type) {
+		case RECORD_SESSION: {
+			uint64_t realtime;
+			char date[64] = "";
+			if (varint_get(record->payload, record->length, &realtime)) {
+				time_t seconds = (time_t) (realtime / 1000000000u);
+				struct tm tm;
+				if (localtime_r(&seconds, &tm))
+					strftime(date, sizeof(date), " on %Y-%m-%d at %H:%M:%S", &tm);
+			}
+			broadcast("[replay] server started%s", date);
+			break;
+		}
+
+		case RECORD_JOIN:
+			remember_name(record->uid, record->payload, record->length);
+			broadcast("[server] %s has entered the game", name_of(record->uid, name, sizeof(name)));
+			break;
+
+		case RECORD_LEAVE:
+			broadcast("[replay] %s has left", name_of(record->uid, name, sizeof(name)));
+			break;
+
+		case RECORD_INPUT:
+			broadcast("[replay] %s: %s", name_of(record->uid, name, sizeof(name)), payload_text(record, text, sizeof(text)));
+			break;
+
+		case RECORD_CHAT:
+			broadcast("<%s> %s", name_of(record->uid, name, sizeof(name)), payload_text(record, text, sizeof(text)));
+			break;
+
+		case RECORD_COMMAND:
+			broadcast("[replay] %s ran //%s", name_of(record->uid, name, sizeof(name)), payload_text(record, text, sizeof(text)));
+			break;
+
+		case RECORD_GAME_END:
+			broadcast("[server] the game has ended");
+			break;
+
+		default:
+			break;
+	}
+}
+
+
+
+/* Plays every record up to the playback clock. Returns the real time at which the next record is due, or 0 if none is. */
+static uint64_t play_due(uint64_t now) {
+	uint64_t pos = position(now);
+	struct record record;
+	size_t next;
+	while ((next = recording_read(&rec, cursor, &record))) {
+		uint64_t elapsed = cursor_elapsed + record_advance(&record);
+		if (elapsed > pos)
+			return playing ? now + (elapsed - pos + speed - 1) / speed : 0;
+		play(&record);
+		cursor = next;
+		cursor_elapsed = elapsed;
+	}
+
+	/* Stop at the end, so the viewers can seek back. */
+	if (playing) {
+		set_playing(false, now);
+		base_elapsed = rec.duration;
+		broadcast("[replay] end of the recording");
+	}
+	return 0;
+}
+
+
+
+/* Moves playback to a recording time, skipping everything before it. */
+static void seek(uint64_t target, uint64_t now) {
+	if (target > rec.duration)
+		target = rec.duration;
+	const struct keyframe *keyframe = recording_find(&rec, target);
+	cursor = keyframe->offset;
+	cursor_elapsed = keyframe->elapsed;
+	struct record record;
+	size_t next;
+	while ((next = recording_read(&rec, cursor, &record)) && cursor_elapsed + record_advance(&record) < target) {
+		/* Still learn the names of users who join in the skipped part. */
+		if (record.type == RECORD_JOIN)
+			remember_name(record.uid, record.payload, record.length);
+		cursor_elapsed += record_advance(&record);
+		cursor = next;
+	}
+	base_elapsed = target;
+	base_time = now;
+}
+
+
+
+static void control_command(struct viewer *viewer, const char *command, uint64_t now) {
+	char here[32], total[32];
+	if (strcmp(command, "help") == 0) {
+		vputs(viewer, "[replay] supported commands are:");
+		vputs(viewer, "[replay] help");
+		vputs(viewer, "[replay] where");
+		vputs(viewer, "[replay] pause");
+		vputs(viewer, "[replay] resume");
+		char line[64];
+		snprintf(line, sizeof(line), "[replay] speed <1-%u>", SPEED_MAX);
+		vputs(viewer, line);
+		vputs(viewer, "[replay] seek [[h:]m:]s");
+		vputs(viewer, "[replay] seek +<seconds> | -<seconds>");
+	} else if (strcmp(command, "where") == 0) {
+		char buffer[128];
+		snprintf(buffer, sizeof(buffer), "[replay] at %s of %s, %s at %ux", format_time(position(now), here, sizeof(here)), format_time(rec.duration, total, sizeof(total)), playing ? "playing" : "paused", speed);
+		vputs(viewer, buffer);
+	} else if (strcmp(command, "pause") == 0) {
+		set_playing(false, now);
+		broadcast("[replay] paused by %s at %s", viewer->name, format_time(position(now), here, sizeof(here)));
+	} else if (strcmp(command, "resume") == 0) {
+		struct record record;
+		if (!recording_read(&rec, cursor, &record)) {
+			vputs(viewer, "[replay] at the end of the recording");
+			return;
+		}
+		set_playing(true, now);
+		broadcast("[replay] resumed by %s at %s", viewer->name, format_time(position(now), here, sizeof(here)));
+	} else if (strncmp(command, "speed ", 6) == 0) {
+		char *endptr;
+		unsigned long value = strtoul(command + 6, &endptr, 10);
+		if (!command[6] || *endptr || value == 0 || value > SPEED_MAX) {
+			vputs(viewer, "[replay] invalid speed");
+			return;
+		}
+		base_elapsed = position(now);
+		base_time = now;
+		speed = value;
+		broadcast("[replay] speed set to %ux by %s", speed, viewer->name);
+	} else if (strncmp(command, "seek ", 5) == 0) {
+		const char *arg = command + 5;
+		uint64_t target, delta;
+		if ((*arg == '+' || *arg == '-') && parse_time(arg + 1, &delta)) {
+			uint64_t pos = position(now);
+			target = *arg == '+' ? pos + delta : pos > delta ? pos - delta : 0;
+		} else if (!parse_time(arg, &target)) {
+			vputs(viewer, "[replay] invalid time");
+			return;
+		}
+		seek(target, now);
+		broadcast("[replay] %s jumped to %s of %s", viewer->name, format_time(base_elapsed, here, sizeof(here)), format_time(rec.duration, total, sizeof(total)));
+	} else {
+		vputs(viewer, "[replay] unknown command");
+	}
+}
+
+
+
+/* Handles the handshake from a new viewer. Returns true on success, false if the viewer must be dropped. */
+static bool greet(struct viewer *viewer, const char *packet, uint64_t now) {
+	if (strcmp(packet, "MATC 1") != 0) {
+		vputs(viewer, "MATC VERSION");
+		return false;
+	}
+
+	/* Name the viewer for the others. */
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	if (getsockopt(viewer->fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0 || credlen != sizeof(cred))
+		return false;
+	char pwbuf[1024];
+	struct passwd pwd, *pwdptr;
+	if (getpwuid_r(cred.uid, &pwd, pwbuf, sizeof(pwbuf), &pwdptr) == 0 && pwdptr)
+		snprintf(viewer->name, sizeof(viewer->name), "%s", pwd.pw_name);
+	else
+		snprintf(viewer->name, sizeof(viewer->name), "uid %lu", (unsigned long) cred.uid);
+
+	if (!vputs(viewer, "MATC OK"))
+		return false;
+	viewer->greeted = true;
+	audience++;
+	broadcast("[replay] %s is watching", viewer->name);
+
+	/* Start the clock for the first viewer, or pick up where the last one left it. */
+	if (waiting_for_audience) {
+		waiting_for_audience = false;
+		set_playing(true, now);
+	}
+	return true;
+}
+
+
+
+/* Handles a packet from a viewer. Returns true on success, false if the viewer must be dropped. */
+static bool handle_packet(struct viewer *viewer, const char *packet, uint64_t now) {
+	if (!viewer->greeted)
+		return greet(viewer, packet, now);
+
+	if (packet[0] == '/' && packet[1] == '/')
+		control_command(viewer, packet + 2, now);
+	else if (packet[0] == '/')
+		broadcast("<%s> %s", viewer->name, packet + 1);
+	else
+		vputs(viewer, "[replay] this is a replay; game commands are ignored");
+	return true;
+}
+
+
+
+/* Accepts every waiting connection. */
+static void accept_viewers(int listenfd) {
+	for (;;) {
+		int fd = accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+		if (viewer_count == viewer_alloc) {
+			size_t new_alloc = viewer_alloc ? viewer_alloc * 2 : 8;
+			struct viewer *new = realloc(viewers, new_alloc * sizeof(*viewers));
+			if (!new) {
+				close(fd);
+				continue;
+			}
+			viewers = new;
+			viewer_alloc = new_alloc;
+		}
+		viewers[viewer_count++] = (struct viewer) {.fd = fd};
+	}
+}
+
+
+
+static int run(int listenfd) {
+	struct pollfd *pollfds = nullptr;
+	size_t pollfds_alloc = 0;
+	for (;;) {
+		/* Play what is due, if anyone is watching, and work out how long to sleep. */
+		uint64_t now = monotime_now();
+		uint64_t due = audience ? play_due(now) : 0;
+
+		/* Wait for the listener, the viewers and the next record. */
+		if (pollfds_alloc < viewer_count + 1) {
+			struct pollfd *new = realloc(pollfds, (viewer_alloc + 1) * sizeof(*pollfds));
+			if (!new) {
+				perror("malloc");
+				return EXIT_FAILURE;
+			}
+			pollfds = new;
+			pollfds_alloc = viewer_alloc + 1;
+		}
+		size_t count = 0;
+		pollfds[count++] = (struct pollfd) {.fd = listenfd, .events = POLLIN};
+		for (size_t i = 0; i < viewer_count; i++)
+			pollfds[count++] = (struct pollfd) {.fd = viewers[i].fd, .events = POLLIN};
+		struct timespec timeout = monotime_to_timespec(due > now ? due - now : 0);
+		if (ppoll(pollfds, count, due ? &timeout : nullptr, nullptr) < 0 && errno != EINTR) {
+			perror("ppoll");
+			return EXIT_FAILURE;
+		}
+		now = monotime_now();
+
+		/* Handle packets from the viewers. */
+		for (size_t i = 1; i < count; i++) {
+			struct viewer *viewer = &viewers[i - 1];
+			if (!pollfds[i].revents || viewer->gone)
+				continue;
+			char packet[256];
+			ssize_t ret = recv(viewer->fd, packet, sizeof(packet) - 1, 0);
+			if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			packet[ret > 0 ? ret : 0] = '\0';
+			if (ret <= 0 || !handle_packet(viewer, packet, now))
+				viewer->gone = true;
+		}
+		sweep_viewers();
+
+		/* Hold the replay while nobody is watching. */
+		if (!audience && !waiting_for_audience) {
+			waiting_for_audience = playing;
+			set_playing(false, now);
+		}
+
+		if (pollfds[0].revents & POLLIN)
+			accept_viewers(listenfd);
+	}
+}
+
+
+
+int main(int argc, char **argv) {
+	/* Scan command-line options. */
+	union sockaddr_union saddr;
+	bool has_path = false;
+	uint64_t start = 0;
+	int ret;
+	while ((ret = getopt_long(argc, argv, shortopts, longopts, 0)) >= 0) {
+		switch (ret) {
+			case 'S':
+				if (strlen(optarg) + 1 > sizeof(saddr.sun.sun_path)) {
+					errno = ENAMETOOLONG;
+					perror("socket address");
+					return EXIT_FAILURE;
+				}
+				strcpy(saddr.sun.sun_path, optarg);
+				has_path = true;
+				break;
+
+			case 'x': {
+				char *endptr;
+				unsigned long value = strtoul(optarg, &endptr, 10);
+				if (!*optarg || *endptr || value == 0 || value > SPEED_MAX) {
+					fprintf(stderr, "%s: invalid speed: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				speed = value;
+				break;
+			}
+
+			case 'o':
+				if (!parse_time(optarg, &start)) {
+					fprintf(stderr, "%s: invalid start time: %s\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			default:
+				fprintf(stderr, "%s: unrecognized argument\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (!has_path || optind != argc - 1) {
+		fprintf(stderr, "Usage: %s --socket PATH [--speed N] [--start [[h:]m:]s] RECORDING\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Open the recording; with a cached index, this does not read the log at all. */
+	if (!recording_open(&rec, argv[optind])) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	seek(start, monotime_now());
+
+	/* Create the socket, accessible only to our own user. */
+	int listenfd = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenfd < 0) {
+		perror("socket(PF_UNIX, SOCK_SEQPACKET, 0)");
+		return EXIT_FAILURE;
+	}
+	unlink(saddr.sun.sun_path);
+	saddr.sun.sun_family = AF_UNIX;
+	mode_t oldumask = umask(077);
+	if (bind(listenfd, &saddr.s, sizeof(saddr)) < 0) {
+		perror("bind");
+		return EXIT_FAILURE;
+	}
+	umask(oldumask);
+	if (listen(listenfd, 10) < 0) {
+		perror("listen");
+		return EXIT_FAILURE;
+	}
+
+	return run(listenfd);
+}
@@ -0,0 +1,240 @@
+#include "logindex.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+
+/* How much recording time may pass between keyframes, in nanoseconds. */
+#define KEYFRAME_INTERVAL 10000000000u
+
+/* The start of an index file, which is followed by the keyframes. Being a cache, it is in native byte order. */
+struct index_header {
+	char magic[8];
+
+	/* How much of the log the index covers, and the recording time up to there. */
+	uint64_t log_size;
+	uint64_t duration;
+
+	/* The wall clock time that starts the log, to tell a replaced log from the one that was indexed. */
+	uint64_t origin;
+
+	uint64_t keyframe_count;
+};
+
+#define INDEX_MAGIC "MATCIDX1"
+
+
+
+/* Decodes the record at an offset in a buffer. Returns the offset of the next record, or 0 if the record is incomplete or malformed. */
+static size_t decode(const uint8_t *data, size_t size, size_t offset, struct record *record) {
+	uint64_t length, delta, uid;
+	size_t used = varint_get(data + offset, size - offset, &length);
+	if (!used || length > size - offset - used)
+		return 0;
+	const uint8_t *pos = data + offset + used, *end = pos + length;
+	if (pos == end)
+		return 0;
+	record->type = (enum record_type) *pos++;
+	if (!(used = varint_get(pos, end - pos, &delta)))
+		return 0;
+	pos += used;
+	if (!(used = varint_get(pos, end - pos, &uid)))
+		return 0;
+	pos += used;
+	record->delta = delta;
+	record->uid = (uid_t) uid;
+	record->payload = pos;
+	record->length = end - pos;
+	return end - data;
+}
+
+
+
+/* Reads the index from a file, if it belongs to the log. Returns true on success, false if the index is missing or unusable. */
+static bool load_index(struct recording *rec, const char *index_path, uint64_t origin, size_t log_size) {
+	int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct index_header header;
+	struct stat st;
+	bool ok = read(fd, &header, sizeof(header)) == (ssize_t) sizeof(header)
+		&& memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0
+		&& header.origin == origin
+		&& header.log_size <= log_size
+		&& header.keyframe_count
+		&& fstat(fd, &st) == 0
+		&& (uint64_t) st.st_size == sizeof(header) + header.keyframe_count * sizeof(struct keyframe);
+	if (ok) {
+		size_t bytes = header.keyframe_count * sizeof(struct keyframe);
+		rec->keyframes = malloc(bytes);
+		ok = rec->keyframes && read(fd, rec->keyframes, bytes) == (ssize_t) bytes;
+	}
+	close(fd);
+	if (!ok) {
+		free(rec->keyframes);
+		rec->keyframes = nullptr;
+		return false;
+	}
+	rec->keyframe_count = header.keyframe_count;
+	rec->size = header.log_size;
+	rec->duration = header.duration;
+	return true;
+}
+
+
+
+/* Writes the index to a file, replacing it atomically. Returns true on success, false on failure. */
+static bool save_index(const struct recording *rec, const char *index_path, uint64_t origin) {
+	char *temp_path = malloc(strlen(index_path) + 5);
+	if (!temp_path)
+		return false;
+	strcpy(temp_path, index_path);
+	strcat(temp_path, ".tmp");
+	int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		free(temp_path);
+		return false;
+	}
+	struct index_header header;
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.log_size = rec->size;
+	header.duration = rec->duration;
+	header.origin = origin;
+	header.keyframe_count = rec->keyframe_count;
+	size_t bytes = rec->keyframe_count * sizeof(struct keyframe);
+	bool ok = write(fd, &header, sizeof(header)) == (ssize_t) sizeof(header)
+		&& write(fd, rec->keyframes, bytes) == (ssize_t) bytes;
+	ok = close(fd) == 0 && ok;
+	ok = ok && rename(temp_path, index_path) == 0;
+	if (!ok)
+		unlink(temp_path);
+	free(temp_path);
+	return ok;
+}
+
+
+
+/* Indexes the part of the mapped log after what the index covers. Returns true on success, false on failure. */
+static bool extend_index(struct recording *rec, size_t mapped_size) {
+	size_t alloc = rec->keyframe_count;
+	uint64_t last_keyframe = rec->keyframe_count ? rec->keyframes[rec->keyframe_count - 1].elapsed : 0;
+	size_t offset = rec->size;
+	struct record record;
+	size_t next;
+	while ((next = decode(rec->data, mapped_size, offset, &record))) {
+		/* Start a keyframe at the first record, at each new session and whenever enough time has passed. */
+		if (!rec->keyframe_count || record.type == RECORD_SESSION || rec->duration - last_keyframe >= KEYFRAME_INTERVAL) {
+			if (rec->keyframe_count == alloc) {
+				size_t new_alloc = alloc ? alloc * 2 : 64;
+				struct keyframe *new = realloc(rec->keyframes, new_alloc * sizeof(*new));
+				if (!new)
+					return false;
+				rec->keyframes = new;
+				alloc = new_alloc;
+			}
+			rec->keyframes[rec->keyframe_count].offset = offset;
+			rec->keyframes[rec->keyframe_count].elapsed = rec->duration;
+			rec->keyframe_count++;
+			last_keyframe = rec->duration;
+		}
+		rec->duration += record_advance(&record);
+		offset = next;
+	}
+	rec->size = offset;
+	return true;
+}
+
+
+
+bool recording_open(struct recording *rec, const char *path) {
+	memset(rec, 0, sizeof(*rec));
+
+	/* Map the log; a log that is still being written is played up to where it was when opened. */
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+	if ((size_t) st.st_size < RECORDING_MAGIC_LENGTH) {
+		close(fd);
+		errno = EINVAL;
+		return false;
+	}
+	void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	rec->data = data;
+	size_t mapped_size = st.st_size;
+	if (memcmp(rec->data, RECORDING_MAGIC, RECORDING_MAGIC_LENGTH) != 0) {
+		munmap(data, mapped_size);
+		errno = EINVAL;
+		return false;
+	}
+
+	/* Identify the log by the wall clock time of its first session. */
+	uint64_t origin = 0;
+	struct record first;
+	if (decode(rec->data, mapped_size, RECORDING_MAGIC_LENGTH, &first) && first.type == RECORD_SESSION)
+		varint_get(first.payload, first.length, &origin);
+
+	/* Use the cached index if there is one, and index whatever has been appended since. */
+	char *index_path = malloc(strlen(path) + 5);
+	if (!index_path) {
+		munmap(data, mapped_size);
+		return false;
+	}
+	strcpy(index_path, path);
+	strcat(index_path, ".idx");
+	bool loaded = load_index(rec, index_path, origin, mapped_size);
+	if (!loaded)
+		rec->size = RECORDING_MAGIC_LENGTH;
+	size_t indexed_size = rec->size;
+	if (!extend_index(rec, mapped_size)) {
+		free(index_path);
+		free(rec->keyframes);
+		munmap(data, mapped_size);
+		return false;
+	}
+	if (!rec->keyframe_count) {
+		free(index_path);
+		munmap(data, mapped_size);
+		errno = ENODATA;
+		return false;
+	}
+
+	/* Save the index for next time; if that fails, the replay can still go on. */
+	if (!loaded || rec->size != indexed_size)
+		save_index(rec, index_path, origin);
+	free(index_path);
+	return true;
+}
+
+
+
+size_t recording_read(const struct recording *rec, size_t offset, struct record *record) {
+	return offset < rec->size ? decode(rec->data, rec->size, offset, record) : 0;
+}
+
+
+
+const struct keyframe *recording_find(const struct recording *rec, uint64_t elapsed) {
+	size_t low = 0, high = rec->keyframe_count;
+	while (high - low > 1) {
+		size_t mid = low + (high - low) / 2;
+		if (rec->keyframes[mid].elapsed < elapsed)
+			low = mid;
+		else
+			high = mid;
+	}
+	return &rec->keyframes[low];
+}
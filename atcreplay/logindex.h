@@ -0,0 +1,53 @@
+#if !defined LOGINDEX_H
+#define LOGINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "../shared/recording.h"
+
+/* A point to start playing from: the offset of a record and the recording time reached just before it. */
+struct keyframe {
+	uint64_t offset;
+	uint64_t elapsed;
+};
+
+/* An open recording, mapped into memory, with its keyframes. */
+struct recording {
+	/* The log, up to the end of its last complete record. */
+	const uint8_t *data;
+	size_t size;
+
+	/* The keyframes, in order, the first at the first record. */
+	struct keyframe *keyframes;
+	size_t keyframe_count;
+
+	/* The length of the recording, in nanoseconds of recorded time; gaps between sessions do not count. */
+	uint64_t duration;
+};
+
+/* A decoded record, pointing into the mapped log. */
+struct record {
+	enum record_type type;
+	uint64_t delta;
+	uid_t uid;
+	const uint8_t *payload;
+	size_t length;
+};
+
+/* Maps a recording and loads its index from PATH.idx, building or extending the index if it is missing or out of date. Returns true on success, false on failure. */
+bool recording_open(struct recording *rec, const char *path);
+
+/* Decodes the record at an offset. Returns the offset of the next record, or 0 at the end of the log. */
+size_t recording_read(const struct recording *rec, size_t offset, struct record *record);
+
+/* Returns how far a record moves the recording time along. */
+static inline uint64_t record_advance(const struct record *record) {
+	return record->type == RECORD_SESSION ? 0 : record->delta;
+}
+
+/* Finds the keyframe to play from to reach a recording time: the last one before it, or the first. */
+const struct keyframe *recording_find(const struct recording *rec, uint64_t elapsed);
+
+#endif
@@ -0,0 +1,348 @@
+#include "matc.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "../shared/commands.h"
+#include "../shared/sockpath.h"
+#include "../shared/sockaddr_union.h"
+
+
+
+/* The most packets received, or sent, in one system call. */
+#define BATCH_MAX 16
+
+/* The size of a receive buffer; atcd's messages are shorter, and anything longer is cut short. */
+#define RECEIVE_MAX 1024
+
+struct packet {
+	size_t length;
+	char data[MATC_PACKET_MAX];
+};
+
+struct matc {
+	int fd;
+
+	/* Whether the hello has yet to be sent, and whether the server has accepted us. */
+	bool hello_pending, ready;
+
+	/* Packets waiting to be sent, as a ring, and whether the socket was last found full. */
+	struct packet queue[MATC_QUEUE_MAX];
+	unsigned int queue_head, queue_count;
+	bool blocked;
+
+	/* The last batch of packets received, and the next of them to hand out. */
+	char inbox[BATCH_MAX][RECEIVE_MAX + 1];
+	unsigned int inbox_length[BATCH_MAX];
+	unsigned int received, next;
+
+	/* The sender of the last chat line handed out. */
+	char sender[64];
+
+	/* The planes commands may be given to. */
+	plane_set planes;
+};
+
+
+
+struct matc *matc_connect(const char *path) {
+	union sockaddr_union saddr;
+	if (path) {
+		if (strlen(path) + 1 > sizeof(saddr.sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return nullptr;
+		}
+		strcpy(saddr.sun.sun_path, path);
+	} else if (!sockpath_set_default(&saddr.sun)) {
+		return nullptr;
+	}
+	saddr.sun.sun_family = AF_UNIX;
+
+	struct matc *conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return nullptr;
+	conn->fd = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (conn->fd < 0) {
+		free(conn);
+		return nullptr;
+	}
+	conn->hello_pending = true;
+	conn->planes = PLANES_ALL;
+	if (connect(conn->fd, &saddr.s, sizeof(saddr)) < 0 || !matc_flush(conn)) {
+		int saved_errno = errno;
+		close(conn->fd);
+		free(conn);
+		errno = saved_errno;
+		return nullptr;
+	}
+	return conn;
+}
+
+
+
+void matc_close(struct matc *conn) {
+	close(conn->fd);
+	free(conn);
+}
+
+
+
+int matc_get_fd(const struct matc *conn) {
+	return conn->fd;
+}
+
+
+
+unsigned int matc_wants(const struct matc *conn) {
+	return MATC_WANT_READ | (conn->blocked ? MATC_WANT_WRITE : 0);
+}
+
+
+
+bool matc_pending(const struct matc *conn) {
+	return conn->next < conn->received;
+}
+
+
+
+uint64_t matc_planes(const struct matc *conn) {
+	return conn->planes;
+}
+
+
+
+bool matc_is_ready(const struct matc *conn) {
+	return conn->ready;
+}
+
+
+
+/* Queues a packet made of a prefix, some text and a suffix, followed after a NUL by a trailer unless that is nullptr. Returns true on success, false on failure. */
+static bool enqueue(struct matc *conn, const char *prefix, const char *text, const char *suffix, const char *trailer) {
+	size_t prefix_length = strlen(prefix), text_length = strlen(text), suffix_length = strlen(suffix);
+	size_t trailer_length = trailer ? strlen(trailer) + 1 : 0;
+	if (prefix_length + text_length + suffix_length + trailer_length > MATC_PACKET_MAX) {
+		errno = EMSGSIZE;
+		return false;
+	}
+	if (conn->queue_count == MATC_QUEUE_MAX) {
+		errno = ENOBUFS;
+		return false;
+	}
+	struct packet *pkt = &conn->queue[(conn->queue_head + conn->queue_count++) % MATC_QUEUE_MAX];
+	memcpy(pkt->data, prefix, prefix_length);
+	memcpy(pkt->data + prefix_length, text, text_length);
+	memcpy(pkt->data + prefix_length + text_length, suffix, suffix_length);
+	pkt->length = prefix_length + text_length + suffix_length;
+	if (trailer) {
+		pkt->data[pkt->length] = '\0';
+		memcpy(pkt->data + pkt->length + 1, trailer, trailer_length - 1);
+		pkt->length += trailer_length;
+	}
+	return true;
+}
+
+
+
+bool matc_send_command(struct matc *conn, const char *command) {
+	return matc_send_traced_command(conn, command, 0, 0);
+}
+
+
+
+bool matc_send_traced_command(struct matc *conn, const char *command, uint64_t trace, uint64_t keystroke) {
+	char description[2048];
+	bool terminal;
+	if (command[0] == '/' || !parse_command(command, conn->planes, description, sizeof(description), &terminal) || !terminal) {
+		errno = plane_bit(command[0]) && !(plane_bit(command[0]) & conn->planes) ? ESRCH : EINVAL;
+		return false;
+	}
+	if (!trace)
+		return enqueue(conn, "", command, "\n", nullptr);
+	char trailer[64];
+	snprintf(trailer, sizeof(trailer), "trace %" PRIx64 " %" PRIu64, trace, keystroke);
+	return enqueue(conn, "", command, "\n", trailer);
+}
+
+
+
+bool matc_send_chat(struct matc *conn, const char *text) {
+	return enqueue(conn, "/", text, "", nullptr);
+}
+
+
+
+bool matc_send_server(struct matc *conn, const char *command) {
+	return enqueue(conn, "//", command, "", nullptr);
+}
+
+
+
+bool matc_send_key(struct matc *conn, char key) {
+	if (key != ' ' && key != '\x0c') {
+		errno = EINVAL;
+		return false;
+	}
+	char text[2] = {key, '\0'};
+	return enqueue(conn, "", text, "", nullptr);
+}
+
+
+
+bool matc_flush(struct matc *conn) {
+	conn->blocked = false;
+	if (conn->hello_pending) {
+		if (send(conn->fd, "MATC 1", strlen("MATC 1"), MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				conn->blocked = true;
+				return true;
+			}
+			return false;
+		}
+		conn->hello_pending = false;
+	}
+
+	/* Nothing else may be sent until the server has answered the hello. */
+	while (conn->ready && conn->queue_count) {
+		struct mmsghdr msgs[BATCH_MAX];
+		struct iovec iovs[BATCH_MAX];
+		unsigned int count = conn->queue_count < BATCH_MAX ? conn->queue_count : BATCH_MAX;
+		for (unsigned int i = 0; i < count; i++) {
+			struct packet *pkt = &conn->queue[(conn->queue_head + i) % MATC_QUEUE_MAX];
+			iovs[i] = (struct iovec) {.iov_base = pkt->data, .iov_len = pkt->length};
+			msgs[i] = (struct mmsghdr) {.msg_hdr = {.msg_iov = &iovs[i], .msg_iovlen = 1}};
+		}
+		int sent = sendmmsg(conn->fd, msgs, count, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				conn->blocked = true;
+				return true;
+			}
+			return false;
+		}
+		conn->queue_head = (conn->queue_head + (unsigned int) sent) % MATC_QUEUE_MAX;
+		conn->queue_count -= (unsigned int) sent;
+		if ((unsigned int) sent < count) {
+			conn->blocked = true;
+			return true;
+		}
+	}
+	return true;
+}
+
+
+
+/* Receives a batch of packets. Returns 1 if any arrived, 0 if none has, or -1 on failure. */
+static int receive(struct matc *conn) {
+	struct mmsghdr msgs[BATCH_MAX];
+	struct iovec iovs[BATCH_MAX];
+	for (unsigned int i = 0; i < BATCH_MAX; i++) {
+		iovs[i] = (struct iovec) {.iov_base = conn->inbox[i], .iov_len = RECEIVE_MAX};
+		msgs[i] = (struct mmsghdr) {.msg_hdr = {.msg_iov = &iovs[i], .msg_iovlen = 1}};
+	}
+	int count;
+	do {
+		count = recvmmsg(conn->fd, msgs, BATCH_MAX, MSG_DONTWAIT, nullptr);
+	} while (count < 0 && errno == EINTR);
+	if (count < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	for (int i = 0; i < count; i++) {
+		conn->inbox_length[i] = msgs[i].msg_len;
+		conn->inbox[i][msgs[i].msg_len] = '\0';
+	}
+	conn->received = (unsigned int) count;
+	conn->next = 0;
+	return count ? 1 : 0;
+}
+
+
+
+/* Checks whether a packet starts with a tag followed by a space, and if so stores what follows in *body. */
+static bool tagged(const char *text, const char *tag, const char **body) {
+	size_t length = strlen(tag);
+	if (strncmp(text, tag, length) != 0 || text[length] != ' ')
+		return false;
+	*body = text + length + 1;
+	return true;
+}
+
+
+
+int matc_next_event(struct matc *conn, struct matc_event *event) {
+	if (conn->next == conn->received) {
+		int ret = receive(conn);
+		if (ret <= 0)
+			return ret;
+	}
+	const char *text = conn->inbox[conn->next];
+	size_t length = conn->inbox_length[conn->next];
+	conn->next++;
+
+	/* An empty packet is the server closing the connection. */
+	if (!length) {
+		conn->next = conn->received = 0;
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	/* Until the server accepts us, the only packet expected is its answer to the hello. */
+	if (!conn->ready) {
+		if (strcmp(text, "MATC OK") != 0) {
+			errno = strcmp(text, "MATC ACCESS") == 0 ? EACCES : EPROTONOSUPPORT;
+			return -1;
+		}
+		conn->ready = true;
+		*event = (struct matc_event) {.type = MATC_EVENT_READY, .text = text, .length = length, .sender = "", .body = text};
+		return matc_flush(conn) ? 1 : -1;
+	}
+
+	*event = (struct matc_event) {.type = MATC_EVENT_OTHER, .text = text, .length = length, .sender = "", .body = text};
+	const char *close;
+	if (tagged(text, "[server]", &event->body)) {
+		event->type = MATC_EVENT_SERVER;
+	} else if (tagged(text, "[state]", &event->body)) {
+		event->type = MATC_EVENT_STATE;
+	} else if (tagged(text, "[map]", &event->body)) {
+		event->type = MATC_EVENT_MAP;
+	} else if (tagged(text, "[planes]", &event->body)) {
+		event->type = MATC_EVENT_PLANES;
+		plane_set planes = 0;
+		for (const char *name = event->body; *name; name++)
+			planes |= *name == '*' ? PLANES_ALL : plane_bit(*name);
+		conn->planes = planes & PLANES_ALL;
+	} else if (text[0] == '<' && (close = strstr(text, "> "))) {
+		size_t sender_length = (size_t) (close - text - 1);
+		if (sender_length >= sizeof(conn->sender))
+			sender_length = sizeof(conn->sender) - 1;
+		memcpy(conn->sender, text + 1, sender_length);
+		conn->sender[sender_length] = '\0';
+		event->type = MATC_EVENT_CHAT;
+		event->sender = conn->sender;
+		event->body = close + 2;
+	}
+	return 1;
+}
+
+
+
+bool matc_wait(struct matc *conn, int timeout) {
+	if (!matc_flush(conn))
+		return false;
+	if (matc_pending(conn))
+		return true;
+	struct pollfd pfd = {.fd = conn->fd, .events = POLLIN | ((matc_wants(conn) & MATC_WANT_WRITE) ? POLLOUT : 0)};
+	int ret;
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+	return ret > 0;
+}
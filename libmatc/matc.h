@@ -0,0 +1,111 @@
+#if !defined MATC_H
+#define MATC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A client library for atcd. Nothing in it blocks, except matc_wait(): a
+ * program with an event loop waits on matc_get_fd() for the readiness
+ * matc_wants() asks for, then calls matc_flush() and matc_next_event(),
+ * without waiting at all while matc_pending() says packets already received
+ * are left to hand out.
+ * Commands and chat are queued and sent together in as few system calls as
+ * possible, so a bot can send many per second; atcd's rate limit still
+ * applies.
+ */
+
+/* A connection to atcd. */
+struct matc;
+
+/* The most packets that can be queued for sending. */
+#define MATC_QUEUE_MAX 256
+
+/* The longest packet atcd accepts. */
+#define MATC_PACKET_MAX 255
+
+/* Readiness flags returned by matc_wants(). */
+#define MATC_WANT_READ 0x01
+#define MATC_WANT_WRITE 0x02
+
+enum matc_event_type {
+	/* The server has accepted us; commands queued so far are now sent. */
+	MATC_EVENT_READY,
+
+	/* A message from the server ("[server] ..."); body is the message. */
+	MATC_EVENT_SERVER,
+
+	/* A chat line ("<user> ..."); sender is the user and body the line. */
+	MATC_EVENT_CHAT,
+
+	/* A game state event ("[state] ..." or "[map] ...", see atcd/gamestate.h); body is what follows the tag. */
+	MATC_EVENT_STATE,
+	MATC_EVENT_MAP,
+
+	/* The planes in the game ("[planes] <letters>", or "*" for any); body is the letters. Commands for other planes are refused from now on. */
+	MATC_EVENT_PLANES,
+
+	/* Anything else, such as "[replay] ..." from atcreplay; body is the whole packet. */
+	MATC_EVENT_OTHER,
+};
+
+/* A received event. The strings are NUL-terminated and stay valid until the next call to matc_next_event() or matc_close(). */
+struct matc_event {
+	enum matc_event_type type;
+
+	/* The whole packet. */
+	const char *text;
+	size_t length;
+
+	/* The sender of a chat line (empty otherwise), and the body as described for each type. */
+	const char *sender;
+	const char *body;
+};
+
+/* Starts connecting to atcd at a socket path, or at the default path if nullptr. The handshake finishes in the background and is reported as MATC_EVENT_READY. Returns the connection, or nullptr on failure. */
+struct matc *matc_connect(const char *path);
+
+/* Closes a connection, discarding anything not yet sent. */
+void matc_close(struct matc *conn);
+
+/* Gets the socket, to wait on. */
+int matc_get_fd(const struct matc *conn);
+
+/* Gets the readiness to wait for on the socket: always MATC_WANT_READ, plus MATC_WANT_WRITE while queued packets are held up by a full socket. */
+unsigned int matc_wants(const struct matc *conn);
+
+/* Checks whether packets already received are waiting to be handed out by matc_next_event(), in which case the socket may not become readable again for them. */
+bool matc_pending(const struct matc *conn);
+
+/* Gets which planes commands may be given to, as one bit per plane letter (a to z, then A to Z): all of them until the server says which are in the game. */
+uint64_t matc_planes(const struct matc *conn);
+
+/* Checks whether the server has accepted us. */
+bool matc_is_ready(const struct matc *conn);
+
+/* Queues a game command (without the trailing newline). Returns true on success, false with errno=EINVAL if it is not a complete command, ESRCH if its plane is not in the game, or ENOBUFS if the queue is full. */
+bool matc_send_command(struct matc *conn, const char *command);
+
+/* Queues a game command as matc_send_command() does, tagged for atcd's tracing (atcd --trace) with a nonzero trace ID and the time its key was pressed, in nanoseconds on CLOCK_MONOTONIC. */
+bool matc_send_traced_command(struct matc *conn, const char *command, uint64_t trace, uint64_t keystroke);
+
+/* Queues a chat line. Returns true on success, false with errno=EMSGSIZE if it is too long, or ENOBUFS if the queue is full. */
+bool matc_send_chat(struct matc *conn, const char *text);
+
+/* Queues a server command (without the leading "//"). Returns true on success, false with errno=EMSGSIZE if it is too long, or ENOBUFS if the queue is full. */
+bool matc_send_server(struct matc *conn, const char *command);
+
+/* Queues a key passed straight to the game: space (to go on at the end of a game) or Control-L (to redraw). Returns true on success, false with errno=EINVAL for any other key, or ENOBUFS if the queue is full. */
+bool matc_send_key(struct matc *conn, char key);
+
+/* Sends as much of the queue as the socket will take. Returns true on success (even if some is left), false on failure. */
+bool matc_flush(struct matc *conn);
+
+/* Gets the next event. Returns 1 if there was one, 0 if none has arrived yet, or -1 on failure, with errno=ECONNRESET if the server closed the connection, EACCES if it refused us, or EPROTONOSUPPORT if it does not speak our protocol. */
+int matc_next_event(struct matc *conn, struct matc_event *event);
+
+/* Sends the queue and waits until an event arrives, for up to a timeout in milliseconds (negative to wait forever). Returns true if there may be an event, false on timeout or failure. */
+bool matc_wait(struct matc *conn, int timeout);
+
+#endif
@@ -248,7 +248,18 @@ static const struct fragment *find_fragment(const struct fragment * const *fragl
 
 
 
-bool parse_command(const char *readptr, char *writeptr, size_t writelen, bool *terminal) {
+plane_set plane_bit(char name) {
+	if (name >= 'a' && name <= 'z')
+		return UINT64_C(1) << (name - 'a');
+	else if (name >= 'A' && name <= 'Z')
+		return UINT64_C(1) << (name - 'A' + 26);
+	else
+		return 0;
+}
+
+
+
+bool parse_command(const char *readptr, plane_set planes, char *writeptr, size_t writelen, bool *terminal) {
 	/* An empty buffer is considered an error. */
 	if (!writelen)
 		return false;
@@ -272,6 +283,10 @@ bool parse_command(const char *readptr, char *writeptr, size_t writelen, bool *t
 		return true;
 	}
 
+	/* A command must be for a plane that is in the game. */
+	if (!(plane_bit(readptr[0]) & planes))
+		return false;
+
 	/* Iterate the characters in the input. */
 	const struct fragment * const *fraglist = root;
 	const struct fragment *fragptr = nullptr;
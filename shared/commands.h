@@ -0,0 +1,19 @@
+#if !defined COMMANDS_H
+#define COMMANDS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A set of planes, as one bit per plane letter (a to z, then A to Z), and the set of every plane. */
+typedef uint64_t plane_set;
+#define PLANES_ALL ((UINT64_C(1) << 52) - 1)
+
+/* Attempts to parse the command string, accepting commands only for planes in the given set (e.g. those in the air as the game reports them). On failure, returns false. On success, stores textual description into buffer (of size buflen), sets *terminal=true (if terminal is not nullptr) if the string is terminal or false if the string is syntactically valid but not finished, and returns true. */
+bool parse_command(const char *cmd, plane_set planes, char *buffer, size_t buflen, bool *terminal);
+
+/* Gets the bit for a plane letter, or 0 if the character is not one. */
+plane_set plane_bit(char name);
+
+#endif
+
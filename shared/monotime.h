@@ -0,0 +1,23 @@
+#if !defined MONOTIME_H
+#define MONOTIME_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Returns the current value of the monotonic clock, in nanoseconds. */
+static inline uint64_t monotime_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/* Converts a relative interval, in nanoseconds, to a timespec. */
+static inline struct timespec monotime_to_timespec(uint64_t ns) {
+	struct timespec ts = {
+		.tv_sec = (time_t) (ns / 1000000000u),
+		.tv_nsec = (long) (ns % 1000000000u),
+	};
+	return ts;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#if !defined PROBES_H
+#define PROBES_H
+
+/*
+ * Static tracepoints (USDT probes) that bpftrace, perf and SystemTap can
+ * attach to, e.g. "bpftrace -e 'usdt:./atcd/atcd:atcd:receive { ... }'".
+ * With <sys/sdt.h> (from SystemTap's development package) each probe is a
+ * single no-op instruction plus a note in the binary saying where its
+ * arguments are, so an unused probe costs next to nothing; without it,
+ * probes compile away. Arguments are evaluated either way, so they must be
+ * cheap and free of side effects.
+ */
+
+#if defined __has_include
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_AVAILABLE 1
+#endif
+#endif
+
+#if defined PROBES_AVAILABLE
+#define PROBE0(provider, name) STAP_PROBE(provider, name)
+#define PROBE1(provider, name, a) STAP_PROBE1(provider, name, a)
+#define PROBE2(provider, name, a, b) STAP_PROBE2(provider, name, a, b)
+#define PROBE3(provider, name, a, b, c) STAP_PROBE3(provider, name, a, b, c)
+#define PROBE4(provider, name, a, b, c, d) STAP_PROBE4(provider, name, a, b, c, d)
+#else
+#define PROBE0(provider, name) ((void) 0)
+#define PROBE1(provider, name, a) ((void) (a))
+#define PROBE2(provider, name, a, b) ((void) (a), (void) (b))
+#define PROBE3(provider, name, a, b, c) ((void) (a), (void) (b), (void) (c))
+#define PROBE4(provider, name, a, b, c, d) ((void) (a), (void) (b), (void) (c), (void) (d))
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+#if !defined RECORDING_H
+#define RECORDING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A recording is the magic string RECORDING_MAGIC followed by records. Each
+ * record is a varint giving the length of the rest of the record, then a type
+ * byte, a varint timestamp, a varint user ID and the payload. Timestamps are
+ * CLOCK_MONOTONIC nanoseconds, each stored as the difference from the previous
+ * record except in RECORD_SESSION, which stores the absolute value and starts
+ * a new run of differences. Varints are unsigned LEB128.
+ */
+#define RECORDING_MAGIC "MATCREC1"
+#define RECORDING_MAGIC_LENGTH 8
+
+enum record_type {
+	/* atcd opened the recording; the payload is a varint CLOCK_REALTIME timestamp in nanoseconds. */
+	RECORD_SESSION = 0,
+
+	/* A user joined or left; the payload is the username. */
+	RECORD_JOIN = 1,
+	RECORD_LEAVE = 2,
+
+	/* A user's input accepted for the game, a chat line or a server command; the payload is the text. */
+	RECORD_INPUT = 3,
+	RECORD_CHAT = 4,
+	RECORD_COMMAND = 5,
+
+	/* The game ended; there is no payload. */
+	RECORD_GAME_END = 6,
+
+	/* A game state event, as sent to clients that asked for them; the payload is the event. */
+	RECORD_STATE = 7,
+};
+
+/* The longest a varint can be. */
+#define VARINT_MAX 10
+
+/* Writes a varint to a buffer with room for VARINT_MAX bytes. Returns the number of bytes written. */
+static inline size_t varint_put(uint8_t *buffer, uint64_t value) {
+	size_t i = 0;
+	while (value >= 0x80) {
+		buffer[i++] = (uint8_t) (value | 0x80);
+		value >>= 7;
+	}
+	buffer[i++] = (uint8_t) value;
+	return i;
+}
+
+/* Reads a varint from a buffer of a given size. Returns the number of bytes read, or 0 if the buffer ends first or the varint is too long. */
+static inline size_t varint_get(const uint8_t *buffer, size_t size, uint64_t *value) {
+	uint64_t result = 0;
+	for (size_t i = 0; i < size && i < VARINT_MAX; i++) {
+		result |= (uint64_t) (buffer[i] & 0x7F) << (7 * i);
+		if (!(buffer[i] & 0x80)) {
+			*value = result;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#if !defined VCLOCK_H
+#define VCLOCK_H
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * The virtual clock that atcd runs a game by when it preloads the time shim
+ * into atc. It lives in a memfd that atcd maps and passes to atc as
+ * VCLOCK_FD. atcd moves the clock: the game's CLOCK_MONOTONIC reads as
+ * base_virtual plus rate times the real time since base_real, and
+ * CLOCK_REALTIME as that plus realtime_offset. atc arms its interval timer
+ * (ITIMER_REAL) in the page, and atcd sends it SIGALRM when the virtual
+ * clock reaches timer_due. All times are in nanoseconds.
+ */
+struct vclock {
+	/* Odd while atcd is changing the fields below it, and bumped after, so that readers can retry a torn read. */
+	atomic_uint sequence;
+	_Atomic uint64_t base_real, base_virtual, realtime_offset;
+	atomic_uint rate;
+
+	/* When the interval timer next expires (zero if disarmed) and its reload interval, in virtual time; written by both sides. */
+	_Atomic uint64_t timer_due, timer_interval;
+
+	/* atcd's own settings: the speed asked for (zero to step by hand), whether the game is held (paused), and the expiries delivered. */
+	atomic_uint speed;
+	atomic_bool held;
+	_Atomic uint64_t ticks;
+};
+
+/* The FD on which atc finds the clock, and the environment variable that says it is there. */
+#define VCLOCK_FD 3
+#define VCLOCK_ENV "ATCD_VCLOCK_FD"
+
+/* The signal atc sends atcd after arming its timer, so that atcd wakes up to time it. It is ignored by default, so it is harmless to anyone else. */
+#define VCLOCK_WAKE_SIGNAL SIGURG
+
+/* Reads the virtual CLOCK_MONOTONIC at a real CLOCK_MONOTONIC time. */
+static inline uint64_t vclock_read(const struct vclock *clock, uint64_t real) {
+	uint64_t virtual;
+	unsigned int seq;
+	do {
+		seq = atomic_load_explicit(&clock->sequence, memory_order_acquire);
+		uint64_t base_real = atomic_load_explicit(&clock->base_real, memory_order_relaxed);
+		virtual = atomic_load_explicit(&clock->base_virtual, memory_order_relaxed);
+		unsigned int rate = atomic_load_explicit(&clock->rate, memory_order_relaxed);
+		if (real > base_real)
+			virtual += (real - base_real) * rate;
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) || seq != atomic_load_explicit(&clock->sequence, memory_order_relaxed));
+	return virtual;
+}
+
+#endif